@@ -0,0 +1,165 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include <strings.h>
+
+#include "redistracker.h"
+
+/* ========================== Transfer accounting ==========================*/
+/* Per passkey uploaded/downloaded deltas, summed across every swarm the user
+ * announces in and credited in batches, so the web tier does not need a
+ * HINCRBY round trip per announce. Deltas are either flushed by a timer into
+ * the hash <accounting-prefix><passkey> (fields "uploaded" and "downloaded")
+ * or pulled with TRACKER.ACCOUNTING DRAIN when accounting-flush-ms is 0. */
+typedef struct UserDelta {
+  uint64_t uploaded;
+  uint64_t downloaded;
+} UserDelta;
+
+static RedisModuleDict *UserDeltas;
+
+void trackerAccount(RedisModuleString *passkey, uint64_t uploaded,
+                    uint64_t downloaded) {
+  if (uploaded == 0 && downloaded == 0) return;
+  UserDelta *ud = RedisModule_DictGet(UserDeltas, passkey, NULL);
+  if (ud == NULL) {
+    ud = RedisModule_Calloc(1, sizeof(*ud));
+    RedisModule_DictSet(UserDeltas, passkey, ud);
+  }
+  ud->uploaded += uploaded;
+  ud->downloaded += downloaded;
+}
+
+/* Client counters are cumulative for the session. The first time we see a
+ * peer we only take the baseline, unless the client says the session just
+ * started, so that a peer whose record expired is not credited twice. A
+ * counter that went backwards means the client restarted its session. */
+static uint64_t statDelta(uint64_t last, uint64_t now, int known) {
+  if (!known) return 0;
+  return now >= last ? now - last : now;
+}
+
+void updatePeerStats(peer *p, RedisModuleString *passkey, int event,
+                     uint64_t uploaded, uint64_t downloaded, uint64_t left) {
+  int known = p->has_stats || event == TRACKER_EVENT_STARTED;
+  uint64_t last_up = p->has_stats ? p->uploaded : 0;
+  uint64_t last_down = p->has_stats ? p->downloaded : 0;
+  if (tracker_config.accounting) {
+    trackerAccount(passkey, statDelta(last_up, uploaded, known),
+                   statDelta(last_down, downloaded, known));
+  }
+  p->has_stats = 1;
+  p->uploaded = uploaded;
+  p->downloaded = downloaded;
+  p->left = left;
+}
+
+/* Credit up to 'batch' users into their hashes. Returns how many are left. */
+static uint64_t flushUserDeltas(RedisModuleCtx *ctx, long long batch) {
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(UserDeltas, "^", NULL, 0);
+  RedisModuleString *passkey;
+  UserDelta *ud;
+  while (batch-- > 0 &&
+         (passkey = RedisModule_DictNext(ctx, iter, (void **)&ud)) != NULL) {
+    /* Passkeys may hold NUL bytes, so they are appended by length. */
+    size_t pklen;
+    const char *pk = RedisModule_StringPtrLen(passkey, &pklen);
+    RedisModuleString *key =
+        RedisModule_CreateString(ctx, tracker_config.accounting_prefix,
+                                 strlen(tracker_config.accounting_prefix));
+    RedisModule_StringAppendBuffer(ctx, key, pk, pklen);
+    RedisModuleCallReply *reply;
+    if (ud->uploaded) {
+      reply = RedisModule_Call(ctx, "HINCRBY", "!scl", key, "uploaded",
+                               (long long)ud->uploaded);
+      if (reply) RedisModule_FreeCallReply(reply);
+    }
+    if (ud->downloaded) {
+      reply = RedisModule_Call(ctx, "HINCRBY", "!scl", key, "downloaded",
+                               (long long)ud->downloaded);
+      if (reply) RedisModule_FreeCallReply(reply);
+    }
+    RedisModule_FreeString(ctx, key);
+    RedisModule_DictDel(UserDeltas, passkey, NULL);
+    RedisModule_DictIteratorReseek(iter, ">", passkey);
+    RedisModule_FreeString(ctx, passkey);
+    RedisModule_Free(ud);
+  }
+  RedisModule_DictIteratorStop(iter);
+  return RedisModule_DictSize(UserDeltas);
+}
+
+static void accountingTimerHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  mstime_t period = tracker_config.accounting_flush_ms;
+  if (period > 0 && RedisModule_DictSize(UserDeltas) &&
+      !(RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_SLAVE)) {
+    /* Come back right away while a backlog remains, rather than crediting
+     * everybody in one long event loop iteration. */
+    if (flushUserDeltas(ctx, tracker_config.accounting_flush_batch)) {
+      period = 1;
+    }
+  }
+  if (period == 0) period = 1000;
+  RedisModule_CreateTimer(ctx, period, accountingTimerHandler, NULL);
+}
+
+void trackerAccountingInit(RedisModuleCtx *ctx) {
+  UserDeltas = RedisModule_CreateDict(NULL);
+  mstime_t period = tracker_config.accounting_flush_ms;
+  RedisModule_CreateTimer(ctx, period ? period : 1000, accountingTimerHandler,
+                          NULL);
+}
+
+/* TRACKER.ACCOUNTING DRAIN [COUNT <n>]
+ *   -> flat array of <passkey> <uploaded> <downloaded>, removed from the
+ *      pending table
+ * TRACKER.ACCOUNTING FLUSH
+ *   -> credit everything pending into the per user hashes now
+ * TRACKER.ACCOUNTING PENDING
+ *   -> number of users with pending deltas */
+int RedisTrackerAccounting_RedisCommand(RedisModuleCtx *ctx,
+                                        RedisModuleString **argv, int argc) {
+  if (argc < 2) return RedisModule_WrongArity(ctx);
+  const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+  if (!strcasecmp(sub, "drain")) {
+    long long count = RedisModule_DictSize(UserDeltas);
+    if (argc == 4 &&
+        !strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "count")) {
+      if (RedisModule_StringToLongLong(argv[3], &count) == REDISMODULE_ERR ||
+          count < 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid COUNT");
+      }
+    } else if (argc != 2) {
+      return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+    }
+    RedisModuleDictIter *iter =
+        RedisModule_DictIteratorStartC(UserDeltas, "^", NULL, 0);
+    RedisModuleString *passkey;
+    UserDelta *ud;
+    long len = 0;
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    while (count-- > 0 &&
+           (passkey = RedisModule_DictNext(ctx, iter, (void **)&ud)) != NULL) {
+      RedisModule_ReplyWithString(ctx, passkey);
+      RedisModule_ReplyWithLongLong(ctx, (long long)ud->uploaded);
+      RedisModule_ReplyWithLongLong(ctx, (long long)ud->downloaded);
+      len += 3;
+      RedisModule_DictDel(UserDeltas, passkey, NULL);
+      RedisModule_DictIteratorReseek(iter, ">", passkey);
+      RedisModule_FreeString(ctx, passkey);
+      RedisModule_Free(ud);
+    }
+    RedisModule_DictIteratorStop(iter);
+    RedisModule_ReplySetArrayLength(ctx, len);
+    return REDISMODULE_OK;
+  }
+  if (!strcasecmp(sub, "flush") && argc == 2) {
+    flushUserDeltas(ctx, RedisModule_DictSize(UserDeltas));
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+  if (!strcasecmp(sub, "pending") && argc == 2) {
+    return RedisModule_ReplyWithLongLong(ctx, RedisModule_DictSize(UserDeltas));
+  }
+  return RedisModule_ReplyWithError(ctx, "ERR unknown subcommand or wrong "
+                                         "number of arguments");
+}
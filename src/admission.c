@@ -0,0 +1,259 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include <strings.h>
+
+#include "redistracker.h"
+
+/* ========================== String hash set ==============================*/
+/* Open addressing with linear probing. Announce only ever asks "is this
+ * passkey/info_hash in the set", so a flat table of (hash, key) beats the
+ * radix tree behind RedisModuleDict by a wide margin on lookups. */
+#define TRACKER_SET_MIN_SIZE 16
+#define TRACKER_SET_TOMBSTONE ((char *)1)
+
+typedef struct TrackerSetEntry {
+  uint64_t hash;
+  size_t len;
+  char *key; /* NULL for never used slots, TRACKER_SET_TOMBSTONE if deleted */
+} TrackerSetEntry;
+
+struct TrackerSet {
+  TrackerSetEntry *table;
+  size_t size; /* power of two */
+  size_t used;
+  size_t deleted;
+};
+
+TrackerSet *trackerSetCreate(void) {
+  TrackerSet *s = RedisModule_Alloc(sizeof(*s));
+  s->size = TRACKER_SET_MIN_SIZE;
+  s->table = RedisModule_Calloc(s->size, sizeof(TrackerSetEntry));
+  s->used = 0;
+  s->deleted = 0;
+  return s;
+}
+
+static void trackerSetFreeKeys(TrackerSet *s) {
+  for (size_t i = 0; i < s->size; i++) {
+    char *key = s->table[i].key;
+    if (key && key != TRACKER_SET_TOMBSTONE) RedisModule_Free(key);
+  }
+}
+
+void trackerSetRelease(TrackerSet *s) {
+  if (!s) return;
+  trackerSetFreeKeys(s);
+  RedisModule_Free(s->table);
+  RedisModule_Free(s);
+}
+
+void trackerSetClear(TrackerSet *s) {
+  trackerSetFreeKeys(s);
+  RedisModule_Free(s->table);
+  s->size = TRACKER_SET_MIN_SIZE;
+  s->table = RedisModule_Calloc(s->size, sizeof(TrackerSetEntry));
+  s->used = 0;
+  s->deleted = 0;
+}
+
+size_t trackerSetSize(TrackerSet *s) { return s->used; }
+
+/* Returns the slot holding key, or the first free slot of its probe chain
+ * (preferring a tombstone) when the key is not there. */
+static TrackerSetEntry *trackerSetFind(TrackerSet *s, const char *key,
+                                       size_t len, uint64_t hash) {
+  size_t mask = s->size - 1;
+  TrackerSetEntry *tomb = NULL;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    TrackerSetEntry *e = &s->table[i];
+    if (e->key == NULL) return tomb ? tomb : e;
+    if (e->key == TRACKER_SET_TOMBSTONE) {
+      if (!tomb) tomb = e;
+    } else if (e->hash == hash && e->len == len &&
+               !memcmp(e->key, key, len)) {
+      return e;
+    }
+  }
+}
+
+static void trackerSetResize(TrackerSet *s, size_t size) {
+  TrackerSetEntry *old = s->table;
+  size_t oldsize = s->size;
+  s->size = size;
+  s->table = RedisModule_Calloc(size, sizeof(TrackerSetEntry));
+  s->deleted = 0;
+  for (size_t i = 0; i < oldsize; i++) {
+    if (old[i].key == NULL || old[i].key == TRACKER_SET_TOMBSTONE) continue;
+    size_t mask = size - 1;
+    size_t j = old[i].hash & mask;
+    while (s->table[j].key) j = (j + 1) & mask;
+    s->table[j] = old[i];
+  }
+  RedisModule_Free(old);
+}
+
+int trackerSetContains(TrackerSet *s, const char *key, size_t len) {
+  if (s->used == 0) return 0;
+  uint64_t hash = trackerHash64(key, len, 0);
+  TrackerSetEntry *e = trackerSetFind(s, key, len, hash);
+  return e->key != NULL && e->key != TRACKER_SET_TOMBSTONE;
+}
+
+/* Returns 1 if the key was added, 0 if it was already there. */
+int trackerSetAdd(TrackerSet *s, const char *key, size_t len) {
+  if ((s->used + s->deleted + 1) * 4 > s->size * 3) {
+    size_t size = s->size;
+    while ((s->used + 1) * 2 > size) size *= 2;
+    trackerSetResize(s, size);
+  }
+  uint64_t hash = trackerHash64(key, len, 0);
+  TrackerSetEntry *e = trackerSetFind(s, key, len, hash);
+  if (e->key != NULL && e->key != TRACKER_SET_TOMBSTONE) return 0;
+  if (e->key == TRACKER_SET_TOMBSTONE) s->deleted--;
+  e->hash = hash;
+  e->len = len;
+  e->key = RedisModule_Alloc(len ? len : 1);
+  memcpy(e->key, key, len);
+  s->used++;
+  return 1;
+}
+
+/* Returns 1 if the key was removed, 0 if it was not there. */
+int trackerSetDel(TrackerSet *s, const char *key, size_t len) {
+  if (s->used == 0) return 0;
+  uint64_t hash = trackerHash64(key, len, 0);
+  TrackerSetEntry *e = trackerSetFind(s, key, len, hash);
+  if (e->key == NULL || e->key == TRACKER_SET_TOMBSTONE) return 0;
+  RedisModule_Free(e->key);
+  e->key = TRACKER_SET_TOMBSTONE;
+  s->used--;
+  s->deleted++;
+  return 1;
+}
+
+/* ========================== Admission filters ============================*/
+/* Passkeys and info_hashes are checked against these sets before announce
+ * opens the key, so junk never allocates a swarm. The sets are not
+ * persisted: the web tier owns them and bulk loads them with
+ * TRACKER.PASSKEY / TRACKER.INFOHASH after a restart. */
+static TrackerSet *ValidPasskeys;
+static TrackerSet *BlockedPasskeys;
+static TrackerSet *AllowedInfohashes;
+
+void trackerAdmissionInit(void) {
+  ValidPasskeys = trackerSetCreate();
+  BlockedPasskeys = trackerSetCreate();
+  AllowedInfohashes = trackerSetCreate();
+}
+
+const char *trackerAdmit(RedisModuleString *info_hash,
+                         RedisModuleString *passkey) {
+  size_t len;
+  const char *s = RedisModule_StringPtrLen(passkey, &len);
+  if (trackerSetContains(BlockedPasskeys, s, len)) {
+    return "ERR passkey is blocked";
+  }
+  if (tracker_config.passkey_filter &&
+      !trackerSetContains(ValidPasskeys, s, len)) {
+    return "ERR unregistered passkey";
+  }
+  if (tracker_config.infohash_filter) {
+    /* Sub-swarms are admitted as their torrent. */
+    s = RedisModule_StringPtrLen(info_hash, &len);
+    size_t taglen = trackerShardTag(s, len, NULL);
+    s += taglen;
+    len -= taglen;
+    if (!trackerSetContains(AllowedInfohashes, s, len)) {
+      return "ERR unregistered torrent";
+    }
+  }
+  return NULL;
+}
+
+/* Shared by TRACKER.PASSKEY and TRACKER.INFOHASH:
+ *   ADD <item> [<item> ...]     -> number of items added
+ *   DEL <item> [<item> ...]     -> number of items removed
+ *   EXISTS <item>               -> 0 / 1
+ *   COUNT                       -> set size
+ *   RESET                       -> drop everything, e.g. before a bulk load */
+static int trackerSetCommand(RedisModuleCtx *ctx, TrackerSet *set,
+                             const char *sub, RedisModuleString **items,
+                             int nitems) {
+  if (!strcasecmp(sub, "add") || !strcasecmp(sub, "del")) {
+    if (nitems < 1) return RedisModule_WrongArity(ctx);
+    int add = !strcasecmp(sub, "add");
+    long long changed = 0;
+    for (int j = 0; j < nitems; j++) {
+      size_t len;
+      const char *s = RedisModule_StringPtrLen(items[j], &len);
+      changed +=
+          add ? trackerSetAdd(set, s, len) : trackerSetDel(set, s, len);
+    }
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithLongLong(ctx, changed);
+  }
+  if (!strcasecmp(sub, "exists")) {
+    if (nitems != 1) return RedisModule_WrongArity(ctx);
+    size_t len;
+    const char *s = RedisModule_StringPtrLen(items[0], &len);
+    return RedisModule_ReplyWithLongLong(ctx,
+                                         trackerSetContains(set, s, len));
+  }
+  if (!strcasecmp(sub, "count")) {
+    if (nitems != 0) return RedisModule_WrongArity(ctx);
+    return RedisModule_ReplyWithLongLong(ctx, trackerSetSize(set));
+  }
+  if (!strcasecmp(sub, "reset")) {
+    if (nitems != 0) return RedisModule_WrongArity(ctx);
+    trackerSetClear(set);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+  return RedisModule_ReplyWithError(ctx, "ERR unknown subcommand");
+}
+
+/* TRACKER.PASSKEY ADD|DEL|EXISTS|COUNT|RESET [<passkey> ...]
+ * TRACKER.PASSKEY BLOCK|UNBLOCK|BLOCKED|BLOCKCOUNT|BLOCKRESET [<passkey> ...]
+ *
+ * The first group edits the registered passkeys, only enforced when
+ * passkey-filter is on. The second group edits the block list, which is
+ * always enforced. */
+int RedisTrackerPasskey_RedisCommand(RedisModuleCtx *ctx,
+                                     RedisModuleString **argv, int argc) {
+  if (argc < 2) return RedisModule_WrongArity(ctx);
+  const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+  if (!strcasecmp(sub, "block")) {
+    return trackerSetCommand(ctx, BlockedPasskeys, "add", argv + 2, argc - 2);
+  } else if (!strcasecmp(sub, "unblock")) {
+    return trackerSetCommand(ctx, BlockedPasskeys, "del", argv + 2, argc - 2);
+  } else if (!strcasecmp(sub, "blocked")) {
+    return trackerSetCommand(ctx, BlockedPasskeys, "exists", argv + 2,
+                             argc - 2);
+  } else if (!strcasecmp(sub, "blockcount")) {
+    return trackerSetCommand(ctx, BlockedPasskeys, "count", argv + 2,
+                             argc - 2);
+  } else if (!strcasecmp(sub, "blockreset")) {
+    return trackerSetCommand(ctx, BlockedPasskeys, "reset", argv + 2,
+                             argc - 2);
+  }
+  return trackerSetCommand(ctx, ValidPasskeys, sub, argv + 2, argc - 2);
+}
+
+/* TRACKER.INFOHASH ADD|DEL|EXISTS|COUNT|RESET [<info_hash> ...]
+ *
+ * Edits the torrent allowlist, only enforced when infohash-filter is on.
+ * The info_hashes are stored the way ANNOUNCE keys swarms. */
+int RedisTrackerInfohash_RedisCommand(RedisModuleCtx *ctx,
+                                      RedisModuleString **argv, int argc) {
+  if (argc < 2) return RedisModule_WrongArity(ctx);
+  RedisModule_AutoMemory(ctx);
+  const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+  RedisModuleString **items =
+      RedisModule_PoolAlloc(ctx, (argc - 1) * sizeof(*items));
+  for (int j = 2; j < argc; j++) {
+    items[j - 2] = trackerInfohashKey(ctx, argv[j]);
+    if (items[j - 2] == NULL) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid info_hash");
+    }
+  }
+  return trackerSetCommand(ctx, AllowedInfohashes, sub, items, argc - 2);
+}
@@ -0,0 +1,284 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include <limits.h>
+#include <strings.h>
+
+#include "redistracker.h"
+
+/* ========================== Module configuration ==========================*/
+TrackerConfig tracker_config = {
+    .repl_coalesce = 0,
+    .passkey_filter = 0,
+    .infohash_filter = 0,
+    .accounting = 0,
+    .accounting_flush_ms = 1000,
+    .accounting_flush_batch = 1000,
+    .accounting_prefix = "tracker:user:",
+    .min_interval = 0,
+    .rate_limit_error = 0,
+    .offenders_max = 10000,
+    .announce_interval = 1800,
+    .numwant_default = 50,
+    .numwant_max = 200,
+    .udp_secret = "",
+    .udp_listen = "",
+    .snapshot_ms = 0,
+    .lazyfree_threshold = 64,
+    .restore_file = "",
+    .delta_channel = "",
+    .topk_size = 0,
+    .topk_halflife_ms = 60000,
+    .unique_peers = 0,
+    .locality_fraction = 0,
+    .pressure_level1 = 80,
+    .pressure_level2 = 85,
+    .pressure_level3 = 90,
+    .pressure_level4 = 95,
+    .pressure_generation_ttl = 600,
+    .pressure_max_peers = 1000,
+    .pressure_interval = 3600,
+    .announce_target_qps = 0,
+    .announce_interval_min = 300,
+    .announce_interval_max = 7200,
+    .announce_jitter = 0,
+    .trace_max_bytes = 1LL << 30,
+    .infohash_normalize = 0,
+    .swarm_table = 0,
+    .slowlog_log_slower_than = 10000,
+    .slowlog_max_len = 128,
+    .shard_threshold = 0,
+    .shard_count = 8,
+    .shard_digest_peers = 50,
+    .shard_digest_ms = 1000,
+};
+
+#define CONFIG_NUMERIC 0
+#define CONFIG_BOOL 1
+#define CONFIG_STRING 2
+
+typedef struct ConfigOption {
+  const char *name;
+  int type;
+  long long *value; /* CONFIG_NUMERIC and CONFIG_BOOL */
+  char **str;       /* CONFIG_STRING */
+  long long min;
+  long long max;
+  int owned; /* *str was allocated by us rather than being the default */
+  int immutable; /* only read at load, SET refuses it */
+} ConfigOption;
+
+#define BOOL_OPTION(name, field) \
+  { name, CONFIG_BOOL, &tracker_config.field, NULL, 0, 1, 0, 0 }
+#define IMMUTABLE_BOOL_OPTION(name, field) \
+  { name, CONFIG_BOOL, &tracker_config.field, NULL, 0, 1, 0, 1 }
+#define NUMERIC_OPTION(name, field, min, max) \
+  { name, CONFIG_NUMERIC, &tracker_config.field, NULL, min, max, 0, 0 }
+#define STRING_OPTION(name, field) \
+  { name, CONFIG_STRING, NULL, &tracker_config.field, 0, 0, 0, 0 }
+#define IMMUTABLE_STRING_OPTION(name, field) \
+  { name, CONFIG_STRING, NULL, &tracker_config.field, 0, 0, 0, 1 }
+
+static ConfigOption configOptions[] = {
+    BOOL_OPTION("repl-coalesce", repl_coalesce),
+    BOOL_OPTION("passkey-filter", passkey_filter),
+    BOOL_OPTION("infohash-filter", infohash_filter),
+    BOOL_OPTION("accounting", accounting),
+    NUMERIC_OPTION("accounting-flush-ms", accounting_flush_ms, 0, 3600000),
+    NUMERIC_OPTION("accounting-flush-batch", accounting_flush_batch, 1,
+                   1000000),
+    STRING_OPTION("accounting-prefix", accounting_prefix),
+    NUMERIC_OPTION("min-interval", min_interval, 0, 86400),
+    BOOL_OPTION("rate-limit-error", rate_limit_error),
+    NUMERIC_OPTION("offenders-max", offenders_max, 0, 10000000),
+    NUMERIC_OPTION("announce-interval", announce_interval, 1, 86400),
+    NUMERIC_OPTION("numwant-default", numwant_default, 0, 10000),
+    NUMERIC_OPTION("numwant-max", numwant_max, 0, 10000),
+    STRING_OPTION("udp-secret", udp_secret),
+    IMMUTABLE_STRING_OPTION("udp-listen", udp_listen),
+    NUMERIC_OPTION("snapshot-ms", snapshot_ms, 0, 60000),
+    NUMERIC_OPTION("lazyfree-threshold", lazyfree_threshold, 0, 1000000000),
+    IMMUTABLE_STRING_OPTION("restore-file", restore_file),
+    STRING_OPTION("delta-channel", delta_channel),
+    NUMERIC_OPTION("topk-size", topk_size, 0, 10000),
+    NUMERIC_OPTION("topk-halflife-ms", topk_halflife_ms, 1000, 86400000),
+    BOOL_OPTION("unique-peers", unique_peers),
+    NUMERIC_OPTION("locality-fraction", locality_fraction, 0, 100),
+    NUMERIC_OPTION("pressure-level1", pressure_level1, 0, 100),
+    NUMERIC_OPTION("pressure-level2", pressure_level2, 0, 100),
+    NUMERIC_OPTION("pressure-level3", pressure_level3, 0, 100),
+    NUMERIC_OPTION("pressure-level4", pressure_level4, 0, 100),
+    NUMERIC_OPTION("pressure-generation-ttl", pressure_generation_ttl, 60,
+                   TRACKER_KEY_TTL),
+    NUMERIC_OPTION("pressure-max-peers", pressure_max_peers, 1, 1000000),
+    NUMERIC_OPTION("pressure-interval", pressure_interval, 1, 86400),
+    NUMERIC_OPTION("announce-target-qps", announce_target_qps, 0, 10000000),
+    NUMERIC_OPTION("announce-interval-min", announce_interval_min, 1, 86400),
+    NUMERIC_OPTION("announce-interval-max", announce_interval_max, 1, 86400),
+    NUMERIC_OPTION("announce-jitter", announce_jitter, 0, 50),
+    NUMERIC_OPTION("trace-max-bytes", trace_max_bytes, 0, LLONG_MAX),
+    BOOL_OPTION("infohash-normalize", infohash_normalize),
+    IMMUTABLE_BOOL_OPTION("swarm-table", swarm_table),
+    NUMERIC_OPTION("slowlog-log-slower-than", slowlog_log_slower_than, -1,
+                   LLONG_MAX),
+    NUMERIC_OPTION("slowlog-max-len", slowlog_max_len, 0, 1000000),
+    NUMERIC_OPTION("shard-threshold", shard_threshold, 0, LLONG_MAX),
+    NUMERIC_OPTION("shard-count", shard_count, 2, TRACKER_SHARD_MAX),
+    NUMERIC_OPTION("shard-digest-peers", shard_digest_peers, 0, 200),
+    NUMERIC_OPTION("shard-digest-ms", shard_digest_ms, 100, 60000),
+    {NULL, 0, NULL, NULL, 0, 0, 0, 0},
+};
+
+static ConfigOption *lookupConfigOption(const char *name) {
+  for (ConfigOption *opt = configOptions; opt->name; opt++) {
+    if (!strcasecmp(opt->name, name)) return opt;
+  }
+  return NULL;
+}
+
+static int parseConfigValue(ConfigOption *opt, RedisModuleString *str,
+                            long long *res) {
+  if (opt->type == CONFIG_BOOL) {
+    size_t len;
+    const char *s = RedisModule_StringPtrLen(str, &len);
+    if (!strcasecmp(s, "yes")) {
+      *res = 1;
+      return REDISMODULE_OK;
+    }
+    if (!strcasecmp(s, "no")) {
+      *res = 0;
+      return REDISMODULE_OK;
+    }
+    return REDISMODULE_ERR;
+  }
+  if (RedisModule_StringToLongLong(str, res) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  if (*res < opt->min || *res > opt->max) {
+    return REDISMODULE_ERR;
+  }
+  return REDISMODULE_OK;
+}
+
+/* Rules spanning several options, NULL when they hold. Module arguments
+ * are only checked once all are in, so they can come in any order. */
+static const char *configConflict(RedisModuleCtx *ctx) {
+  /* Commands declare the info_hash they were sent as their key, the
+   * decoded one hashes to another slot. */
+  if (tracker_config.infohash_normalize &&
+      RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER) {
+    return "ERR infohash-normalize can't be used in cluster mode";
+  }
+  if (tracker_config.announce_interval_min >
+      tracker_config.announce_interval_max) {
+    return "ERR announce-interval-min is above announce-interval-max";
+  }
+  /* Levels add to the ones below, a higher one can't come first. */
+  long long levels[] = {
+      tracker_config.pressure_level1, tracker_config.pressure_level2,
+      tracker_config.pressure_level3, tracker_config.pressure_level4};
+  long long below = 0;
+  for (int l = 0; l < 4; l++) {
+    if (levels[l] == 0) continue;
+    if (levels[l] < below) {
+      return "ERR pressure levels must not decrease, except for 0";
+    }
+    below = levels[l];
+  }
+  return NULL;
+}
+
+/* Returns NULL, or the error when the value was not taken. */
+static const char *configSet(RedisModuleCtx *ctx, RedisModuleString *name,
+                             RedisModuleString *value, int loading) {
+  ConfigOption *opt = lookupConfigOption(RedisModule_StringPtrLen(name, NULL));
+  if (opt == NULL) return "ERR unknown tracker option or invalid value";
+  if (opt->immutable && !loading) {
+    return "ERR tracker option can only be set as a module argument";
+  }
+  if (opt->type == CONFIG_STRING) {
+    if (opt->owned) RedisModule_Free(*opt->str);
+    *opt->str = RedisModule_Strdup(RedisModule_StringPtrLen(value, NULL));
+    opt->owned = 1;
+    return NULL;
+  }
+  long long v, old = *opt->value;
+  if (parseConfigValue(opt, value, &v) == REDISMODULE_ERR) {
+    return "ERR unknown tracker option or invalid value";
+  }
+  *opt->value = v;
+  const char *err = loading ? NULL : configConflict(ctx);
+  if (err) {
+    *opt->value = old;
+  } else if (opt->value == &tracker_config.slowlog_max_len) {
+    trackerSlowlogResize();
+  }
+  return err;
+}
+
+/* Module arguments are "<name> <value>" pairs, the same names accepted by
+ * TRACKER.CONFIG SET, e.g.
+ *   loadmodule redistracker.so repl-coalesce yes */
+int trackerLoadConfig(RedisModuleCtx *ctx, RedisModuleString **argv,
+                      int argc) {
+  if (argc % 2) {
+    RedisModule_Log(ctx, "warning", "odd number of module arguments");
+    return REDISMODULE_ERR;
+  }
+  for (int i = 0; i < argc; i += 2) {
+    if (configSet(ctx, argv[i], argv[i + 1], 1)) {
+      RedisModule_Log(ctx, "warning", "invalid module argument '%s %s'",
+                      RedisModule_StringPtrLen(argv[i], NULL),
+                      RedisModule_StringPtrLen(argv[i + 1], NULL));
+      return REDISMODULE_ERR;
+    }
+  }
+  const char *err = configConflict(ctx);
+  if (err) {
+    RedisModule_Log(ctx, "warning", "invalid module arguments: %s", err + 4);
+    return REDISMODULE_ERR;
+  }
+  return REDISMODULE_OK;
+}
+
+static void replyWithConfigOption(RedisModuleCtx *ctx, ConfigOption *opt) {
+  RedisModule_ReplyWithCString(ctx, opt->name);
+  if (opt->type == CONFIG_BOOL) {
+    RedisModule_ReplyWithCString(ctx, *opt->value ? "yes" : "no");
+  } else if (opt->type == CONFIG_STRING) {
+    RedisModule_ReplyWithCString(ctx, *opt->str);
+  } else {
+    RedisModule_ReplyWithLongLong(ctx, *opt->value);
+  }
+}
+
+/* TRACKER.CONFIG GET <name|*>
+ * TRACKER.CONFIG SET <name> <value> */
+int RedisTrackerConfig_RedisCommand(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc) {
+  if (argc < 3) return RedisModule_WrongArity(ctx);
+  const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+  if (!strcasecmp(sub, "get") && argc == 3) {
+    const char *name = RedisModule_StringPtrLen(argv[2], NULL);
+    if (!strcmp(name, "*")) {
+      long len = 0;
+      RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+      for (ConfigOption *opt = configOptions; opt->name; opt++) {
+        replyWithConfigOption(ctx, opt);
+        len += 2;
+      }
+      RedisModule_ReplySetArrayLength(ctx, len);
+      return REDISMODULE_OK;
+    }
+    ConfigOption *opt = lookupConfigOption(name);
+    if (opt == NULL) return RedisModule_ReplyWithEmptyArray(ctx);
+    RedisModule_ReplyWithArray(ctx, 2);
+    replyWithConfigOption(ctx, opt);
+    return REDISMODULE_OK;
+  }
+  if (!strcasecmp(sub, "set") && argc == 4) {
+    const char *err = configSet(ctx, argv[2], argv[3], 0);
+    if (err) return RedisModule_ReplyWithError(ctx, err);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+  return RedisModule_ReplyWithError(ctx, "ERR unknown subcommand or wrong "
+                                         "number of arguments");
+}
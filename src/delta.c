@@ -0,0 +1,180 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include "redistracker.h"
+
+/* ========================== Swarm deltas =================================*/
+/* With delta-channel set, every swarm that changed during an event loop
+ * tick gets one message on <delta-channel><info_hash> at the end of it,
+ * listing what happened to it (format in redistracker.h), so edge caches
+ * can keep exact copies of the swarms they subscribed to.
+ *
+ * updateIP and detachPeer only note the passkey and the last operation in
+ * the swarm's pending delta; the peer itself is packed when the delta is
+ * sealed, so several announces of one peer in a tick cost one record that
+ * carries its final state. A generation rotation seals what is pending
+ * first, since replaying a peer update after the rotation would put the
+ * peer in the wrong generation. */
+typedef struct TrackerDelta {
+  RedisModuleDict *ops; /* passkey -> operation, since the last seal */
+  uint8_t *buf;         /* sealed records */
+  size_t len;
+  size_t cap;
+  char *key; /* key name, once queued */
+  size_t keylen;
+} TrackerDelta;
+
+/* Key name -> SeedersObj with a delta to publish. */
+static RedisModuleDict *DeltaQueue;
+static int DeltaScheduled;
+static long long DeltaMessages;
+static long long DeltaBytes;
+
+static TrackerDelta *deltaGet(SeedersObj *o) {
+  if (o->delta == NULL) o->delta = RedisModule_Calloc(1, sizeof(*o->delta));
+  return o->delta;
+}
+
+static uint8_t *deltaReserve(TrackerDelta *d, size_t len) {
+  if (d->len + len > d->cap) {
+    d->cap = d->cap * 2 > d->len + len ? d->cap * 2 : d->len + len + 64;
+    d->buf = RedisModule_Realloc(d->buf, d->cap);
+  }
+  uint8_t *p = d->buf + d->len;
+  d->len += len;
+  return p;
+}
+
+static peer *deltaLookupPeer(SeedersObj *o, const char *passkey, size_t len) {
+  peer *p = RedisModule_DictGetC(o->d[1]->table, (void *)passkey, len, NULL);
+  if (p == NULL) {
+    p = RedisModule_DictGetC(o->d[0]->table, (void *)passkey, len, NULL);
+  }
+  return p;
+}
+
+/* Packs the pending operations into records. */
+static void deltaSeal(SeedersObj *o) {
+  TrackerDelta *d = o->delta;
+  if (d->ops == NULL) return;
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(d->ops, "^", NULL, 0);
+  char *passkey;
+  size_t len;
+  void *op;
+  while ((passkey = RedisModule_DictNextC(iter, &len, &op))) {
+    if (len > UINT16_MAX) continue;
+    peer *p = NULL;
+    if ((uintptr_t)op == TRACKER_EFFECT_UPDATE) {
+      p = deltaLookupPeer(o, passkey, len);
+    }
+    uint8_t effect[TRACKER_EFFECT_MAX_LEN];
+    size_t elen = packEffect(
+        effect, p ? TRACKER_EFFECT_UPDATE : TRACKER_EFFECT_REMOVE, p);
+    uint8_t *rec = deltaReserve(d, 3 + len + elen);
+    rec[0] = TRACKER_DELTA_PEER;
+    rec[1] = len & 0xff;
+    rec[2] = len >> 8;
+    memcpy(rec + 3, passkey, len);
+    memcpy(rec + 3 + len, effect, elen);
+  }
+  RedisModule_DictIteratorStop(iter);
+  RedisModule_FreeDict(NULL, d->ops);
+  d->ops = NULL;
+}
+
+void trackerDeltaPeer(SeedersObj *o, RedisModuleString *passkey, int op) {
+  if (tracker_config.delta_channel[0] == '\0') return;
+  TrackerDelta *d = deltaGet(o);
+  if (d->ops == NULL) d->ops = RedisModule_CreateDict(NULL);
+  RedisModule_DictReplace(d->ops, passkey, (void *)(uintptr_t)op);
+}
+
+/* Called after seedersCompaction rotated the generations of o. */
+void trackerDeltaRotate(SeedersObj *o) {
+  if (tracker_config.delta_channel[0] == '\0') return;
+  TrackerDelta *d = deltaGet(o);
+  deltaSeal(o);
+  uint8_t *rec = deltaReserve(d, 9);
+  rec[0] = TRACKER_DELTA_ROTATE;
+  uint64_t when = o->d[1]->when_to_die;
+  for (int i = 0; i < 8; i++) rec[1 + i] = when >> (8 * i);
+}
+
+static void deltaFree(TrackerDelta *d) {
+  if (d->ops) RedisModule_FreeDict(NULL, d->ops);
+  RedisModule_Free(d->buf);
+  RedisModule_Free(d->key);
+  RedisModule_Free(d);
+}
+
+static void deltaFlush(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  DeltaScheduled = 0;
+  const char *prefix = tracker_config.delta_channel;
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(DeltaQueue, "^", NULL, 0);
+  char *key;
+  size_t keylen;
+  SeedersObj *o;
+  while ((key = RedisModule_DictNextC(iter, &keylen, (void **)&o))) {
+    deltaSeal(o);
+    TrackerDelta *d = o->delta;
+    o->delta = NULL;
+    if (d->len && prefix[0] != '\0') {
+      uint8_t seq[8];
+      uint64_t v = ++o->delta_seq;
+      for (int i = 0; i < 8; i++) seq[i] = v >> (8 * i);
+      RedisModuleString *channel =
+          RedisModule_CreateString(NULL, prefix, strlen(prefix));
+      RedisModule_StringAppendBuffer(NULL, channel, key, keylen);
+      RedisModuleString *msg =
+          RedisModule_CreateString(NULL, (const char *)seq, 8);
+      RedisModule_StringAppendBuffer(NULL, msg, (const char *)d->buf, d->len);
+      RedisModule_PublishMessage(ctx, channel, msg);
+      RedisModule_FreeString(NULL, channel);
+      RedisModule_FreeString(NULL, msg);
+      DeltaMessages++;
+      DeltaBytes += 8 + d->len;
+    }
+    deltaFree(d);
+  }
+  RedisModule_DictIteratorStop(iter);
+  RedisModule_FreeDict(NULL, DeltaQueue);
+  DeltaQueue = RedisModule_CreateDict(NULL);
+}
+
+/* Called once a command is done changing the swarm under keyname, queues
+ * whatever it recorded for the end of the tick. */
+void trackerDeltaTouch(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                       SeedersObj *o) {
+  TrackerDelta *d = o->delta;
+  if (d == NULL || d->key) return;
+  size_t len;
+  const char *key = RedisModule_StringPtrLen(keyname, &len);
+  d->key = RedisModule_Alloc(len ? len : 1);
+  memcpy(d->key, key, len);
+  d->keylen = len;
+  RedisModule_DictSetC(DeltaQueue, d->key, len, o);
+  if (!DeltaScheduled) {
+    RedisModule_CreateTimer(ctx, 0, deltaFlush, NULL);
+    DeltaScheduled = 1;
+  }
+}
+
+/* Forgets the pending delta of a swarm that is going away. */
+void trackerDeltaDrop(SeedersObj *o) {
+  TrackerDelta *d = o->delta;
+  if (d == NULL) return;
+  if (d->key) RedisModule_DictDelC(DeltaQueue, d->key, d->keylen, NULL);
+  deltaFree(d);
+  o->delta = NULL;
+}
+
+void trackerDeltaInit(void) { DeltaQueue = RedisModule_CreateDict(NULL); }
+
+void trackerDeltaInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "deltas");
+  RedisModule_InfoAddFieldLongLong(ctx, "delta_messages", DeltaMessages);
+  RedisModule_InfoAddFieldLongLong(ctx, "delta_bytes", DeltaBytes);
+  RedisModule_InfoAddFieldULongLong(ctx, "delta_pending_swarms",
+                                    RedisModule_DictSize(DeltaQueue));
+}
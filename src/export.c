@@ -0,0 +1,246 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS, fileno */
+#define REDISMODULE_EXPERIMENTAL_API
+#include <stdio.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "redistracker.h"
+
+/* ========================== Swarm export =================================*/
+/* TRACKER.EXPORT forks, and the child walks every swarm of the selected db
+ * into a sequential file (format in redistracker.h) while the parent keeps
+ * serving. The db number goes in the header so a restore puts the swarms
+ * back where they were. The child publishes its progress in a shared
+ * anonymous mapping and writes <path>.tmp, which the parent renames once the
+ * child exits cleanly. */
+typedef struct ExportProgress {
+  uint64_t swarms;
+  uint64_t peers;
+  uint64_t bytes;
+} ExportProgress;
+
+static struct {
+  int running;
+  char *path;
+  mstime_t started_at;
+  unsigned long long total_keys; /* keys of any type when the export began */
+  volatile ExportProgress *progress;
+  /* Last finished export. */
+  const char *last_status; /* "none", "ok" or "err" */
+  uint64_t last_swarms;
+  uint64_t last_peers;
+  mstime_t last_duration_ms;
+} Export = {.last_status = "none"};
+
+typedef struct ExportWriter {
+  FILE *fp;
+  volatile ExportProgress *progress;
+  int failed;
+} ExportWriter;
+
+static void exportWrite(ExportWriter *w, const void *buf, size_t len) {
+  if (w->failed) return;
+  if (fwrite(buf, 1, len, w->fp) != len) w->failed = 1;
+  w->progress->bytes += len;
+}
+
+static void exportU8(ExportWriter *w, uint8_t v) { exportWrite(w, &v, 1); }
+
+static void exportLE(ExportWriter *w, uint64_t v, int len) {
+  uint8_t buf[8];
+  for (int i = 0; i < len; i++) buf[i] = v >> (8 * i);
+  exportWrite(w, buf, len);
+}
+
+static void exportPeer(ExportWriter *w, int gen, const char *passkey,
+                       size_t len, peer *p) {
+  uint8_t flags = 0;
+  if (p->use_v4) flags |= TRACKER_EFFECT_HAS_V4;
+  if (p->use_v6) flags |= TRACKER_EFFECT_HAS_V6;
+  if (p->has_stats) flags |= TRACKER_EFFECT_HAS_STATS;
+  if (len > UINT16_MAX) len = UINT16_MAX;
+  exportU8(w, gen);
+  exportU8(w, flags);
+  exportLE(w, len, 2);
+  exportWrite(w, passkey, len);
+  if (p->use_v4) exportWrite(w, p->peer, 6);
+  if (p->use_v6) exportWrite(w, p->peer6, 18);
+  exportLE(w, p->last_announce, 8);
+  if (p->has_stats) {
+    exportLE(w, p->uploaded, 8);
+    exportLE(w, p->downloaded, 8);
+    exportLE(w, p->left, 8);
+  }
+  w->progress->peers++;
+}
+
+static void exportRecord(ExportWriter *w, const char *name, size_t keylen,
+                         SeedersObj *o) {
+  uint64_t npeers = RedisModule_DictSize(o->d[0]->table) +
+                    RedisModule_DictSize(o->d[1]->table);
+  exportU8(w, TRACKER_EXPORT_SWARM);
+  exportLE(w, keylen, 4);
+  exportWrite(w, name, keylen);
+  exportLE(w, o->expire_at, 8);
+  exportLE(w, o->d[0]->when_to_die, 8);
+  exportLE(w, o->d[1]->when_to_die, 8);
+  exportLE(w, npeers, 4);
+  for (int gen = 0; gen < 2; gen++) {
+    RedisModuleDictIter *iter =
+        RedisModule_DictIteratorStartC(o->d[gen]->table, "^", NULL, 0);
+    char *passkey;
+    size_t len;
+    peer *p;
+    while ((passkey = RedisModule_DictNextC(iter, &len, (void **)&p))) {
+      exportPeer(w, gen, passkey, len, p);
+    }
+    RedisModule_DictIteratorStop(iter);
+  }
+  w->progress->swarms++;
+}
+
+static void exportSwarm(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                        RedisModuleKey *key, void *privdata) {
+  REDISMODULE_NOT_USED(ctx);
+  SeedersObj *o = key ? trackerSwarmFromKey(key) : NULL;
+  if (o == NULL) return;
+  size_t keylen;
+  const char *name = RedisModule_StringPtrLen(keyname, &keylen);
+  exportRecord(privdata, name, keylen, o);
+}
+
+static void exportTableSwarm(SeedersObj *o, void *privdata) {
+  exportRecord(privdata, o->key, o->keylen, o);
+}
+
+/* Runs in the child, returns the exit code. */
+static int exportChild(RedisModuleCtx *ctx, const char *tmppath) {
+  ExportWriter w = {NULL, Export.progress, 0};
+  w.fp = fopen(tmppath, "w");
+  if (w.fp == NULL) return 1;
+  setvbuf(w.fp, NULL, _IOFBF, 1 << 20);
+  exportWrite(&w, TRACKER_EXPORT_MAGIC, 8);
+  exportLE(&w, RedisModule_Milliseconds(), 8);
+  exportLE(&w, RedisModule_GetSelectedDb(ctx), 4);
+  if (trackerTableEnabled()) {
+    size_t slot = 0;
+    do {
+      slot = trackerTableScan(slot, 1024, exportTableSwarm, &w);
+    } while (slot && !w.failed);
+  } else {
+    RedisModuleScanCursor *cursor = RedisModule_ScanCursorCreate();
+    while (RedisModule_Scan(ctx, cursor, exportSwarm, &w)) {
+      if (w.failed) break;
+    }
+    RedisModule_ScanCursorDestroy(cursor);
+  }
+  exportU8(&w, TRACKER_EXPORT_END);
+  exportLE(&w, w.progress->swarms, 8);
+  exportLE(&w, w.progress->peers, 8);
+  if (fflush(w.fp) || fsync(fileno(w.fp))) w.failed = 1;
+  if (fclose(w.fp)) w.failed = 1;
+  return w.failed;
+}
+
+static void exportDone(int exitcode, int bysignal, void *user_data) {
+  REDISMODULE_NOT_USED(user_data);
+  RedisModuleString *tmp = RedisModule_CreateStringPrintf(
+      NULL, "%s.tmp", Export.path);
+  const char *tmppath = RedisModule_StringPtrLen(tmp, NULL);
+  int ok = exitcode == 0 && !bysignal && rename(tmppath, Export.path) == 0;
+  if (!ok) unlink(tmppath);
+  RedisModule_FreeString(NULL, tmp);
+
+  Export.last_status = ok ? "ok" : "err";
+  Export.last_swarms = Export.progress->swarms;
+  Export.last_peers = Export.progress->peers;
+  Export.last_duration_ms = RedisModule_Milliseconds() - Export.started_at;
+  RedisModule_Log(NULL, ok ? "notice" : "warning",
+                  "tracker export to %s %s: %llu swarms, %llu peers in %lld ms",
+                  Export.path, ok ? "done" : "failed",
+                  (unsigned long long)Export.last_swarms,
+                  (unsigned long long)Export.last_peers,
+                  (long long)Export.last_duration_ms);
+  munmap((void *)Export.progress, sizeof(ExportProgress));
+  Export.progress = NULL;
+  Export.running = 0;
+}
+
+static int exportStatus(RedisModuleCtx *ctx) {
+  RedisModule_ReplyWithArray(ctx, 16);
+  RedisModule_ReplyWithCString(ctx, "running");
+  RedisModule_ReplyWithLongLong(ctx, Export.running);
+  RedisModule_ReplyWithCString(ctx, "path");
+  RedisModule_ReplyWithCString(ctx, Export.path ? Export.path : "");
+  RedisModule_ReplyWithCString(ctx, "swarms_done");
+  RedisModule_ReplyWithLongLong(
+      ctx, Export.running ? (long long)Export.progress->swarms : 0);
+  RedisModule_ReplyWithCString(ctx, "keys_total");
+  RedisModule_ReplyWithLongLong(ctx, Export.running ? Export.total_keys : 0);
+  RedisModule_ReplyWithCString(ctx, "bytes_written");
+  RedisModule_ReplyWithLongLong(
+      ctx, Export.running ? (long long)Export.progress->bytes : 0);
+  RedisModule_ReplyWithCString(ctx, "last_status");
+  RedisModule_ReplyWithCString(ctx, Export.last_status);
+  RedisModule_ReplyWithCString(ctx, "last_swarms");
+  RedisModule_ReplyWithLongLong(ctx, Export.last_swarms);
+  RedisModule_ReplyWithCString(ctx, "last_duration_ms");
+  RedisModule_ReplyWithLongLong(ctx, Export.last_duration_ms);
+  return REDISMODULE_OK;
+}
+
+/* TRACKER.EXPORT <path>
+ *   -> forks and writes every swarm of the current db to <path>
+ * TRACKER.EXPORT STATUS
+ *   -> progress of the running export and outcome of the last one */
+int RedisTrackerExport_RedisCommand(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc) {
+  if (argc != 2) return RedisModule_WrongArity(ctx);
+  const char *path = RedisModule_StringPtrLen(argv[1], NULL);
+  if (!strcasecmp(path, "status")) return exportStatus(ctx);
+  if (Export.running) {
+    return RedisModule_ReplyWithError(ctx, "ERR an export is in progress");
+  }
+  ExportProgress *progress =
+      mmap(NULL, sizeof(*progress), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (progress == MAP_FAILED) {
+    return RedisModule_ReplyWithError(ctx, "ERR can't map export progress");
+  }
+  memset(progress, 0, sizeof(*progress));
+  if (Export.path) RedisModule_Free(Export.path);
+  Export.path = RedisModule_Strdup(path);
+  Export.progress = progress;
+  Export.started_at = RedisModule_Milliseconds();
+  Export.total_keys = RedisModule_DbSize(ctx);
+
+  int pid = RedisModule_Fork(exportDone, NULL);
+  if (pid == 0) {
+    RedisModuleString *tmp =
+        RedisModule_CreateStringPrintf(ctx, "%s.tmp", Export.path);
+    RedisModule_ExitFromChild(
+        exportChild(ctx, RedisModule_StringPtrLen(tmp, NULL)));
+  }
+  if (pid == -1) {
+    munmap(progress, sizeof(*progress));
+    Export.progress = NULL;
+    return RedisModule_ReplyWithError(
+        ctx, "ERR can't fork, another child process may be active");
+  }
+  Export.running = 1;
+  return RedisModule_ReplyWithSimpleString(ctx, "Background export started");
+}
+
+void trackerExportInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "export");
+  RedisModule_InfoAddFieldLongLong(ctx, "export_in_progress", Export.running);
+  RedisModule_InfoAddFieldCString(ctx, "export_last_status",
+                                  (char *)Export.last_status);
+  RedisModule_InfoAddFieldULongLong(ctx, "export_last_swarms",
+                                    Export.last_swarms);
+  RedisModule_InfoAddFieldULongLong(ctx, "export_last_peers",
+                                    Export.last_peers);
+  RedisModule_InfoAddFieldLongLong(ctx, "export_last_duration_ms",
+                                   Export.last_duration_ms);
+}
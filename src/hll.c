@@ -0,0 +1,218 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include <math.h>
+
+#include "redistracker.h"
+
+/* ========================== Unique peers =================================*/
+/* HyperLogLog estimates of the distinct passkeys that announced, per swarm
+ * and over the whole tracker, for the current and the previous hour and
+ * day. The generations forget a peer half an hour after it left, these
+ * don't need to remember anybody.
+ *
+ * A swarm HLL has 2^10 registers (about 3% standard error) and starts
+ * sparse: a list of <register:10 rank:6> pairs, turned into a dense byte
+ * per register once it would no longer be smaller. The tracker wide one has
+ * 2^14 registers (under 1%) and is always dense. A window is rolled by the
+ * first announce that falls into the next one. */
+#define HLL_SWARM_P 10
+#define HLL_GLOBAL_P 14
+#define HLL_SPARSE_MAX 256 /* entries, 512 bytes against 1024 dense */
+
+typedef struct Hll {
+  uint8_t p;
+  uint8_t dense;
+  uint16_t sparse_len;
+  uint16_t sparse_cap;
+  void *regs; /* uint8_t[1 << p] when dense, uint16_t[sparse_cap] if not */
+} Hll;
+
+typedef struct HllWindow {
+  uint64_t epoch;  /* now / window length, of the current window */
+  uint64_t last;   /* estimate of the window before, 0 if it was empty */
+  Hll hll;
+} HllWindow;
+
+struct TrackerHll {
+  HllWindow hour;
+  HllWindow day;
+};
+
+static HllWindow GlobalHour = {0, 0, {HLL_GLOBAL_P, 1, 0, 0, NULL}};
+static HllWindow GlobalDay = {0, 0, {HLL_GLOBAL_P, 1, 0, 0, NULL}};
+static uint64_t HllSeed;
+
+static void hllClear(Hll *h) {
+  if (h->p == HLL_GLOBAL_P) {
+    if (h->regs == NULL) h->regs = RedisModule_Alloc(1 << h->p);
+    memset(h->regs, 0, 1 << h->p);
+    return;
+  }
+  RedisModule_Free(h->regs);
+  h->regs = NULL;
+  h->dense = 0;
+  h->sparse_len = h->sparse_cap = 0;
+}
+
+static void hllToDense(Hll *h) {
+  uint8_t *regs = RedisModule_Calloc(1, 1 << h->p);
+  uint16_t *sparse = h->regs;
+  for (uint16_t i = 0; i < h->sparse_len; i++) {
+    regs[sparse[i] >> 6] = sparse[i] & 63;
+  }
+  RedisModule_Free(sparse);
+  h->regs = regs;
+  h->dense = 1;
+}
+
+static void hllAdd(Hll *h, uint64_t hash) {
+  uint32_t idx = hash & ((1 << h->p) - 1);
+  uint64_t w = (hash >> h->p) | (1ULL << (64 - h->p));
+  uint8_t rank = __builtin_ctzll(w) + 1;
+  if (h->dense) {
+    uint8_t *regs = h->regs;
+    if (rank > regs[idx]) regs[idx] = rank;
+    return;
+  }
+  uint16_t *sparse = h->regs;
+  for (uint16_t i = 0; i < h->sparse_len; i++) {
+    if ((sparse[i] >> 6) != idx) continue;
+    if (rank > (sparse[i] & 63)) sparse[i] = idx << 6 | rank;
+    return;
+  }
+  if (h->sparse_len == HLL_SPARSE_MAX) {
+    hllToDense(h);
+    hllAdd(h, hash);
+    return;
+  }
+  if (h->sparse_len == h->sparse_cap) {
+    h->sparse_cap = h->sparse_cap ? h->sparse_cap * 2 : 8;
+    h->regs = sparse =
+        RedisModule_Realloc(sparse, h->sparse_cap * sizeof(*sparse));
+  }
+  sparse[h->sparse_len++] = idx << 6 | rank;
+}
+
+static uint64_t hllCount(const Hll *h) {
+  uint32_t m = 1 << h->p;
+  double sum = 0;
+  uint32_t zeros = 0;
+  if (h->dense) {
+    const uint8_t *regs = h->regs;
+    for (uint32_t i = 0; i < m; i++) {
+      sum += 1.0 / (double)(1ULL << regs[i]);
+      if (regs[i] == 0) zeros++;
+    }
+  } else {
+    /* Registers not in the list are zero. */
+    const uint16_t *sparse = h->regs;
+    zeros = m - h->sparse_len;
+    sum = zeros;
+    for (uint16_t i = 0; i < h->sparse_len; i++) {
+      sum += 1.0 / (double)(1ULL << (sparse[i] & 63));
+    }
+  }
+  double alpha = 0.7213 / (1 + 1.079 / m);
+  double e = alpha * m * m / sum;
+  if (e <= 2.5 * m && zeros) e = m * log((double)m / zeros);
+  return (uint64_t)(e + 0.5);
+}
+
+static void hllWindowRoll(HllWindow *w, uint64_t epoch) {
+  if (w->epoch == epoch) return;
+  w->last = w->epoch + 1 == epoch ? hllCount(&w->hll) : 0;
+  hllClear(&w->hll);
+  w->epoch = epoch;
+}
+
+static void hllWindowAdd(HllWindow *w, uint64_t epoch, uint64_t hash) {
+  hllWindowRoll(w, epoch);
+  hllAdd(&w->hll, hash);
+}
+
+/* Current and previous window estimates as of epoch, without rolling. */
+static void hllWindowGet(const HllWindow *w, uint64_t epoch, uint64_t *cur,
+                         uint64_t *last) {
+  if (w->epoch == epoch) {
+    *cur = hllCount(&w->hll);
+    *last = w->last;
+  } else {
+    *cur = 0;
+    *last = w->epoch + 1 == epoch ? hllCount(&w->hll) : 0;
+  }
+}
+
+static uint64_t hllHour(void) { return trackerMilliseconds() / 3600000; }
+static uint64_t hllDay(void) { return trackerMilliseconds() / 86400000; }
+
+void trackerHllAnnounce(SeedersObj *o, RedisModuleString *passkey) {
+  if (!tracker_config.unique_peers) return;
+  size_t len;
+  const char *pk = RedisModule_StringPtrLen(passkey, &len);
+  uint64_t hash = trackerHash64(pk, len, HllSeed);
+  uint64_t hour = hllHour(), day = hllDay();
+  if (o->hll == NULL) {
+    o->hll = RedisModule_Calloc(1, sizeof(*o->hll));
+    o->hll->hour.hll.p = o->hll->day.hll.p = HLL_SWARM_P;
+    o->hll->hour.epoch = hour;
+    o->hll->day.epoch = day;
+  }
+  hllWindowAdd(&o->hll->hour, hour, hash);
+  hllWindowAdd(&o->hll->day, day, hash);
+  hllWindowAdd(&GlobalHour, hour, hash);
+  hllWindowAdd(&GlobalDay, day, hash);
+}
+
+void trackerHllFree(struct TrackerHll *hll) {
+  if (hll == NULL) return;
+  RedisModule_Free(hll->hour.hll.regs);
+  RedisModule_Free(hll->day.hll.regs);
+  RedisModule_Free(hll);
+}
+
+static void replyWindows(RedisModuleCtx *ctx, const HllWindow *hour,
+                         const HllWindow *day) {
+  uint64_t cur_hour = 0, last_hour = 0, cur_day = 0, last_day = 0;
+  if (hour) hllWindowGet(hour, hllHour(), &cur_hour, &last_hour);
+  if (day) hllWindowGet(day, hllDay(), &cur_day, &last_day);
+  RedisModule_ReplyWithArray(ctx, 8);
+  RedisModule_ReplyWithCString(ctx, "hour");
+  RedisModule_ReplyWithLongLong(ctx, cur_hour);
+  RedisModule_ReplyWithCString(ctx, "last_hour");
+  RedisModule_ReplyWithLongLong(ctx, last_hour);
+  RedisModule_ReplyWithCString(ctx, "day");
+  RedisModule_ReplyWithLongLong(ctx, cur_day);
+  RedisModule_ReplyWithCString(ctx, "last_day");
+  RedisModule_ReplyWithLongLong(ctx, last_day);
+}
+
+/* TRACKER.UNIQUE [<info_hash>]
+ *   -> estimated distinct passkeys of the swarm, or of the whole tracker,
+ *      in the current and previous clock hour and UTC day */
+int RedisTrackerUnique_RedisCommand(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc) {
+  if (argc > 2) return RedisModule_WrongArity(ctx);
+  if (argc == 1) {
+    replyWindows(ctx, &GlobalHour, &GlobalDay);
+    return REDISMODULE_OK;
+  }
+  RedisModuleString *info_hash = trackerInfohashKey(ctx, argv[1]);
+  if (info_hash == NULL) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid info_hash");
+  }
+  SeedersObj *o = trackerLookupSwarm(ctx, info_hash);
+  if (o == NULL || o->hll == NULL) {
+    replyWindows(ctx, NULL, NULL);
+  } else {
+    replyWindows(ctx, &o->hll->hour, &o->hll->day);
+  }
+  if (info_hash != argv[1]) RedisModule_FreeString(ctx, info_hash);
+  return REDISMODULE_OK;
+}
+
+void trackerHllInit(void) {
+  RedisModule_GetRandomBytes((unsigned char *)&HllSeed, sizeof(HllSeed));
+  GlobalHour.epoch = hllHour();
+  GlobalDay.epoch = hllDay();
+  hllClear(&GlobalHour.hll);
+  hllClear(&GlobalDay.hll);
+}
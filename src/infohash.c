@@ -0,0 +1,146 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "redistracker.h"
+
+/* ========================== Info hash keys ===============================*/
+/* With infohash-normalize on, swarms are keyed by the raw 20 byte info_hash
+ * (32 bytes for a full v2 one) whatever form the frontend sent it in: raw,
+ * 40 / 64 hex digits, or URL-encoded as it appears in the announce query
+ * string. Half the key memory of hex keys, and half the bytes to hash.
+ *
+ * Commands still declare the info_hash as sent as their key, so cluster
+ * slot checks and ACL key patterns see that form while the swarm lives
+ * under the decoded one. The two hash to different slots, which is why
+ * normalization is refused in cluster mode; ACL key patterns have to match
+ * both forms, or none.
+ *
+ * Hex is tried first, then URL decoding when there is a '%', then raw. A
+ * raw 32 byte info_hash that happens to URL-decode into 20 bytes would be
+ * misread, which takes six well placed '%' in it.
+ *
+ * The {<base>:<k>} tag of a sub-swarm key is kept as is before the decoded
+ * info_hash, see shard.c. */
+#define INFOHASH_V1_LEN 20
+#define INFOHASH_V2_LEN 32
+#define INFOHASH_TAG_MAX 32
+
+static int hexNibble(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+#ifdef __SSE2__
+/* Decodes 32 hex digits into 16 bytes, returns 0 if any is not hex. */
+static int hexDecode32(const char *in, uint8_t *out) {
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i five = _mm_set1_epi8(5);
+  __m128i bytes[2];
+  for (int i = 0; i < 2; i++) {
+    __m128i c = _mm_loadu_si128((const __m128i *)(in + 16 * i));
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                                 _mm_set1_epi8('a'));
+    /* Unsigned x <= n is min(x, n) == x. */
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, nine), digit);
+    __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, five), alpha);
+    if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) {
+      return 0;
+    }
+    __m128i v = _mm_or_si128(
+        _mm_and_si128(is_digit, digit),
+        _mm_andnot_si128(is_digit,
+                         _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+    /* Each 16 bit lane holds <high nibble, low nibble>, fold them into the
+     * low byte. */
+    __m128i hi = _mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0xf0));
+    __m128i lo = _mm_srli_epi16(v, 8);
+    bytes[i] = _mm_or_si128(hi, lo);
+  }
+  _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(bytes[0], bytes[1]));
+  return 1;
+}
+#endif
+
+/* Decodes len hex digits, len even, into len / 2 bytes. */
+static int hexDecode(const char *in, size_t len, uint8_t *out) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 32 <= len; i += 32) {
+    if (!hexDecode32(in + i, out + i / 2)) return 0;
+  }
+#endif
+  for (; i < len; i += 2) {
+    int hi = hexNibble(in[i]), lo = hexNibble(in[i + 1]);
+    if (hi < 0 || lo < 0) return 0;
+    out[i / 2] = hi << 4 | lo;
+  }
+  return 1;
+}
+
+/* Percent-decodes in, returns the decoded length or 0 if it is malformed or
+ * longer than cap. */
+static size_t urlDecode(const char *in, size_t len, uint8_t *out,
+                        size_t cap) {
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (n == cap) return 0;
+    if (in[i] != '%') {
+      out[n++] = in[i];
+      continue;
+    }
+    if (i + 2 >= len) return 0;
+    int hi = hexNibble(in[i + 1]), lo = hexNibble(in[i + 2]);
+    if (hi < 0 || lo < 0) return 0;
+    out[n++] = hi << 4 | lo;
+    i += 2;
+  }
+  return n;
+}
+
+/* Length of the leading {...} tag of s, 0 if there is none. */
+static size_t tagLen(const char *s, size_t len) {
+  if (len == 0 || s[0] != '{') return 0;
+  for (size_t i = 1; i < len && i < INFOHASH_TAG_MAX; i++) {
+    if (s[i] == '}') return i + 1;
+  }
+  return 0;
+}
+
+/* Returns the key of the swarm of info_hash: info_hash itself when it is
+ * already raw or infohash-normalize is off, a string created in ctx if it
+ * had to be decoded, or NULL when it is no info_hash in any form. */
+RedisModuleString *trackerInfohashKey(RedisModuleCtx *ctx,
+                                      RedisModuleString *info_hash) {
+  if (!tracker_config.infohash_normalize) return info_hash;
+  size_t len;
+  const char *s = RedisModule_StringPtrLen(info_hash, &len);
+  uint8_t raw[INFOHASH_V2_LEN + INFOHASH_TAG_MAX];
+  /* A raw info_hash may start with something looking like a tag, so it is
+   * tried whole too. */
+  size_t taglen = tagLen(s, len);
+  for (;;) {
+    const char *hash = s + taglen;
+    size_t hashlen = len - taglen, rawlen = 0;
+    if ((hashlen == 2 * INFOHASH_V1_LEN || hashlen == 2 * INFOHASH_V2_LEN) &&
+        hexDecode(hash, hashlen, raw + taglen)) {
+      rawlen = hashlen / 2;
+    } else if (memchr(hash, '%', hashlen)) {
+      rawlen = urlDecode(hash, hashlen, raw + taglen, INFOHASH_V2_LEN);
+      if (rawlen != INFOHASH_V1_LEN && rawlen != INFOHASH_V2_LEN) rawlen = 0;
+    }
+    if (rawlen) {
+      memcpy(raw, s, taglen);
+      return RedisModule_CreateString(ctx, (char *)raw, taglen + rawlen);
+    }
+    if (hashlen == INFOHASH_V1_LEN || hashlen == INFOHASH_V2_LEN) {
+      return info_hash;
+    }
+    if (taglen == 0) return NULL;
+    taglen = 0;
+  }
+}
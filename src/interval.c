@@ -0,0 +1,159 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include <math.h>
+
+#include "redistracker.h"
+
+/* ========================== Adaptive interval ============================*/
+/* With announce-target-qps set, the interval handed out follows the load
+ * instead of being announce-interval for everybody. Once a second the
+ * announce rate is folded into a moving average and the base interval is
+ * moved towards base * rate / target, the interval that would bring the
+ * peers behind that rate in at the target. The rate only follows once
+ * clients come back on the new interval, about one base interval later, so
+ * each tick takes the tick / base share of INTERVAL_GAIN of that move: the
+ * base closes at most that part of the gap per interval instead of running
+ * into announce-interval-max or -min before the rate could answer, and
+ * swinging between the two. rate / target is capped at INTERVAL_RATIO_MAX
+ * either way, so a restart stretches intervals over a few of them.
+ *
+ * Each reply scales the base by the size of its swarm, from half for a
+ * lone peer to twice for swarms of INTERVAL_SWARM_REF * 4 peers and more,
+ * since peer lists of small swarms go stale faster. announce-jitter then
+ * spreads peers that announced together, with or without the target.
+ *
+ * The min interval a reply carries, and that rate limiting holds peers to,
+ * is min-interval raised to INTERVAL_MIN_SHARE of the shortest interval the
+ * swarm hands out, so clients told to stay away for an hour are not let
+ * back after the few minutes min-interval was set for.
+ *
+ * Generations live as long as the longest interval that could be handed
+ * out now, or that was handed out and has not run out yet, so that no peer
+ * is forgotten before it was due back. */
+#define INTERVAL_TICK_MS 1000
+#define INTERVAL_RATE_ALPHA (1.0 / 16)
+#define INTERVAL_MEAN_ALPHA (1.0 / 1024)
+#define INTERVAL_GAIN 0.5
+#define INTERVAL_RATIO_MAX 4.0
+#define INTERVAL_MIN_SHARE 0.5
+#define INTERVAL_SWARM_REF 50
+#define INTERVAL_SWARM_MIN 0.5
+#define INTERVAL_SWARM_MAX 2.0
+#define INTERVAL_MIN_TTL 60
+
+static double IntervalBase;   /* seconds, before swarm size and jitter */
+static double IntervalRate;   /* announces per second */
+static double IntervalMean;   /* of the intervals announces were told */
+static double IntervalMax;    /* longest one handed out, minus time since */
+static long long IntervalLastAnnounces;
+static uint64_t IntervalRng;
+
+static double intervalClamp(double v, double min, double max) {
+  return v < min ? min : v > max ? max : v;
+}
+
+/* In [-1, 1]. */
+static double intervalRandom(void) {
+  IntervalRng ^= IntervalRng << 13;
+  IntervalRng ^= IntervalRng >> 7;
+  IntervalRng ^= IntervalRng << 17;
+  return (double)(IntervalRng >> 11) / (double)(1ULL << 52) - 1;
+}
+
+static void intervalTimerHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  long long announces = tracker_stats.announces - IntervalLastAnnounces;
+  IntervalLastAnnounces = tracker_stats.announces;
+  IntervalRate += (announces * 1000.0 / INTERVAL_TICK_MS - IntervalRate) *
+                  INTERVAL_RATE_ALPHA;
+  if (tracker_config.announce_target_qps) {
+    double ratio = intervalClamp(
+        IntervalRate / tracker_config.announce_target_qps,
+        1 / INTERVAL_RATIO_MAX, INTERVAL_RATIO_MAX);
+    IntervalBase *= pow(ratio, INTERVAL_GAIN * INTERVAL_TICK_MS / 1000.0 /
+                                   IntervalBase);
+  }
+  if (IntervalMax > 0) IntervalMax -= INTERVAL_TICK_MS / 1000.0;
+  IntervalBase = intervalClamp(IntervalBase,
+                               tracker_config.announce_interval_min,
+                               tracker_config.announce_interval_max);
+  RedisModule_CreateTimer(ctx, INTERVAL_TICK_MS, intervalTimerHandler, NULL);
+}
+
+static double intervalSwarmFactor(SeedersObj *o) {
+  size_t size = RedisModule_DictSize(o->d[0]->table) +
+                RedisModule_DictSize(o->d[1]->table);
+  return intervalClamp(sqrt((double)size / INTERVAL_SWARM_REF),
+                       INTERVAL_SWARM_MIN, INTERVAL_SWARM_MAX);
+}
+
+/* The interval of swarm o, before jitter. */
+static double intervalOf(SeedersObj *o) {
+  if (tracker_config.announce_target_qps) {
+    return IntervalBase * intervalSwarmFactor(o);
+  }
+  return tracker_config.announce_interval;
+}
+
+/* Seconds the announcing peer of swarm o may not come back before, 0 when
+ * min-interval is. The same for every peer of the swarm at a time, there is
+ * no jitter in it. */
+long long trackerMinInterval(SeedersObj *o) {
+  long long min = tracker_config.min_interval;
+  if (min <= 0) return 0;
+  double shortest =
+      intervalOf(o) * (1 - tracker_config.announce_jitter / 100.0);
+  long long share =
+      trackerPressureInterval((long long)shortest) * INTERVAL_MIN_SHARE;
+  return share > min ? share : min;
+}
+
+/* Seconds the announcing peer of swarm o is told to wait. Never below its
+ * min interval, or it would be rate limited when it comes back. */
+long long trackerAnnounceInterval(SeedersObj *o) {
+  double v = intervalOf(o);
+  v *= 1 + tracker_config.announce_jitter / 100.0 * intervalRandom();
+  long long interval = trackerPressureInterval((long long)(v + 0.5));
+  long long min = trackerMinInterval(o);
+  if (interval < min) interval = min;
+  if (interval < 1) interval = 1;
+  IntervalMean += (interval - IntervalMean) * INTERVAL_MEAN_ALPHA;
+  if (interval > IntervalMax) IntervalMax = interval;
+  return interval;
+}
+
+/* Seconds a generation created now lives. */
+uint64_t trackerGenerationTtl(void) {
+  double v = tracker_config.announce_interval;
+  if (tracker_config.announce_target_qps) {
+    v = IntervalBase * INTERVAL_SWARM_MAX;
+  }
+  v *= 1 + tracker_config.announce_jitter / 100.0;
+  long long ttl = trackerPressureInterval((long long)ceil(v));
+  if (ttl < IntervalMax) ttl = ceil(IntervalMax);
+  if (ttl < tracker_config.min_interval) ttl = tracker_config.min_interval;
+  if (ttl < INTERVAL_MIN_TTL) ttl = INTERVAL_MIN_TTL;
+  return trackerPressureTtl(ttl);
+}
+
+void trackerIntervalInit(RedisModuleCtx *ctx) {
+  RedisModule_GetRandomBytes((unsigned char *)&IntervalRng,
+                             sizeof(IntervalRng));
+  IntervalRng |= 1;
+  IntervalBase = intervalClamp(tracker_config.announce_interval,
+                               tracker_config.announce_interval_min,
+                               tracker_config.announce_interval_max);
+  IntervalMean = IntervalMax = 0;
+  IntervalRate = 0;
+  IntervalLastAnnounces = tracker_stats.announces;
+  RedisModule_CreateTimer(ctx, INTERVAL_TICK_MS, intervalTimerHandler, NULL);
+}
+
+void trackerIntervalInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "interval");
+  RedisModule_InfoAddFieldDouble(ctx, "interval_base", IntervalBase);
+  RedisModule_InfoAddFieldDouble(ctx, "interval_mean", IntervalMean);
+  RedisModule_InfoAddFieldDouble(ctx, "interval_announce_rate",
+                                 IntervalRate);
+  RedisModule_InfoAddFieldULongLong(ctx, "interval_generation_ttl",
+                                    trackerGenerationTtl());
+}
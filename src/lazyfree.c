@@ -0,0 +1,104 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include <pthread.h>
+
+#include "redistracker.h"
+
+/* ========================== Lazy freeing =================================*/
+/* Releasing a generation walks and frees every peer in it, which for a big
+ * swarm is a latency spike on whichever announce happened to rotate it, or
+ * on the command that deleted the key. Like Redis lazyfree, anything with
+ * more than lazyfree-threshold peers is handed to a background thread
+ * instead, so the main thread only pays for a queue push. */
+typedef struct LazyfreeJob {
+  void *ptr;
+  void (*free)(void *ptr);
+  struct LazyfreeJob *next;
+} LazyfreeJob;
+
+static pthread_mutex_t LazyfreeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t LazyfreeCond = PTHREAD_COND_INITIALIZER;
+static LazyfreeJob *LazyfreeHead, *LazyfreeTail;
+static int LazyfreeRunning;
+static long long LazyfreePending;
+static long long LazyfreeFreed;
+
+static void *lazyfreeMain(void *arg) {
+  REDISMODULE_NOT_USED(arg);
+  pthread_mutex_lock(&LazyfreeMutex);
+  for (;;) {
+    while (LazyfreeHead == NULL) {
+      pthread_cond_wait(&LazyfreeCond, &LazyfreeMutex);
+    }
+    LazyfreeJob *job = LazyfreeHead;
+    LazyfreeHead = job->next;
+    if (LazyfreeHead == NULL) LazyfreeTail = NULL;
+    pthread_mutex_unlock(&LazyfreeMutex);
+
+    job->free(job->ptr);
+    RedisModule_Free(job);
+
+    pthread_mutex_lock(&LazyfreeMutex);
+    LazyfreePending--;
+    LazyfreeFreed++;
+  }
+  return NULL;
+}
+
+/* Frees ptr with fn, in the background if effort (the number of peers to
+ * release) is above lazyfree-threshold. */
+static void lazyfree(void *ptr, size_t effort, void (*fn)(void *ptr)) {
+  long long threshold = tracker_config.lazyfree_threshold;
+  if (!LazyfreeRunning || threshold == 0 || effort <= (size_t)threshold) {
+    fn(ptr);
+    return;
+  }
+  LazyfreeJob *job = RedisModule_Alloc(sizeof(*job));
+  job->ptr = ptr;
+  job->free = fn;
+  job->next = NULL;
+  pthread_mutex_lock(&LazyfreeMutex);
+  if (LazyfreeTail) {
+    LazyfreeTail->next = job;
+  } else {
+    LazyfreeHead = job;
+  }
+  LazyfreeTail = job;
+  LazyfreePending++;
+  pthread_cond_signal(&LazyfreeCond);
+  pthread_mutex_unlock(&LazyfreeMutex);
+}
+
+static void lazyfreeDict(void *ptr) { releaseDictObject(ptr); }
+
+static void lazyfreeSwarm(void *ptr) { releaseSeedersObject(ptr); }
+
+void trackerLazyfreeDict(dict *d) {
+  lazyfree(d, RedisModule_DictSize(d->table), lazyfreeDict);
+}
+
+void trackerLazyfreeSwarm(SeedersObj *o) {
+  lazyfree(o,
+           RedisModule_DictSize(o->d[0]->table) +
+               RedisModule_DictSize(o->d[1]->table),
+           lazyfreeSwarm);
+}
+
+void trackerLazyfreeInit(RedisModuleCtx *ctx) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, lazyfreeMain, NULL) != 0) {
+    RedisModule_Log(ctx, "warning",
+                    "can't start the lazyfree thread, freeing inline");
+    return;
+  }
+  pthread_detach(thread);
+  LazyfreeRunning = 1;
+}
+
+void trackerLazyfreeInfo(RedisModuleInfoCtx *ctx) {
+  pthread_mutex_lock(&LazyfreeMutex);
+  long long pending = LazyfreePending, freed = LazyfreeFreed;
+  pthread_mutex_unlock(&LazyfreeMutex);
+  RedisModule_InfoAddSection(ctx, "lazyfree");
+  RedisModule_InfoAddFieldLongLong(ctx, "lazyfree_pending_objects", pending);
+  RedisModule_InfoAddFieldLongLong(ctx, "lazyfree_freed_objects", freed);
+}
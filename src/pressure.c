@@ -0,0 +1,122 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include "redistracker.h"
+
+/* ========================== Memory pressure ==============================*/
+/* Close to maxmemory every announce would still create swarms and peers
+ * until Redis refuses all writes. Instead a timer watches the used memory
+ * ratio and moves through degradation levels, each one adding to the ones
+ * below it:
+ *   1  new generations live pressure-generation-ttl instead of 30 minutes
+ *   2  swarms stop taking new peers beyond pressure-max-peers
+ *   3  announces for swarms that don't exist yet are refused
+ *   4  clients are told to come back after pressure-interval
+ * A level is entered once the ratio reaches its pressure-level<N> percent,
+ * and only left once it is PRESSURE_HYSTERESIS points below, so a ratio
+ * hovering at a threshold doesn't flap. Without maxmemory the ratio is 0
+ * and nothing ever degrades. */
+#define PRESSURE_CHECK_MS 100
+#define PRESSURE_HYSTERESIS 5
+#define PRESSURE_LEVELS 4
+
+static int PressureLevel;
+static float PressureRatio;
+static long long PressureTransitions;
+static long long PressureEntered[PRESSURE_LEVELS + 1];
+static mstime_t PressureChangedAt;
+static long long PressureCappedPeers;
+static long long PressureRefusedSwarms;
+
+static long long pressureThreshold(int level) {
+  switch (level) {
+  case 1: return tracker_config.pressure_level1;
+  case 2: return tracker_config.pressure_level2;
+  case 3: return tracker_config.pressure_level3;
+  default: return tracker_config.pressure_level4;
+  }
+}
+
+/* The level the ratio calls for, given the one we are at. A threshold of 0
+ * disables its level. */
+static int pressureTarget(float ratio, int current) {
+  int level = 0;
+  for (int l = 1; l <= PRESSURE_LEVELS; l++) {
+    long long threshold = pressureThreshold(l);
+    if (threshold == 0) continue;
+    if (l <= current) threshold -= PRESSURE_HYSTERESIS;
+    if (ratio * 100 >= threshold) level = l;
+  }
+  return level;
+}
+
+static void pressureTimerHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  PressureRatio = RedisModule_GetUsedMemoryRatio();
+  int level = pressureTarget(PressureRatio, PressureLevel);
+  if (level != PressureLevel) {
+    RedisModule_Log(ctx, level > PressureLevel ? "warning" : "notice",
+                    "memory pressure level %d -> %d, used memory ratio %.2f",
+                    PressureLevel, level, PressureRatio);
+    PressureLevel = level;
+    PressureTransitions++;
+    PressureEntered[level]++;
+    PressureChangedAt = RedisModule_Milliseconds();
+  }
+  RedisModule_CreateTimer(ctx, PRESSURE_CHECK_MS, pressureTimerHandler, NULL);
+}
+
+/* Generation TTL to use instead of ttl. */
+uint64_t trackerPressureTtl(uint64_t ttl) {
+  if (PressureLevel >= 1 &&
+      ttl > (uint64_t)tracker_config.pressure_generation_ttl) {
+    return tracker_config.pressure_generation_ttl;
+  }
+  return ttl;
+}
+
+/* Whether a swarm of size peers may take one more. */
+int trackerPressureAdmitPeer(size_t size) {
+  if (PressureLevel < 2 || size < (size_t)tracker_config.pressure_max_peers) {
+    return 1;
+  }
+  PressureCappedPeers++;
+  return 0;
+}
+
+/* Whether a swarm may be created. */
+int trackerPressureAdmitSwarm(void) {
+  if (PressureLevel < 3) return 1;
+  PressureRefusedSwarms++;
+  return 0;
+}
+
+/* Announce interval to hand out instead of interval. */
+long long trackerPressureInterval(long long interval) {
+  if (PressureLevel >= 4 && tracker_config.pressure_interval > interval) {
+    return tracker_config.pressure_interval;
+  }
+  return interval;
+}
+
+void trackerPressureInit(RedisModuleCtx *ctx) {
+  RedisModule_CreateTimer(ctx, PRESSURE_CHECK_MS, pressureTimerHandler, NULL);
+}
+
+void trackerPressureInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "pressure");
+  RedisModule_InfoAddFieldLongLong(ctx, "pressure_level", PressureLevel);
+  RedisModule_InfoAddFieldDouble(ctx, "pressure_used_memory_ratio",
+                                 PressureRatio);
+  RedisModule_InfoAddFieldLongLong(ctx, "pressure_transitions",
+                                   PressureTransitions);
+  RedisModule_InfoAddFieldLongLong(ctx, "pressure_last_transition_ms",
+                                   PressureChangedAt);
+  char field[48];
+  for (int l = 0; l <= PRESSURE_LEVELS; l++) {
+    snprintf(field, sizeof(field), "pressure_level%d_entered", l);
+    RedisModule_InfoAddFieldLongLong(ctx, field, PressureEntered[l]);
+  }
+  RedisModule_InfoAddFieldLongLong(ctx, "pressure_capped_peers",
+                                   PressureCappedPeers);
+  RedisModule_InfoAddFieldLongLong(ctx, "pressure_refused_swarms",
+                                   PressureRefusedSwarms);
+}
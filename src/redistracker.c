@@ -2,9 +2,11 @@
 #include "redistracker.h"
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "redismodule.h"
 
@@ -12,6 +14,8 @@ static RedisModuleType *RedisTrackerType;
 
 static RedisModuleString *TrackerNoneString;
 
+TrackerStats tracker_stats;
+
 peer *createPeerObject(void) {
   peer *o;
   o = RedisModule_Calloc(1, sizeof(*o));
@@ -29,13 +33,31 @@ dict *createDictObject(void) {
   dict *o;
   o = RedisModule_Calloc(1, sizeof(*o));
   o->table = RedisModule_CreateDict(NULL);
-  // todo: cinfig ttl
-  o->when_to_die = RedisModule_Milliseconds() / 1000 + 1800;
-  o->v4_seeder = 0;
-  o->v6_seeder = 0;
+  o->when_to_die = trackerMilliseconds() / 1000 + trackerGenerationTtl();
+  o->complete = 0;
+  o->incomplete = 0;
   return o;
 }
 
+static void releaseLocalPools(RedisModuleDict *local) {
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(local, "^", NULL, 0);
+  PeerPool *pool;
+  while (RedisModule_DictNextC(iter, NULL, (void **)&pool)) {
+    RedisModule_Free(pool->items);
+    RedisModule_Free(pool);
+  }
+  RedisModule_DictIteratorStop(iter);
+  RedisModule_FreeDict(NULL, local);
+}
+
+/* Drops the prefix index of a generation, if it has one. */
+void releaseLocality(dict *o) {
+  if (o->local4) releaseLocalPools(o->local4);
+  if (o->local6) releaseLocalPools(o->local6);
+  o->local4 = o->local6 = NULL;
+}
+
 void releaseDictObject(dict *o) {
   if (!o) return;
   if (o->table) {
@@ -49,6 +71,9 @@ void releaseDictObject(dict *o) {
     RedisModule_DictIteratorStop(iter);
     RedisModule_FreeDict(NULL, o->table);
   }
+  RedisModule_Free(o->pool4.items);
+  RedisModule_Free(o->pool6.items);
+  releaseLocality(o);
   RedisModule_Free(o);
 }
 
@@ -80,11 +105,19 @@ void *SeederIterNext(SeederIter *iter, size_t *keylen, void **dataptr) {
 }
 
 SeedersObj *createSeedersObject(void) {
+  return createSeedersObjectWithKey(NULL, 0);
+}
+
+/* A swarm that carries its info_hash, for the swarm table. */
+SeedersObj *createSeedersObjectWithKey(const char *key, size_t len) {
   SeedersObj *o;
-  o = RedisModule_Calloc(1, sizeof(*o));
+  o = RedisModule_Calloc(1, sizeof(*o) + len);
+  if (len) memcpy(o->key, key, len);
+  o->keylen = len;
   o->d[0] = createDictObject();
-  o->d[0]->when_to_die -= 1800;
+  o->d[0]->when_to_die = trackerMilliseconds() / 1000;
   o->d[1] = createDictObject();
+  o->expire_at = 0;
   return o;
 }
 
@@ -92,19 +125,86 @@ void releaseSeedersObject(SeedersObj *o) {
   if (!o) return;
   if (o->d[0]) releaseDictObject(o->d[0]);
   if (o->d[1]) releaseDictObject(o->d[1]);
+  trackerHllFree(o->hll);
   RedisModule_Free(o);
 }
 
 /* ========================== Common  func =============================*/
 
+static inline uint64_t _rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t _fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+/* Small non-cryptographic 64 bit hash (murmur3 style word mixing), used for
+ * the module side tables. Not suitable where clients can choose the input
+ * to attack it, unless seeded with a secret. */
+uint64_t trackerHash64(const void *key, size_t len, uint64_t seed) {
+  const uint8_t *p = key;
+  uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+  while (len >= 8) {
+    uint64_t k;
+    memcpy(&k, p, 8);
+    k *= 0x87c37b91114253d5ULL;
+    k = _rotl64(k, 31);
+    k *= 0x4cf5ad432745937fULL;
+    h ^= k;
+    h = _rotl64(h, 27) * 5 + 0x52dce729;
+    p += 8;
+    len -= 8;
+  }
+  if (len) {
+    uint64_t k = 0;
+    memcpy(&k, p, len);
+    k *= 0x87c37b91114253d5ULL;
+    k = _rotl64(k, 31);
+    k *= 0x4cf5ad432745937fULL;
+    h ^= k;
+  }
+  return _fmix64(h);
+}
+
 void seedersCompaction(SeedersObj *s) {
-  uint64_t now = RedisModule_Milliseconds() / 1000;
-  if (now > s->d[0]->when_to_die) {
+  uint64_t now = trackerMilliseconds() / 1000;
+  /* Under memory pressure generations created earlier die sooner too. */
+  uint64_t ttl = trackerGenerationTtl();
+  if (s->d[0]->when_to_die > now + ttl) s->d[0]->when_to_die = now + ttl;
+  if (now < s->d[0]->when_to_die) {
     return;
   }
-  releaseDictObject(s->d[0]);
+  trackerLazyfreeDict(s->d[0]);
   s->d[0] = s->d[1];
   s->d[1] = createDictObject();
+  trackerDeltaRotate(s);
+}
+
+/* Push the key expire forward only when less than TRACKER_KEY_TTL is left,
+ * and then overshoot by TRACKER_KEY_TTL_SLACK, so that a busy swarm touches
+ * the expires dict at most once per slack window instead of per announce.
+ * Generations outliving TRACKER_KEY_TTL stretch it to their own TTL. With
+ * a NULL key, for swarm table swarms, only expire_at moves.
+ * Returns 1 if the expire was moved. */
+int refreshKeyTTL(RedisModuleKey *key, SeedersObj *o) {
+  mstime_t now = RedisModule_Milliseconds();
+  mstime_t keep = trackerGenerationTtl();
+  if (keep < TRACKER_KEY_TTL) keep = TRACKER_KEY_TTL;
+  if (o->expire_at - now >= keep * 1000) {
+    return 0;
+  }
+  mstime_t ttl = (keep + TRACKER_KEY_TTL_SLACK) * 1000;
+  if (key == NULL || RedisModule_SetExpire(key, ttl) == REDISMODULE_OK) {
+    o->expire_at = now + ttl;
+    return 1;
+  }
+  return 0;
 }
 
 int _s2u(const char *start, const char *end) {
@@ -117,7 +217,7 @@ int _s2u(const char *start, const char *end) {
       } else {
         ch = ch | 0x20;
         if (ch >= 'a' && ch <= 'f') {
-          x = x * 16 + ch - 'a';
+          x = x * 16 + ch - 'a' + 10;
         } else {
           return -1;
         }
@@ -183,7 +283,7 @@ int _hex2u(const char *start, const char *end) {
     } else {
       ch = ch | 0x20;
       if (ch >= 'a' && ch <= 'f') {
-        x = x * 16 + ch - 'a';
+        x = x * 16 + ch - 'a' + 10;
       } else {
         return -1;
       }
@@ -269,8 +369,130 @@ int parseIPV6(RedisModuleString *str, uint8_t *res, uint8_t **has_v6) {
   return parseIPV6Inner(s, len, res);
 }
 
-void updateIP(SeedersObj *o, RedisModuleString *passkey, uint8_t *v4,
-              uint8_t *v6, uint16_t port) {
+static inline int peerIsSeeder(peer *p) { return p->has_stats && !p->left; }
+
+static inline void countSeeder(dict *d, peer *p, int sign) {
+  if (peerIsSeeder(p)) {
+    d->complete += sign;
+  } else {
+    d->incomplete += sign;
+  }
+}
+
+static void poolAdd(PeerPool *pool, peer *p, uint32_t *idx) {
+  if (pool->len == pool->cap) {
+    pool->cap = pool->cap ? pool->cap * 2 : 4;
+    pool->items =
+        RedisModule_Realloc(pool->items, pool->cap * sizeof(*pool->items));
+  }
+  *idx = pool->len;
+  pool->items[pool->len++] = p;
+}
+
+/* Moves the last peer into the hole, so idx4/idx6 of that one change. */
+static void poolDel(PeerPool *pool, uint32_t idx, int v6) {
+  peer *last = pool->items[--pool->len];
+  pool->items[idx] = last;
+  if (v6) {
+    last->idx6 = idx;
+  } else {
+    last->idx4 = idx;
+  }
+}
+
+static void poolSwap(PeerPool *pool, uint32_t i, uint32_t j, int v6) {
+  peer *a = pool->items[i];
+  peer *b = pool->items[j];
+  pool->items[i] = b;
+  pool->items[j] = a;
+  if (v6) {
+    a->idx6 = j;
+    b->idx6 = i;
+  } else {
+    a->idx4 = j;
+    b->idx4 = i;
+  }
+}
+
+/* Same prefix pools: a peer is in the one of its /24 and of its /48, and
+ * lidx4 / lidx6 follow it there the way idx4 / idx6 do in the generation
+ * pools. Empty pools are dropped. */
+#define LOCALITY_PREFIX4 3
+#define LOCALITY_PREFIX6 6
+
+static PeerPool *localPool(RedisModuleDict *local, peer *p, int v6) {
+  return RedisModule_DictGetC(local, v6 ? p->peer6 : p->peer,
+                              v6 ? LOCALITY_PREFIX6 : LOCALITY_PREFIX4, NULL);
+}
+
+static void localSwap(PeerPool *pool, uint32_t i, uint32_t j, int v6) {
+  peer *a = pool->items[i];
+  peer *b = pool->items[j];
+  pool->items[i] = b;
+  pool->items[j] = a;
+  if (v6) {
+    a->lidx6 = j;
+    b->lidx6 = i;
+  } else {
+    a->lidx4 = j;
+    b->lidx4 = i;
+  }
+}
+
+static void localAdd(RedisModuleDict *local, peer *p, int v6) {
+  PeerPool *pool = localPool(local, p, v6);
+  if (pool == NULL) {
+    pool = RedisModule_Calloc(1, sizeof(*pool));
+    RedisModule_DictSetC(local, v6 ? p->peer6 : p->peer,
+                         v6 ? LOCALITY_PREFIX6 : LOCALITY_PREFIX4, pool);
+  }
+  poolAdd(pool, p, v6 ? &p->lidx6 : &p->lidx4);
+}
+
+static void localDel(RedisModuleDict *local, peer *p, int v6) {
+  PeerPool *pool = localPool(local, p, v6);
+  localSwap(pool, v6 ? p->lidx6 : p->lidx4, pool->len - 1, v6);
+  if (--pool->len) return;
+  RedisModule_DictDelC(local, v6 ? p->peer6 : p->peer,
+                       v6 ? LOCALITY_PREFIX6 : LOCALITY_PREFIX4, NULL);
+  RedisModule_Free(pool->items);
+  RedisModule_Free(pool);
+}
+
+static void poolPeer(dict *d, peer *p) {
+  if (p->use_v4) poolAdd(&d->pool4, p, &p->idx4);
+  if (p->use_v6) poolAdd(&d->pool6, p, &p->idx6);
+  if (d->local4 && p->use_v4) localAdd(d->local4, p, 0);
+  if (d->local6 && p->use_v6) localAdd(d->local6, p, 1);
+}
+
+static void unpoolPeer(dict *d, peer *p) {
+  if (p->use_v4) poolDel(&d->pool4, p->idx4, 0);
+  if (p->use_v6) poolDel(&d->pool6, p->idx6, 1);
+  if (d->local4 && p->use_v4) localDel(d->local4, p, 0);
+  if (d->local6 && p->use_v6) localDel(d->local6, p, 1);
+}
+
+/* Builds the prefix index of a generation from its pools, once. */
+static void buildLocality(dict *d) {
+  d->local4 = RedisModule_CreateDict(NULL);
+  d->local6 = RedisModule_CreateDict(NULL);
+  for (uint32_t i = 0; i < d->pool4.len; i++) {
+    localAdd(d->local4, d->pool4.items[i], 0);
+  }
+  for (uint32_t i = 0; i < d->pool6.len; i++) {
+    localAdd(d->local6, d->pool6.items[i], 1);
+  }
+}
+
+/* Ports are kept in network byte order, ready for compact responses. */
+static inline void writePort(uint8_t *buf, uint16_t port) {
+  buf[0] = port >> 8;
+  buf[1] = port & 0xff;
+}
+
+peer *updateIP(SeedersObj *o, RedisModuleString *passkey, uint8_t *v4,
+               uint8_t *v6, uint16_t port) {
   RedisModuleDict *d2 = o->d[1]->table;
   RedisModuleDict *d1 = o->d[0]->table;
   peer *p = RedisModule_DictGet(d2, passkey, NULL);
@@ -278,16 +500,16 @@ void updateIP(SeedersObj *o, RedisModuleString *passkey, uint8_t *v4,
     p = RedisModule_DictGet(d1, passkey, NULL);
     if (p != NULL) {
       RedisModule_DictDel(d1, passkey, NULL);
-      o->d[0]->v4_seeder -= p->use_v4;
-      o->d[0]->v6_seeder -= p->use_v6;
+      unpoolPeer(o->d[0], p);
+      countSeeder(o->d[0], p, -1);
       RedisModule_DictSet(d2, passkey, p);
     } else {
       p = createPeerObject();
       RedisModule_DictSet(d2, passkey, p);
     }
+    countSeeder(o->d[1], p, 1);
   } else {
-    o->d[1]->v4_seeder -= p->use_v4;
-    o->d[1]->v6_seeder -= p->use_v6;
+    unpoolPeer(o->d[1], p);
   }
 
   if (v4 == NULL) {
@@ -295,84 +517,936 @@ void updateIP(SeedersObj *o, RedisModuleString *passkey, uint8_t *v4,
   } else {
     p->use_v4 = 1;
     memcpy(p->peer, v4, 4);
-    *(uint16_t *)(p->peer + 4) = port;
+    writePort(p->peer + 4, port);
   }
   if (v6 == NULL) {
     p->use_v6 = 0;
   } else {
     p->use_v6 = 1;
     memcpy(p->peer6, v6, 16);
-    *(uint16_t *)(p->peer6 + 16) = port;
+    writePort(p->peer6 + 16, port);
+  }
+  poolPeer(o->d[1], p);
+  p->last_announce = trackerMilliseconds();
+  trackerDeltaPeer(o, passkey, TRACKER_EFFECT_UPDATE);
+  return p;
+}
+
+/* Stats decide whether a peer is complete or incomplete, so they are only
+ * changed through here, on a peer updateIP just put in d[1]. */
+void setPeerStats(SeedersObj *o, peer *p, RedisModuleString *passkey,
+                  int event, uint64_t uploaded, uint64_t downloaded,
+                  uint64_t left) {
+  countSeeder(o->d[1], p, -1);
+  updatePeerStats(p, passkey, event, uploaded, downloaded, left);
+  countSeeder(o->d[1], p, 1);
+}
+
+peer *lookupPeer(SeedersObj *o, RedisModuleString *passkey) {
+  peer *p = RedisModule_DictGet(o->d[1]->table, passkey, NULL);
+  if (p == NULL) p = RedisModule_DictGet(o->d[0]->table, passkey, NULL);
+  return p;
+}
+
+/* Unlinks the peer from whichever generation holds it, without freeing. */
+peer *detachPeer(SeedersObj *o, RedisModuleString *passkey) {
+  for (int i = 1; i >= 0; i--) {
+    peer *p = NULL;
+    if (RedisModule_DictDel(o->d[i]->table, passkey, &p) == REDISMODULE_OK) {
+      unpoolPeer(o->d[i], p);
+      countSeeder(o->d[i], p, -1);
+      trackerDeltaPeer(o, passkey, TRACKER_EFFECT_REMOVE);
+      return p;
+    }
+  }
+  return NULL;
+}
+
+int removePeer(SeedersObj *o, RedisModuleString *passkey) {
+  peer *p = detachPeer(o, passkey);
+  if (p == NULL) return 0;
+  releasePeerObject(p);
+  return 1;
+}
+
+/* Links a peer that no generation holds yet into d, as is. Fails if d
+ * already has a peer under that passkey. */
+int insertPeer(dict *d, const char *passkey, size_t len, peer *p) {
+  if (RedisModule_DictSetC(d->table, (void *)passkey, len, p) ==
+      REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  poolPeer(d, p);
+  countSeeder(d, p, 1);
+  return REDISMODULE_OK;
+}
+
+/* ========================== Response =============================*/
+
+/* Partial Fisher-Yates over pool[from, len): picks want distinct peers
+ * uniformly, leaving them in pool[from, from + want) where they are copied
+ * from. Reordering the pool is harmless as long as idx4/idx6 follow. */
+static size_t poolSample(PeerPool *pool, uint32_t from, uint32_t len,
+                         size_t want, uint8_t *out, int v6) {
+  if (from >= len) return 0;
+  if (want > len - from) want = len - from;
+  for (uint32_t k = from; k < from + want; k++) {
+    uint32_t j = k + rand() % (len - k);
+    if (j != k) poolSwap(pool, k, j, v6);
+    peer *p = pool->items[k];
+    if (v6) {
+      memcpy(out + (k - from) * 18, p->peer6, 18);
+    } else {
+      memcpy(out + (k - from) * 6, p->peer, 6);
+    }
+  }
+  return want;
+}
+
+/* Picks up to want peers sharing the prefix of self, newest generation
+ * first, with the same partial Fisher-Yates as poolSample. Every peer taken
+ * is also moved to the front of its generation pool, and taken[g] counts
+ * them, so the random fill can skip them. Self is parked at the end of its
+ * prefix pool and left out. */
+static size_t sampleLocal(SeedersObj *o, peer *self, size_t want,
+                          uint8_t *out, int v6, uint32_t taken[2]) {
+  size_t n = 0;
+  for (int g = 1; g >= 0 && n < want; g--) {
+    dict *d = o->d[g];
+    if (d->local4 == NULL) buildLocality(d);
+    PeerPool *lp = localPool(v6 ? d->local6 : d->local4, self, v6);
+    if (lp == NULL) continue;
+    uint32_t len = lp->len;
+    if (g == 1) {
+      localSwap(lp, v6 ? self->lidx6 : self->lidx4, len - 1, v6);
+      len--;
+    }
+    PeerPool *pool = v6 ? &d->pool6 : &d->pool4;
+    for (uint32_t k = 0; k < len && n < want; k++, n++) {
+      uint32_t j = k + rand() % (len - k);
+      if (j != k) localSwap(lp, k, j, v6);
+      peer *p = lp->items[k];
+      poolSwap(pool, v6 ? p->idx6 : p->idx4, taken[g]++, v6);
+      if (v6) {
+        memcpy(out + n * 18, p->peer6, 18);
+      } else {
+        memcpy(out + n * 6, p->peer, 6);
+      }
+    }
+  }
+  return n;
+}
+
+/* Samples numwant peers out of the two generations of one family, taking
+ * from each generation in proportion to its size. The announcing peer, if
+ * any, is in d[1]: it is parked at the end of that pool and left out. */
+size_t sampleSwarmPeers(SeedersObj *o, peer *self, size_t numwant,
+                        uint8_t *out, int v6) {
+  PeerPool *old = v6 ? &o->d[0]->pool6 : &o->d[0]->pool4;
+  PeerPool *cur = v6 ? &o->d[1]->pool6 : &o->d[1]->pool4;
+  uint32_t curlen = cur->len;
+  if (self && (v6 ? self->use_v6 : self->use_v4)) {
+    poolSwap(cur, v6 ? self->idx6 : self->idx4, curlen - 1, v6);
+    curlen--;
+  }
+  uint64_t total = (uint64_t)curlen + old->len;
+  if (total == 0 || numwant == 0) return 0;
+
+  size_t n = 0;
+  uint32_t taken[2] = {0, 0};
+  if (tracker_config.locality_fraction == 0) {
+    if (o->d[0]->local4) releaseLocality(o->d[0]);
+    if (o->d[1]->local4) releaseLocality(o->d[1]);
+  } else if (self && (v6 ? self->use_v6 : self->use_v4)) {
+    size_t want = numwant * tracker_config.locality_fraction / 100;
+    n = sampleLocal(o, self, want, out, v6, taken);
+    numwant -= n;
+    out += n * (v6 ? 18 : 6);
+    curlen -= taken[1];
+    total -= n;
+  }
+
+  size_t want_cur = numwant;
+  if (total > numwant) {
+    want_cur = (size_t)((uint64_t)numwant * curlen / total);
+    if (numwant - want_cur > old->len - taken[0]) {
+      want_cur = numwant - (old->len - taken[0]);
+    }
+  }
+  size_t m = poolSample(cur, taken[1], taken[1] + curlen, want_cur, out, v6);
+  m += poolSample(old, taken[0], old->len, numwant - m,
+                  out + m * (v6 ? 18 : 6), v6);
+  return n + m;
+}
+
+/* sampleSwarmPeers, plus peers of the sibling sub-swarms of a sub-swarm. */
+size_t samplePeerFamily(SeedersObj *o, peer *self, size_t numwant,
+                        uint8_t *out, int v6) {
+  size_t n = o->shard ? trackerShardSample(o, numwant, out, v6) : 0;
+  return n + sampleSwarmPeers(o, self, numwant - n, out + n * (v6 ? 18 : 6),
+                              v6);
+}
+
+/* Copies the compact address of up to numwant peers per family, skipping
+ * the announcing peer itself. O(numwant), whatever the swarm size. */
+void samplePeers(SeedersObj *o, peer *self, long numwant, uint8_t *out4,
+                 size_t *n4, uint8_t *out6, size_t *n6) {
+  *n4 = 0;
+  *n6 = 0;
+  if (numwant <= 0) return;
+  *n4 = samplePeerFamily(o, self, numwant, out4, 0);
+  *n6 = samplePeerFamily(o, self, numwant, out6, 1);
+}
+
+static size_t _digits(size_t v) {
+  size_t n = 1;
+  while (v >= 10) {
+    v /= 10;
+    n++;
+  }
+  return n;
+}
+
+size_t bencodeAnnounceMaxLen(long numwant) {
+  /* Fixed keys and four integers, then the two peer strings. */
+  return 128 + 16 + _digits(numwant * 6) + numwant * 6 + 16 +
+         _digits(numwant * 18) + numwant * 18;
+}
+
+/* Writes the whole announce response body into buf, which must hold
+ * bencodeAnnounceMaxLen(numwant) bytes, and returns its length. Peers are
+ * sampled straight into place after a length prefix sized for the worst
+ * case, which is then rewritten and the peers slid back over the unused
+ * digits, so nothing is built twice. */
+size_t bencodeAnnounce(char *buf, SeedersObj *o, peer *self, long numwant) {
+  char *p = buf;
+  char hdr[32];
+  int complete = o->d[0]->complete + o->d[1]->complete;
+  int incomplete = o->d[0]->incomplete + o->d[1]->incomplete;
+  trackerShardCounts(o, &complete, &incomplete);
+  p += sprintf(p, "d8:completei%de10:incompletei%de8:intervali%llde",
+               complete, incomplete, trackerAnnounceInterval(o));
+  long long min_interval = trackerMinInterval(o);
+  if (min_interval > 0) {
+    p += sprintf(p, "12:min intervali%llde", min_interval);
+  }
+
+  size_t hdr4max = 8 + _digits(numwant * 6);
+  size_t hdr6max = 9 + _digits(numwant * 18);
+  uint8_t *v4 = (uint8_t *)p + hdr4max;
+  uint8_t *v6 = v4 + numwant * 6 + hdr6max;
+  size_t n4, n6;
+  samplePeers(o, self, numwant, v4, &n4, v6, &n6);
+
+  int len = snprintf(hdr, sizeof(hdr), "5:peers%zu:", n4 * 6);
+  memcpy(p, hdr, len);
+  p += len;
+  memmove(p, v4, n4 * 6);
+  p += n4 * 6;
+  len = snprintf(hdr, sizeof(hdr), "6:peers6%zu:", n6 * 18);
+  memcpy(p, hdr, len);
+  p += len;
+  memmove(p, v6, n6 * 18);
+  p += n6 * 18;
+  *p++ = 'e';
+  return p - buf;
+}
+
+/* Default reply:
+ *   [interval, min interval, complete, incomplete, peers, peers6]
+ * where peers and peers6 are BEP 23 / BEP 7 compact strings. With BENCODE
+ * the reply is the finished HTTP response body instead. */
+static int replyAnnounce(RedisModuleCtx *ctx, SeedersObj *o, peer *self,
+                         long numwant, int bencode) {
+  if (bencode) {
+    char *buf = RedisModule_Alloc(bencodeAnnounceMaxLen(numwant));
+    size_t len = bencodeAnnounce(buf, o, self, numwant);
+    RedisModule_ReplyWithStringBuffer(ctx, buf, len);
+    RedisModule_Free(buf);
+    return REDISMODULE_OK;
   }
-  o->d[1]->v4_seeder -= p->use_v4;
-  o->d[1]->v6_seeder -= p->use_v6;
+  uint8_t *buf = RedisModule_Alloc(numwant * (6 + 18) + 1);
+  size_t n4, n6;
+  samplePeers(o, self, numwant, buf, &n4, buf + numwant * 6, &n6);
+  int complete = o->d[0]->complete + o->d[1]->complete;
+  int incomplete = o->d[0]->incomplete + o->d[1]->incomplete;
+  trackerShardCounts(o, &complete, &incomplete);
+  RedisModule_ReplyWithArray(ctx, 6);
+  RedisModule_ReplyWithLongLong(ctx, trackerAnnounceInterval(o));
+  RedisModule_ReplyWithLongLong(ctx, trackerMinInterval(o));
+  RedisModule_ReplyWithLongLong(ctx, complete);
+  RedisModule_ReplyWithLongLong(ctx, incomplete);
+  RedisModule_ReplyWithStringBuffer(ctx, (char *)buf, n4 * 6);
+  RedisModule_ReplyWithStringBuffer(ctx, (char *)buf + numwant * 6, n6 * 18);
+  RedisModule_Free(buf);
+  return REDISMODULE_OK;
 }
 
-void genResponse(SeedersObj *o, int num_want) {
-  int seeder_cnt = o->d[0]->v4_seeder;
-  seeder_cnt += o->d[0]->v6_seeder;
-  seeder_cnt += o->d[1]->v4_seeder;
-  seeder_cnt += o->d[1]->v6_seeder;
-  int step = seeder_cnt / num_want;
-  int start = seeder_cnt % num_want;
-  if (step <= 0) step = 1;
-  if (start < 0) start = 0;
-  start = rand() % start;
+/* ========================== Replication =============================*/
+
+/* Announces are not replicated verbatim: replicas would redo the parsing and
+ * validation for nothing. Instead we replicate the resulting effect as
+ * TRACKER.APPLY <info_hash> <passkey> <effect> [<expire_at>], where effect is
+ * the already packed peer address. */
+size_t packEffect(uint8_t *buf, int op, peer *p) {
+  size_t len = 2;
+  buf[0] = (uint8_t)op;
+  buf[1] = 0;
+  if (p == NULL) return len;
+  if (p->use_v4) {
+    buf[1] |= TRACKER_EFFECT_HAS_V4;
+    memcpy(buf + len, p->peer, 6);
+    len += 6;
+  }
+  if (p->use_v6) {
+    buf[1] |= TRACKER_EFFECT_HAS_V6;
+    memcpy(buf + len, p->peer6, 18);
+    len += 18;
+  }
+  if (p->has_stats) {
+    buf[1] |= TRACKER_EFFECT_HAS_STATS;
+    memcpy(buf + len, &p->uploaded, 8);
+    memcpy(buf + len + 8, &p->downloaded, 8);
+    memcpy(buf + len + 16, &p->left, 8);
+    len += 24;
+  }
+  return len;
+}
+
+static void replicateEffectNow(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                               RedisModuleString *passkey,
+                               const uint8_t *effect, size_t len,
+                               mstime_t expire_at) {
+  if (expire_at) {
+    RedisModule_Replicate(ctx, "TRACKER.APPLY", "ssbl", keyname, passkey,
+                          (const char *)effect, len, expire_at);
+  } else {
+    RedisModule_Replicate(ctx, "TRACKER.APPLY", "ssb", keyname, passkey,
+                          (const char *)effect, len);
+  }
+}
+
+/* With repl-coalesce enabled, effects are parked here keyed by
+ * <dbid><keylen><info_hash><passkey> and flushed by a 0ms timer, so a peer
+ * that announces several times within one event loop tick costs a single
+ * TRACKER.APPLY in the replication stream.
+ *
+ * Nothing else may reach the stream ahead of a parked effect: a DEL,
+ * RENAME or FLUSHALL of the swarm would otherwise be replayed before the
+ * announce that came first, and the late TRACKER.APPLY would recreate the
+ * swarm on replicas only. So a command filter flushes them before any
+ * command but another announce runs, through a thread safe context, whose
+ * RedisModule_Replicate propagates at once instead of after the command. */
+typedef struct PendingEffect {
+  int dbid;
+  RedisModuleString *keyname;
+  RedisModuleString *passkey;
+  mstime_t expire_at;
+  size_t len;
+  uint8_t effect[TRACKER_EFFECT_MAX_LEN];
+} PendingEffect;
+
+static RedisModuleDict *PendingEffects;
+static int PendingEffectsScheduled = 0;
+static RedisModuleCtx *PendingEffectsCtx;
+
+static void flushPendingEffects(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  PendingEffectsScheduled = 0;
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(PendingEffects, "^", NULL, 0);
+  size_t keylen;
+  PendingEffect *pe;
+  while (RedisModule_DictNextC(iter, &keylen, (void **)&pe)) {
+    RedisModule_SelectDb(ctx, pe->dbid);
+    replicateEffectNow(ctx, pe->keyname, pe->passkey, pe->effect, pe->len,
+                       pe->expire_at);
+    RedisModule_FreeString(NULL, pe->keyname);
+    RedisModule_FreeString(NULL, pe->passkey);
+    RedisModule_Free(pe);
+  }
+  RedisModule_DictIteratorStop(iter);
+  RedisModule_FreeDict(NULL, PendingEffects);
+  PendingEffects = RedisModule_CreateDict(NULL);
+}
+
+static void flushPendingEffectsFilter(RedisModuleCommandFilterCtx *fctx) {
+  if (!PendingEffectsScheduled) return;
+  const char *cmd = RedisModule_StringPtrLen(
+      RedisModule_CommandFilterArgGet(fctx, 0), NULL);
+  if (!strcasecmp(cmd, "announce") || !strcasecmp(cmd, "announce.udp")) {
+    return;
+  }
+  flushPendingEffects(PendingEffectsCtx, NULL);
+}
+
+void replicateEffect(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                     RedisModuleString *passkey, const uint8_t *effect,
+                     size_t len, mstime_t expire_at) {
+  if (!tracker_config.repl_coalesce ||
+      (RedisModule_GetContextFlags(ctx) &
+       (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA))) {
+    replicateEffectNow(ctx, keyname, passkey, effect, len, expire_at);
+    return;
+  }
+  int dbid = RedisModule_GetSelectedDb(ctx);
+  size_t klen, plen;
+  const char *k = RedisModule_StringPtrLen(keyname, &klen);
+  const char *pk = RedisModule_StringPtrLen(passkey, &plen);
+  uint32_t klen32 = (uint32_t)klen;
+  size_t idlen = sizeof(dbid) + sizeof(klen32) + klen + plen;
+  char *id = RedisModule_Alloc(idlen);
+  memcpy(id, &dbid, sizeof(dbid));
+  memcpy(id + sizeof(dbid), &klen32, sizeof(klen32));
+  memcpy(id + sizeof(dbid) + sizeof(klen32), k, klen);
+  memcpy(id + sizeof(dbid) + sizeof(klen32) + klen, pk, plen);
+
+  PendingEffect *pe = RedisModule_DictGetC(PendingEffects, id, idlen, NULL);
+  if (pe == NULL) {
+    pe = RedisModule_Alloc(sizeof(*pe));
+    pe->dbid = dbid;
+    pe->keyname = RedisModule_CreateStringFromString(NULL, keyname);
+    pe->passkey = RedisModule_CreateStringFromString(NULL, passkey);
+    pe->expire_at = 0;
+    pe->len = 0;
+    RedisModule_DictSetC(PendingEffects, id, idlen, pe);
+  }
+  RedisModule_Free(id);
+  /* Whatever replaces it, a completion must still be counted. */
+  uint8_t completed = pe->len ? pe->effect[1] & TRACKER_EFFECT_COMPLETED : 0;
+  memcpy(pe->effect, effect, len);
+  pe->effect[1] |= completed;
+  pe->len = len;
+  if (expire_at > pe->expire_at) pe->expire_at = expire_at;
+
+  if (!PendingEffectsScheduled) {
+    RedisModule_CreateTimer(ctx, 0, flushPendingEffects, NULL);
+    PendingEffectsScheduled = 1;
+  }
+}
+
+/* ========================== Rate limiting =============================*/
+
+/* Passkey -> number of announces refused for coming in under min-interval. */
+static RedisModuleDict *Offenders;
+
+static int samePeerAddress(peer *p, uint8_t *v4, uint8_t *v6,
+                           uint16_t port) {
+  if (p->use_v4 != (v4 != NULL) || p->use_v6 != (v6 != NULL)) return 0;
+  uint8_t nport[2];
+  writePort(nport, port);
+  if (v4 && (memcmp(p->peer, v4, 4) || memcmp(p->peer + 4, nport, 2))) {
+    return 0;
+  }
+  if (v6 && (memcmp(p->peer6, v6, 16) || memcmp(p->peer6 + 16, nport, 2))) {
+    return 0;
+  }
+  return 1;
+}
+
+/* A plain re-announce (no event) from the same address within the min
+ * interval of the swarm changes nothing we care about, so it is answered
+ * without touching the swarm. Only the current generation is looked at: a
+ * peer still sitting in d[0] must be moved forward before that generation is
+ * released. */
+static int isRateLimited(SeedersObj *o, RedisModuleString *passkey,
+                         uint8_t *v4, uint8_t *v6, uint16_t port) {
+  long long min_interval = trackerMinInterval(o);
+  if (min_interval <= 0) return 0;
+  peer *p = RedisModule_DictGet(o->d[1]->table, passkey, NULL);
+  if (p == NULL) return 0;
+  mstime_t now = trackerMilliseconds();
+  if (now - p->last_announce >= min_interval * 1000) return 0;
+  return samePeerAddress(p, v4, v6, port);
+}
+
+/* Counts a refused announce against its passkey, as long as fewer than
+ * offenders-max passkeys are counted. */
+static void recordOffender(RedisModuleString *passkey) {
+  tracker_stats.rate_limited++;
+  uint64_t *count = RedisModule_DictGet(Offenders, passkey, NULL);
+  if (count == NULL) {
+    if (RedisModule_DictSize(Offenders) >=
+        (uint64_t)tracker_config.offenders_max) {
+      tracker_stats.rate_limited_untracked++;
+      return;
+    }
+    count = RedisModule_Calloc(1, sizeof(*count));
+    RedisModule_DictSet(Offenders, passkey, count);
+  }
+  (*count)++;
+}
+
+/* TRACKER.OFFENDERS [RESET]
+ *
+ * Lists <passkey> <refused announces> pairs, or forgets them all. */
+int RedisTrackerOffenders_RedisCommand(RedisModuleCtx *ctx,
+                                       RedisModuleString **argv, int argc) {
+  if (argc == 2 &&
+      !strcasecmp(RedisModule_StringPtrLen(argv[1], NULL), "reset")) {
+    RedisModuleDictIter *iter =
+        RedisModule_DictIteratorStartC(Offenders, "^", NULL, 0);
+    size_t keylen;
+    void *count;
+    while (RedisModule_DictNextC(iter, &keylen, &count)) {
+      RedisModule_Free(count);
+    }
+    RedisModule_DictIteratorStop(iter);
+    RedisModule_FreeDict(NULL, Offenders);
+    Offenders = RedisModule_CreateDict(NULL);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+  if (argc != 1) return RedisModule_WrongArity(ctx);
+  RedisModule_ReplyWithArray(ctx, RedisModule_DictSize(Offenders) * 2);
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(Offenders, "^", NULL, 0);
+  size_t keylen;
+  char *passkey;
+  uint64_t *count;
+  while ((passkey = RedisModule_DictNextC(iter, &keylen, (void **)&count))) {
+    RedisModule_ReplyWithStringBuffer(ctx, passkey, keylen);
+    RedisModule_ReplyWithLongLong(ctx, (long long)*count);
+  }
+  RedisModule_DictIteratorStop(iter);
+  return REDISMODULE_OK;
+}
+
+/* ========================== Announce core =============================*/
+
+/* Opens the swarm of an info_hash without creating it. Returns NULL when
+ * there is none, or when the key holds something else. */
+SeedersObj *trackerLookupSwarm(RedisModuleCtx *ctx,
+                               RedisModuleString *info_hash) {
+  if (trackerTableEnabled()) {
+    size_t len;
+    const char *s = RedisModule_StringPtrLen(info_hash, &len);
+    return trackerTableGet(s, len);
+  }
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, info_hash, REDISMODULE_READ);
+  SeedersObj *o = trackerSwarmFromKey(key);
+  RedisModule_CloseKey(key);
+  return o;
+}
+
+/* The swarm held by an open key, NULL if the key holds something else. */
+SeedersObj *trackerSwarmFromKey(RedisModuleKey *key) {
+  if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_MODULE ||
+      RedisModule_ModuleTypeGetType(key) != RedisTrackerType) {
+    return NULL;
+  }
+  return RedisModule_ModuleTypeGetValue(key);
+}
+
+/* Stores a new swarm under an empty key. */
+void trackerSetSwarm(RedisModuleKey *key, SeedersObj *o) {
+  RedisModule_ModuleTypeSetValue(key, RedisTrackerType, o);
+}
+
+/* Announces that can't be redirected go to the sub-swarm of their passkey
+ * when it lives on this node: swaps *key, *keyname and the swarm for it.
+ * Returns NULL, leaving them alone, when it doesn't. */
+static SeedersObj *localSubswarm(RedisModuleCtx *ctx, TrackerAnnounce *req,
+                                 SeedersObj *o, RedisModuleKey **key,
+                                 RedisModuleString **keyname) {
+  RedisModuleString *name = trackerShardSubswarm(ctx, o, req->passkey);
+  RedisModuleKey *subkey = NULL;
+  SeedersObj *sub;
+  if (trackerTableEnabled()) {
+    size_t len;
+    const char *s = RedisModule_StringPtrLen(name, &len);
+    sub = trackerTableGet(s, len);
+  } else {
+    subkey = RedisModule_OpenKey(ctx, name, REDISMODULE_WRITE);
+    sub = trackerSwarmFromKey(subkey);
+  }
+  if (sub == NULL) {
+    RedisModule_CloseKey(subkey);
+    RedisModule_FreeString(ctx, name);
+    return NULL;
+  }
+  RedisModule_CloseKey(*key);
+  *key = subkey;
+  *keyname = name;
+  return sub;
+}
+
+/* Applies an already parsed and admitted announce to its swarm, whatever
+ * protocol it came in with, and hands back the swarm and the announcing
+ * peer (NULL once it stopped) to build the response from. req->numwant is
+ * cleared when the response should carry no peers. */
+static int applyAnnounce(RedisModuleCtx *ctx, TrackerAnnounce *req,
+                         SeedersObj **swarm, peer **self) {
+  SeedersObj *o = NULL;
+  RedisModuleKey *key = NULL;
+  RedisModuleString *keyname = req->info_hash;
+  int admit = 1;
+  size_t ihlen;
+  const char *ih = RedisModule_StringPtrLen(req->info_hash, &ihlen);
+  *swarm = NULL;
+  *self = NULL;
+  trackerSlowlogStage(TRACKER_SLOWLOG_PARSE);
+  if (trackerTableEnabled()) {
+    o = trackerTableGet(ih, ihlen);
+  } else {
+    key = RedisModule_OpenKey(ctx, req->info_hash, REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+      o = trackerSwarmFromKey(key);
+      if (o == NULL) {
+        RedisModule_CloseKey(key);
+        return TRACKER_ANNOUNCE_WRONGTYPE;
+      }
+    }
+  }
+  if (o == NULL) {
+    if (!trackerPressureAdmitSwarm()) {
+      RedisModule_CloseKey(key);
+      return TRACKER_ANNOUNCE_REFUSED;
+    }
+    if (key) {
+      o = createSeedersObject();
+      trackerSetSwarm(key, o);
+    } else if ((o = trackerTableAdd(ih, ihlen)) == NULL) {
+      return TRACKER_ANNOUNCE_WRONGTYPE;
+    }
+  } else if (req->redirect && req->event != TRACKER_EVENT_STOPPED &&
+             trackerShardSplit(o)) {
+    /* Stops stay here, the peer may still be in the split swarm. */
+    RedisModule_CloseKey(key);
+    *swarm = o;
+    return TRACKER_ANNOUNCE_SHARDED;
+  } else {
+    if (!req->redirect && trackerShardSplit(o)) {
+      SeedersObj *sub = localSubswarm(ctx, req, o, &key, &keyname);
+      if (sub) {
+        o = sub;
+      } else {
+        admit = 0;
+      }
+    }
+    if (req->event == TRACKER_EVENT_NONE &&
+        isRateLimited(o, req->passkey, req->v4, req->v6, req->port)) {
+      recordOffender(req->passkey);
+      RedisModule_CloseKey(key);
+      if (keyname != req->info_hash) RedisModule_FreeString(ctx, keyname);
+      *swarm = o;
+      req->numwant = 0;
+      trackerSlowlogStage(TRACKER_SLOWLOG_LOOKUP);
+      return TRACKER_ANNOUNCE_RATE_LIMITED;
+    }
+  }
+  tracker_stats.announces++;
+  trackerTopkAnnounce(req->info_hash);
+  trackerHllAnnounce(o, req->passkey);
+  trackerSlowlogStage(TRACKER_SLOWLOG_LOOKUP);
+  dict *old = o->d[0];
+  size_t old_peers = RedisModule_DictSize(old->table);
+  seedersCompaction(o);
+  if (o->d[0] != old) trackerSlowlogReleased(old_peers);
+  trackerSlowlogStage(TRACKER_SLOWLOG_COMPACTION);
+
+  uint8_t effect[TRACKER_EFFECT_MAX_LEN];
+  size_t effect_len = 0;
+  if (req->event == TRACKER_EVENT_STOPPED) {
+    peer *p = detachPeer(o, req->passkey);
+    if (p) {
+      if (req->stats) {
+        updatePeerStats(p, req->passkey, req->event, req->uploaded,
+                        req->downloaded, req->left);
+      }
+      releasePeerObject(p);
+      effect_len = packEffect(effect, TRACKER_EFFECT_REMOVE, NULL);
+    }
+    /* A leaving peer has no use for a peer list. */
+    req->numwant = 0;
+  } else if (lookupPeer(o, req->passkey) == NULL &&
+             (!admit || !trackerPressureAdmitPeer(
+                            RedisModule_DictSize(o->d[0]->table) +
+                            RedisModule_DictSize(o->d[1]->table)))) {
+    /* Swarm is full for now, or split with no sub-swarm here to take new
+     * peers, the peer still gets a peer list. */
+  } else {
+    peer *p = updateIP(o, req->passkey, req->v4, req->v6, req->port);
+    if (req->stats) {
+      setPeerStats(o, p, req->passkey, req->event, req->uploaded,
+                   req->downloaded, req->left);
+    }
+    effect_len = packEffect(effect, TRACKER_EFFECT_UPDATE, p);
+    if (req->event == TRACKER_EVENT_COMPLETED) {
+      o->downloaded++;
+      effect[1] |= TRACKER_EFFECT_COMPLETED;
+    }
+    *self = p;
+  }
+  trackerShardAnnounce(o, keyname);
+  trackerSlowlogStage(TRACKER_SLOWLOG_UPDATE);
+  mstime_t expire_at = refreshKeyTTL(key, o) ? o->expire_at : 0;
+  if (effect_len || expire_at) {
+    if (effect_len == 0) {
+      effect_len = packEffect(effect, TRACKER_EFFECT_REMOVE, NULL);
+    }
+    replicateEffect(ctx, keyname, req->passkey, effect, effect_len,
+                    expire_at);
+  }
+  trackerSnapshotTouch(keyname, o);
+  trackerDeltaTouch(ctx, keyname, o);
+  RedisModule_CloseKey(key);
+  if (keyname != req->info_hash) RedisModule_FreeString(ctx, keyname);
+  *swarm = o;
+  trackerSlowlogStage(TRACKER_SLOWLOG_REPLICATE);
+  return TRACKER_ANNOUNCE_OK;
+}
+
+int trackerAnnounce(RedisModuleCtx *ctx, TrackerAnnounce *req,
+                    SeedersObj **swarm, peer **self) {
+  if (!trackerTracing()) return applyAnnounce(ctx, req, swarm, self);
+  TrackerAnnounce traced = *req;
+  long long start = trackerMicroseconds();
+  int res = applyAnnounce(ctx, req, swarm, self);
+  trackerTraceAnnounce(ctx, &traced, res, trackerMicroseconds() - start);
+  return res;
 }
 
 /* ================= "redistracker" type commands=======================*/
 
-/* ANNOUNCE <info_hash> <passkey> <v4ip> <v6ip> <port> */
+static int parseEvent(RedisModuleString *str, int *event) {
+  size_t len;
+  const char *s = RedisModule_StringPtrLen(str, &len);
+  if (!strcasecmp(s, "started")) {
+    *event = TRACKER_EVENT_STARTED;
+  } else if (!strcasecmp(s, "stopped")) {
+    *event = TRACKER_EVENT_STOPPED;
+  } else if (!strcasecmp(s, "completed")) {
+    *event = TRACKER_EVENT_COMPLETED;
+  } else if (!strcasecmp(s, "none") || len == 0) {
+    *event = TRACKER_EVENT_NONE;
+  } else {
+    return REDISMODULE_ERR;
+  }
+  return REDISMODULE_OK;
+}
+
+static int parseCounter(RedisModuleString *str, uint64_t *res) {
+  long long v;
+  if (RedisModule_StringToLongLong(str, &v) == REDISMODULE_ERR || v < 0) {
+    return REDISMODULE_ERR;
+  }
+  *res = (uint64_t)v;
+  return REDISMODULE_OK;
+}
+
+/* ANNOUNCE <info_hash> <passkey> <v4ip> <v6ip> <port> [EVENT <event>]
+ *          [UPLOADED <n> DOWNLOADED <n> LEFT <n>] [NUMWANT <n>] [BENCODE] */
 int RedisTrackerTypeAnnounce_RedisCommand(RedisModuleCtx *ctx,
                                           RedisModuleString **argv, int argc) {
   RedisModule_AutoMemory(ctx);
-  if (argc != 6) {
-    RedisModule_ReplyWithError(ctx, "FUCK U");
+  trackerSlowlogBegin();
+  if (argc < 6) return RedisModule_WrongArity(ctx);
+  RedisModuleString *info_hash = trackerInfohashKey(ctx, argv[1]);
+  if (info_hash == NULL) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid info_hash");
     return REDISMODULE_ERR;
   }
-  SeedersObj *o = NULL;
-  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_WRITE);
-  int type = RedisModule_KeyType(key);
-  if (REDISMODULE_KEYTYPE_EMPTY == type) {
-    o = createSeedersObject();
-    RedisModule_ModuleTypeSetValue(key, RedisTrackerType, o);
-  } else {
-    if (RedisModule_ModuleTypeGetType(key) != RedisTrackerType) {
-      RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  const char *reject = trackerAdmit(info_hash, argv[2]);
+  if (reject) {
+    RedisModule_ReplyWithError(ctx, reject);
+    return REDISMODULE_ERR;
+  }
+  int event = TRACKER_EVENT_NONE;
+  uint64_t uploaded = 0, downloaded = 0, left = 0;
+  int stats = 0;
+  long long numwant = tracker_config.numwant_default;
+  int bencode = 0;
+  for (int j = 6; j < argc; j++) {
+    const char *opt = RedisModule_StringPtrLen(argv[j], NULL);
+    int moreargs = j + 1 < argc;
+    if (!strcasecmp(opt, "event") && moreargs) {
+      if (parseEvent(argv[++j], &event) == REDISMODULE_ERR) {
+        RedisModule_ReplyWithError(ctx, "ERR invalid announce event");
+        return REDISMODULE_ERR;
+      }
+    } else if (!strcasecmp(opt, "uploaded") && moreargs) {
+      if (parseCounter(argv[++j], &uploaded) == REDISMODULE_ERR) {
+        RedisModule_ReplyWithError(ctx, "ERR invalid transfer counter");
+        return REDISMODULE_ERR;
+      }
+      stats |= 1;
+    } else if (!strcasecmp(opt, "downloaded") && moreargs) {
+      if (parseCounter(argv[++j], &downloaded) == REDISMODULE_ERR) {
+        RedisModule_ReplyWithError(ctx, "ERR invalid transfer counter");
+        return REDISMODULE_ERR;
+      }
+      stats |= 2;
+    } else if (!strcasecmp(opt, "left") && moreargs) {
+      if (parseCounter(argv[++j], &left) == REDISMODULE_ERR) {
+        RedisModule_ReplyWithError(ctx, "ERR invalid transfer counter");
+        return REDISMODULE_ERR;
+      }
+      stats |= 4;
+    } else if (!strcasecmp(opt, "numwant") && moreargs) {
+      if (RedisModule_StringToLongLong(argv[++j], &numwant) ==
+              REDISMODULE_ERR ||
+          numwant < 0) {
+        RedisModule_ReplyWithError(ctx, "ERR invalid numwant");
+        return REDISMODULE_ERR;
+      }
+    } else if (!strcasecmp(opt, "bencode")) {
+      bencode = 1;
+    } else {
+      RedisModule_ReplyWithError(ctx, "ERR syntax error");
       return REDISMODULE_ERR;
     }
-    o = RedisModule_ModuleTypeGetValue(key);
+  }
+  if (stats != 0 && stats != 7) {
+    RedisModule_ReplyWithError(
+        ctx, "ERR UPLOADED, DOWNLOADED and LEFT must be given together");
+    return REDISMODULE_ERR;
+  }
+  if (numwant > tracker_config.numwant_max) {
+    numwant = tracker_config.numwant_max;
   }
   uint8_t ipv4[4];
   uint8_t ipv6[16];
   uint8_t *v4 = ipv4, *v6 = ipv6;
-  int16_t port;
-  int64_t tmp;
+  uint16_t port;
+  long long tmp;
   if (parseIPV4(argv[3], ipv4, &v4) == REDISMODULE_ERR) {
-    // GG
-    // todo
-    RedisModule_ReplyWithError(ctx, "FUCK U");
+    RedisModule_ReplyWithError(ctx, "ERR invalid ipv4");
     return REDISMODULE_ERR;
   }
   if (parseIPV6(argv[4], ipv6, &v6) == REDISMODULE_ERR) {
-    // GG
-    // todo
-    RedisModule_ReplyWithError(ctx, "FUCK U");
+    RedisModule_ReplyWithError(ctx, "ERR invalid ipv6");
     return REDISMODULE_ERR;
   }
-  if (RedisModule_StringToLongLong(argv[5], &tmp) && (tmp < 0 || tmp > 65535)) {
-    // GG
-    // todo
-    RedisModule_ReplyWithError(ctx, "FUCK U");
+  if (RedisModule_StringToLongLong(argv[5], &tmp) == REDISMODULE_ERR ||
+      tmp < 0 || tmp > 65535) {
+    RedisModule_ReplyWithError(ctx, "ERR invalid port");
     return REDISMODULE_ERR;
   }
-  port = tmp % 65536;
+  port = (uint16_t)tmp;
+
+  TrackerAnnounce req = {info_hash, argv[2], v4, v6, port, event, stats != 0,
+                         uploaded, downloaded, left, numwant, 1};
+  SeedersObj *o;
+  peer *self;
+  int res = trackerAnnounce(ctx, &req, &o, &self);
+  if (res == TRACKER_ANNOUNCE_WRONGTYPE) {
+    RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  } else if (res == TRACKER_ANNOUNCE_REFUSED) {
+    RedisModule_ReplyWithError(
+        ctx, "ERR tracker under memory pressure, new torrents refused");
+  } else if (res == TRACKER_ANNOUNCE_SHARDED) {
+    RedisModuleString *err = trackerShardRedirect(ctx, o, req.passkey);
+    RedisModule_ReplyWithError(ctx, RedisModule_StringPtrLen(err, NULL));
+  } else if (res == TRACKER_ANNOUNCE_RATE_LIMITED &&
+             tracker_config.rate_limit_error) {
+    RedisModuleString *err = RedisModule_CreateStringPrintf(
+        ctx, "ERR announce too frequent, min interval %lld",
+        trackerMinInterval(o));
+    RedisModule_ReplyWithError(ctx, RedisModule_StringPtrLen(err, NULL));
+  } else {
+    replyAnnounce(ctx, o, self, req.numwant, bencode);
+  }
+  trackerSlowlogEnd(info_hash, o, req.numwant);
+  return res == TRACKER_ANNOUNCE_WRONGTYPE ? REDISMODULE_ERR : REDISMODULE_OK;
+}
+
+/* TRACKER.APPLY <info_hash> <passkey> <effect> [<expire_at>]
+ *
+ * Replica side of announce: the effect was validated and packed by the
+ * master, so it is applied as is. Only accepted from the master link or
+ * while loading the AOF. */
+int RedisTrackerTypeApply_RedisCommand(RedisModuleCtx *ctx,
+                                       RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx);
+  if (argc != 4 && argc != 5) return RedisModule_WrongArity(ctx);
+  int flags = RedisModule_GetContextFlags(ctx);
+  if (!(flags & (REDISMODULE_CTX_FLAGS_REPLICATED |
+                 REDISMODULE_CTX_FLAGS_LOADING))) {
+    return RedisModule_ReplyWithError(
+        ctx, "ERR TRACKER.APPLY is only accepted from the replication link");
+  }
+  size_t len;
+  const uint8_t *effect =
+      (const uint8_t *)RedisModule_StringPtrLen(argv[3], &len);
+  long long expire_at = 0;
+  if (len < 2 || (argc == 5 && RedisModule_StringToLongLong(
+                                   argv[4], &expire_at) == REDISMODULE_ERR)) {
+    return RedisModule_ReplyWithError(ctx, "ERR malformed tracker effect");
+  }
+
+  RedisModuleKey *key = NULL;
+  SeedersObj *o = NULL;
+  size_t ihlen;
+  const char *ih = RedisModule_StringPtrLen(argv[1], &ihlen);
+  if (trackerTableEnabled()) {
+    o = trackerTableGet(ih, ihlen);
+  } else {
+    key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+      o = trackerSwarmFromKey(key);
+      if (o == NULL) {
+        return RedisModule_ReplyWithError(ctx,
+                                          REDISMODULE_ERRORMSG_WRONGTYPE);
+      }
+    }
+  }
+  if (o == NULL) {
+    if (effect[0] != TRACKER_EFFECT_UPDATE) {
+      return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    if (key) {
+      o = createSeedersObject();
+      trackerSetSwarm(key, o);
+    } else if ((o = trackerTableAdd(ih, ihlen)) == NULL) {
+      return RedisModule_ReplyWithError(ctx, "ERR info_hash too long");
+    }
+  }
   seedersCompaction(o);
 
-  updateIP(o, argv[2], v4, v6, port);
-  // todo: response
-  RedisModule_ReplyWithCString(ctx, "hello world");
-  return REDISMODULE_OK;
+  if (effect[0] == TRACKER_EFFECT_UPDATE) {
+    const uint8_t *ptr = effect + 2;
+    uint8_t *v4 = NULL, *v6 = NULL;
+    uint16_t port = 0;
+    if (effect[1] & TRACKER_EFFECT_HAS_V4) {
+      v4 = (uint8_t *)ptr;
+      port = ptr[4] << 8 | ptr[5];
+      ptr += 6;
+    }
+    if (effect[1] & TRACKER_EFFECT_HAS_V6) {
+      v6 = (uint8_t *)ptr;
+      port = ptr[16] << 8 | ptr[17];
+      ptr += 18;
+    }
+    const uint8_t *stats = NULL;
+    if (effect[1] & TRACKER_EFFECT_HAS_STATS) {
+      stats = ptr;
+      ptr += 24;
+    }
+    if ((size_t)(ptr - effect) != len) {
+      return RedisModule_ReplyWithError(ctx, "ERR malformed tracker effect");
+    }
+    peer *p = updateIP(o, argv[2], v4, v6, port);
+    if (stats) {
+      /* Accounting happened on the master, only keep the baseline. */
+      countSeeder(o->d[1], p, -1);
+      p->has_stats = 1;
+      memcpy(&p->uploaded, stats, 8);
+      memcpy(&p->downloaded, stats + 8, 8);
+      memcpy(&p->left, stats + 16, 8);
+      countSeeder(o->d[1], p, 1);
+    }
+  } else {
+    removePeer(o, argv[2]);
+  }
+  if (effect[1] & TRACKER_EFFECT_COMPLETED) o->downloaded++;
+  trackerSnapshotTouch(argv[1], o);
+  trackerDeltaTouch(ctx, argv[1], o);
+  if (expire_at) {
+    mstime_t ttl = expire_at - RedisModule_Milliseconds();
+    if (key) RedisModule_SetExpire(key, ttl > 0 ? ttl : 1);
+    o->expire_at = expire_at;
+  }
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
 }
 
 /* ==================== "redistracker" methods commands==================*/
@@ -402,24 +1476,174 @@ size_t TrackerTypeMemUsage(const void *value) {
   return 114514;
 }
 
-void TrackerTypeFree(void *value) { releaseSeedersObject(value); }
+/* ========================== Swarm teardown ===============================*/
+/* Sub-swarm links, snapshots and pending deltas live in main thread state
+ * (ShardLocal, DirtySwarms, the snapshot table, DeltaQueue) that points back
+ * at the swarm, and have to go before it does. free is also called from the
+ * bio thread when FLUSHALL / FLUSHDB ASYNC or a replica lazy flush hands a
+ * whole keyspace over, and this type predates the unlink callback, so those
+ * swarms are detached from the FlushDB event while still on the main thread
+ * and free only detaches when the caller holds the GIL. */
+static pthread_t MainThread;
+
+static void detachSwarm(SeedersObj *o) {
+  trackerShardDrop(o);
+  trackerSnapshotDrop(o);
+  trackerDeltaDrop(o);
+}
+
+static void detachScanned(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                          RedisModuleKey *key, void *privdata) {
+  REDISMODULE_NOT_USED(ctx);
+  REDISMODULE_NOT_USED(keyname);
+  REDISMODULE_NOT_USED(privdata);
+  SeedersObj *o = key ? trackerSwarmFromKey(key) : NULL;
+  if (o) detachSwarm(o);
+}
+
+static void detachDb(RedisModuleCtx *ctx) {
+  RedisModuleScanCursor *cursor = RedisModule_ScanCursorCreate();
+  while (RedisModule_Scan(ctx, cursor, detachScanned, NULL)) {
+  }
+  RedisModule_ScanCursorDestroy(cursor);
+}
+
+/* An O(keys) walk, but no peer is touched: the bio thread still does the
+ * freeing that makes an async flush worth it. */
+static void flushingSwarms(RedisModuleCtx *ctx, RedisModuleEvent e,
+                           uint64_t sub, void *data) {
+  REDISMODULE_NOT_USED(e);
+  RedisModuleFlushInfo *fi = data;
+  if (sub != REDISMODULE_SUBEVENT_FLUSHDB_START || fi->sync) return;
+  if (fi->dbnum != -1) {
+    if (RedisModule_SelectDb(ctx, fi->dbnum) == REDISMODULE_OK) detachDb(ctx);
+    return;
+  }
+  for (int db = 0; RedisModule_SelectDb(ctx, db) == REDISMODULE_OK; db++) {
+    detachDb(ctx);
+  }
+}
+
+void TrackerTypeFree(void *value) {
+  if (pthread_equal(pthread_self(), MainThread) ||
+      trackerUdpListenerThread()) {
+    detachSwarm(value);
+  }
+  trackerLazyfreeSwarm(value);
+}
+
+void RedisTrackerInfo(RedisModuleInfoCtx *ctx, int for_crash_report) {
+  REDISMODULE_NOT_USED(for_crash_report);
+  RedisModule_InfoAddSection(ctx, "announce");
+  RedisModule_InfoAddFieldLongLong(ctx, "announces", tracker_stats.announces);
+  RedisModule_InfoAddFieldLongLong(ctx, "rate_limited",
+                                   tracker_stats.rate_limited);
+  RedisModule_InfoAddFieldULongLong(ctx, "offending_passkeys",
+                                    RedisModule_DictSize(Offenders));
+  RedisModule_InfoAddFieldLongLong(ctx, "rate_limited_untracked",
+                                   tracker_stats.rate_limited_untracked);
+  trackerUdpInfo(ctx);
+  trackerSnapshotInfo(ctx);
+  trackerLazyfreeInfo(ctx);
+  trackerExportInfo(ctx);
+  trackerRestoreInfo(ctx);
+  trackerPressureInfo(ctx);
+  trackerIntervalInfo(ctx);
+  trackerTraceInfo(ctx);
+  trackerTableInfo(ctx);
+  trackerShardInfo(ctx);
+  trackerDeltaInfo(ctx);
+}
 
 /* This function must be present on each Redis module. It is used in order
  * to register the commands into the Redis server. */
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
                        int argc) {
-  REDISMODULE_NOT_USED(argv);
-  REDISMODULE_NOT_USED(argc);
-
   if (RedisModule_Init(ctx, "redistracker", 1, REDISMODULE_APIVER_1) ==
       REDISMODULE_ERR)
     return REDISMODULE_ERR;
 
+  if (trackerLoadConfig(ctx, argv, argc) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
   if (RedisModule_CreateCommand(ctx, "announce",
                                 RedisTrackerTypeAnnounce_RedisCommand,
                                 "write deny-oom", 1, 1, 1) == REDISMODULE_ERR)
     return REDISMODULE_ERR;
 
+  if (RedisModule_CreateCommand(ctx, "tracker.apply",
+                                RedisTrackerTypeApply_RedisCommand, "write",
+                                1, 1, 1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.config",
+                                RedisTrackerConfig_RedisCommand,
+                                "admin fast", 0, 0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.passkey",
+                                RedisTrackerPasskey_RedisCommand,
+                                "write deny-oom fast", 0, 0,
+                                0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.infohash",
+                                RedisTrackerInfohash_RedisCommand,
+                                "write deny-oom fast", 0, 0,
+                                0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.offenders",
+                                RedisTrackerOffenders_RedisCommand, "admin",
+                                0, 0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.accounting",
+                                RedisTrackerAccounting_RedisCommand, "write",
+                                0, 0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.unique",
+                                RedisTrackerUnique_RedisCommand, "readonly",
+                                0, 0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.topk",
+                                RedisTrackerTopk_RedisCommand, "readonly", 0,
+                                0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.scrapeall",
+                                RedisTrackerScrapeAll_RedisCommand,
+                                "readonly", 0, 0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.export",
+                                RedisTrackerExport_RedisCommand, "admin", 0,
+                                0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.trace",
+                                RedisTrackerTrace_RedisCommand, "admin", 0,
+                                0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.replay",
+                                RedisTrackerReplay_RedisCommand,
+                                "admin write deny-oom", 0, 0,
+                                0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "tracker.slowlog",
+                                RedisTrackerSlowlog_RedisCommand, "admin", 0,
+                                0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "announce.udp",
+                                RedisTrackerAnnounceUdp_RedisCommand,
+                                "write deny-oom", 0, 0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
   RedisModuleTypeMethods tm = {
       .version = REDISMODULE_TYPE_METHOD_VERSION,
       .rdb_load = TrackerTypeRdbLoad,
@@ -428,11 +1652,44 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
       .free = TrackerTypeFree,
       .mem_usage = TrackerTypeMemUsage,
       .digest = NULL,
-      .aux_load = NULL,
-      .aux_save = NULL,
+      /* RDBs of a swarm-table server load either way. */
+      .aux_load = trackerTableAuxLoad,
+      .aux_save = tracker_config.swarm_table ? trackerTableAuxSave : NULL,
+      .aux_save_triggers = REDISMODULE_AUX_AFTER_RDB,
   };
   RedisTrackerType = RedisModule_CreateDataType(ctx, "TrackType", 1, &tm);
   TrackerNoneString = RedisModule_CreateString(NULL, "NONE", 4);
+  PendingEffects = RedisModule_CreateDict(NULL);
+  PendingEffectsCtx = RedisModule_GetDetachedThreadSafeContext(ctx);
+  if (RedisModule_RegisterCommandFilter(ctx, flushPendingEffectsFilter, 0) ==
+      NULL) {
+    return REDISMODULE_ERR;
+  }
+  MainThread = pthread_self();
+  /* table.c has the event to itself in swarm-table mode, where swarms are
+   * no keys and are torn down on the main thread anyway. */
+  if (!tracker_config.swarm_table) {
+    RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_FlushDB,
+                                       flushingSwarms);
+  }
+  trackerAdmissionInit();
+  trackerTableInit(ctx);
+  trackerShardInit(ctx);
+  trackerAccountingInit(ctx);
+  trackerSnapshotInit(ctx);
+  trackerLazyfreeInit(ctx);
+  trackerDeltaInit();
+  trackerScrapeInit();
+  trackerTopkInit(ctx);
+  trackerHllInit();
+  trackerRestoreInit(ctx);
+  trackerPressureInit(ctx);
+  trackerIntervalInit(ctx);
+  if (trackerUdpInit(ctx) == REDISMODULE_ERR) return REDISMODULE_ERR;
+  Offenders = RedisModule_CreateDict(NULL);
+
+  if (RedisModule_RegisterInfoFunc(ctx, RedisTrackerInfo) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
   if (RedisTrackerType == NULL) return REDISMODULE_ERR;
 
   return REDISMODULE_OK;
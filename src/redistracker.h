@@ -9,40 +9,511 @@
 #include "redismodule.h"
 
 /* ========================== Internal data structure  =======================*/
+/* Every swarm key lives at least TRACKER_KEY_TTL seconds after its last
+ * announce and at most TRACKER_KEY_TTL + TRACKER_KEY_TTL_SLACK seconds. */
+#define TRACKER_KEY_TTL 1800
+#define TRACKER_KEY_TTL_SLACK 300
+
+
 typedef struct Peer {
   uint8_t use_v4;
   uint8_t use_v6;
+  uint8_t has_stats; /* uploaded/downloaded/left were ever reported */
   uint8_t peer[6];
   uint8_t peer6[18];
+  /* Position in the peers / peers6 pool of the generation holding us. */
+  uint32_t idx4;
+  uint32_t idx6;
+  /* Position in the same prefix pools, while the generation has them. */
+  uint32_t lidx4;
+  uint32_t lidx6;
+  mstime_t last_announce;
+  /* Last counters reported by the client, to compute accounting deltas. */
+  uint64_t uploaded;
+  uint64_t downloaded;
+  uint64_t left;
 } peer;
 
+/* Dense array of the peers of one generation that have an address of one
+ * family, so responses can sample it in O(numwant). */
+typedef struct PeerPool {
+  peer **items;
+  uint32_t len;
+  uint32_t cap;
+} PeerPool;
+
 typedef struct Dict {
   RedisModuleDict *table;
   uint64_t when_to_die;
-  int32_t v4_seeder;
-  int32_t v6_seeder;
+  PeerPool pool4;     /* peers with use_v4 */
+  PeerPool pool6;     /* peers with use_v6 */
+  /* /24 and /48 prefix -> PeerPool of the peers in it, NULL unless
+   * locality-fraction is set. */
+  RedisModuleDict *local4;
+  RedisModuleDict *local6;
+  int32_t complete;   /* peers that reported left == 0 */
+  int32_t incomplete; /* everybody else */
 } dict;
 
 typedef struct SeedersObj {
   dict *d[2];
+  /* Absolute unix time in ms at which the key was last told to expire. Lets
+   * announce skip RedisModule_SetExpire while the remaining TTL is still
+   * above TRACKER_KEY_TTL. 0 means the key TTL has never been set. */
+  mstime_t expire_at;
+  /* Key name the swarm snapshot is published under, NULL if none. */
+  char *snapshot_key;
+  size_t snapshot_keylen;
+  int snapshot_dirty; /* waiting in the rebuild queue */
+  /* Changes not yet published on the delta channel, NULL if none. */
+  struct TrackerDelta *delta;
+  uint64_t delta_seq; /* deltas published so far */
+  uint64_t downloaded; /* completed events, for scrapes */
+  struct TrackerHll *hll; /* distinct passkeys, NULL until unique-peers */
+  /* Set once the swarm split or when it is a sub-swarm, NULL otherwise. */
+  struct TrackerShard *shard;
+  /* info_hash of a swarm-table swarm, empty for one held by a key. */
+  uint16_t keylen;
+  char key[];
 } SeedersObj;
 
+/* Announce events, see BEP 3. */
+#define TRACKER_EVENT_NONE 0
+#define TRACKER_EVENT_STARTED 1
+#define TRACKER_EVENT_STOPPED 2
+#define TRACKER_EVENT_COMPLETED 3
+
+/* Replicated announce effects, applied on replicas by TRACKER.APPLY.
+ * Wire format: <op:1> <flags:1> [peer:6] [peer6:18] [uploaded:8 downloaded:8
+ * left:8] */
+#define TRACKER_EFFECT_UPDATE 'U'
+#define TRACKER_EFFECT_REMOVE 'D'
+#define TRACKER_EFFECT_HAS_V4 (1 << 0)
+#define TRACKER_EFFECT_HAS_V6 (1 << 1)
+#define TRACKER_EFFECT_HAS_STATS (1 << 2)
+#define TRACKER_EFFECT_COMPLETED (1 << 3) /* count a download */
+#define TRACKER_EFFECT_MAX_LEN (2 + 6 + 18 + 24)
+
+/* ========================== Module configuration ==========================*/
+typedef struct TrackerConfig {
+  /* Replicate at most one effect per peer per event loop tick. */
+  long long repl_coalesce;
+  /* Only admit passkeys registered with TRACKER.PASSKEY ADD. */
+  long long passkey_filter;
+  /* Only admit info_hashes registered with TRACKER.INFOHASH ADD. */
+  long long infohash_filter;
+  /* Aggregate per passkey uploaded/downloaded deltas. */
+  long long accounting;
+  /* Flush period of the deltas into hashes, 0 to only drain by command. */
+  long long accounting_flush_ms;
+  /* Max users credited per flush timer tick. */
+  long long accounting_flush_batch;
+  /* Hash key prefix the deltas are credited to, followed by the passkey. */
+  char *accounting_prefix;
+  /* Seconds under which a plain re-announce from the same address is not
+   * applied, 0 to disable. Raised to half of long intervals handed out, see
+   * interval.c. */
+  long long min_interval;
+  /* Refuse such announces with an error instead of an empty response. */
+  long long rate_limit_error;
+  /* Passkeys TRACKER.OFFENDERS counts refused announces of, further ones
+   * are only counted in INFO. */
+  long long offenders_max;
+  /* Seconds clients are told to wait between announces, and the start
+   * value of the adaptive interval. */
+  long long announce_interval;
+  /* Peers returned per family when the client does not say. */
+  long long numwant_default;
+  /* Upper bound of peers returned per family. */
+  long long numwant_max;
+  /* Key of the UDP connection ids, shared by every node a relay may forward
+   * to. Empty to use a random one. */
+  char *udp_secret;
+  /* "<ip>:<port>" or "[<ipv6>]:<port>" to serve BEP 15 from a module thread,
+   * empty for none. Module argument only, read at load time. */
+  char *udp_listen;
+  /* Rebuild period of the swarm snapshots read by other threads, 0 to not
+   * publish any. */
+  long long snapshot_ms;
+  /* Generations and swarms with more peers than this are freed by a
+   * background thread, 0 to always free them inline. */
+  long long lazyfree_threshold;
+  /* TRACKER.EXPORT file to reload the swarms from at startup, empty for
+   * none. Module argument only, read at load time. */
+  char *restore_file;
+  /* Pub/Sub channel prefix the per swarm deltas are published under,
+   * followed by the info_hash. Empty to not publish any. */
+  char *delta_channel;
+  /* Hottest swarms tracked for TRACKER.TOPK, 0 to not track any. */
+  long long topk_size;
+  /* Period after which announce counts of TRACKER.TOPK are halved. */
+  long long topk_halflife_ms;
+  /* Estimate distinct passkeys per swarm and hour / day for
+   * TRACKER.UNIQUE. */
+  long long unique_peers;
+  /* Percentage of numwant filled with peers from the announcing peer's /24
+   * or /48 first, 0 to sample the whole swarm uniformly. */
+  long long locality_fraction;
+  /* Used memory percentages of maxmemory from which, in addition to what
+   * the levels below do, 1) new generations live pressure-generation-ttl,
+   * 2) swarms take at most pressure-max-peers, 3) announces creating a
+   * swarm are refused, 4) clients are told pressure-interval. 0 disables a
+   * level. */
+  long long pressure_level1;
+  long long pressure_level2;
+  long long pressure_level3;
+  long long pressure_level4;
+  /* Seconds a generation lives from pressure level 1. */
+  long long pressure_generation_ttl;
+  /* Peers a swarm takes from pressure level 2. */
+  long long pressure_max_peers;
+  /* Seconds clients are told to wait between announces from level 4. */
+  long long pressure_interval;
+  /* Announces per second the adaptive interval aims for, 0 to always hand
+   * out announce-interval. */
+  long long announce_target_qps;
+  /* Bounds of the adaptive interval, in seconds. */
+  long long announce_interval_min;
+  long long announce_interval_max;
+  /* Percentage by which each handed out interval is randomly moved up or
+   * down. */
+  long long announce_jitter;
+  /* Size at which a TRACKER.TRACE file stops growing, 0 for no limit. */
+  long long trace_max_bytes;
+  /* Key swarms by the raw info_hash, decoding hex and URL-encoded ones.
+   * Not in cluster mode, see infohash.c. */
+  long long infohash_normalize;
+  /* Keep swarms in one module table instead of a key each. Module argument
+   * only, read at load time. */
+  long long swarm_table;
+  /* Announces taking at least this many microseconds go to TRACKER.SLOWLOG,
+   * -1 to log none. */
+  long long slowlog_log_slower_than;
+  /* Entries TRACKER.SLOWLOG keeps. */
+  long long slowlog_max_len;
+  /* Peers at which a swarm splits into sub-swarms, 0 to never split. */
+  long long shard_threshold;
+  /* Sub-swarms a swarm splits into. */
+  long long shard_count;
+  /* Peers per family a sub-swarm tells its siblings about, and how often
+   * in ms. */
+  long long shard_digest_peers;
+  long long shard_digest_ms;
+} TrackerConfig;
+
+extern TrackerConfig tracker_config;
+
+/* Counters exported in INFO. */
+typedef struct TrackerStats {
+  long long announces;
+  long long rate_limited;
+  long long rate_limited_untracked; /* of passkeys past offenders-max */
+} TrackerStats;
+
+extern TrackerStats tracker_stats;
+
+int trackerLoadConfig(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+
+/* ========================== Swarm table ==================================*/
+typedef void (*TrackerTableScanCB)(SeedersObj *o, void *privdata);
+
+void trackerTableInit(RedisModuleCtx *ctx);
+void trackerTableInfo(RedisModuleInfoCtx *ctx);
+int trackerTableEnabled(void);
+SeedersObj *trackerTableGet(const char *key, size_t len);
+SeedersObj *trackerTableAdd(const char *key, size_t len);
+void trackerTableDel(SeedersObj *o);
+size_t trackerTableScan(size_t cursor, size_t count, TrackerTableScanCB fn,
+                        void *privdata);
+size_t trackerTableSize(void);
+void trackerTableAuxSave(RedisModuleIO *rdb, int when);
+int trackerTableAuxLoad(RedisModuleIO *rdb, int encver, int when);
+
+/* ========================== Info hash keys ===============================*/
+RedisModuleString *trackerInfohashKey(RedisModuleCtx *ctx,
+                                      RedisModuleString *info_hash);
+
+/* ========================== Admission filters ============================*/
+typedef struct TrackerSet TrackerSet;
+
+TrackerSet *trackerSetCreate(void);
+void trackerSetRelease(TrackerSet *s);
+void trackerSetClear(TrackerSet *s);
+size_t trackerSetSize(TrackerSet *s);
+int trackerSetContains(TrackerSet *s, const char *key, size_t len);
+int trackerSetAdd(TrackerSet *s, const char *key, size_t len);
+int trackerSetDel(TrackerSet *s, const char *key, size_t len);
+
+void trackerAdmissionInit(void);
+const char *trackerAdmit(RedisModuleString *info_hash,
+                         RedisModuleString *passkey);
+
+/* ========================== Transfer accounting ==========================*/
+void trackerAccountingInit(RedisModuleCtx *ctx);
+void trackerAccount(RedisModuleString *passkey, uint64_t uploaded,
+                    uint64_t downloaded);
+void updatePeerStats(peer *p, RedisModuleString *passkey, int event,
+                     uint64_t uploaded, uint64_t downloaded, uint64_t left);
+
 peer *createPeerObject(void);
 void releasePeerObject(peer *o);
 dict *createDictObject(void);
 void releaseDictObject(dict *o);
+void releaseLocality(dict *o);
 SeedersObj *createSeedersObject(void);
+SeedersObj *createSeedersObjectWithKey(const char *key, size_t len);
 void releaseSeedersObject(SeedersObj *o);
 
 /* ========================== Common  func =============================*/
+uint64_t trackerHash64(const void *key, size_t len, uint64_t seed);
 void seedersCompaction(SeedersObj *s);
+int refreshKeyTTL(RedisModuleKey *key, SeedersObj *o);
 int parseIPV4(RedisModuleString *str, uint8_t *res, uint8_t **has_v4);
 int parseIPV6(RedisModuleString *str, uint8_t *res, uint8_t **has_v6);
-void updateIP(SeedersObj *o, RedisModuleString *passkey, uint8_t *v4,
-              uint8_t *v6, uint16_t port);
+peer *updateIP(SeedersObj *o, RedisModuleString *passkey, uint8_t *v4,
+               uint8_t *v6, uint16_t port);
+peer *lookupPeer(SeedersObj *o, RedisModuleString *passkey);
+peer *detachPeer(SeedersObj *o, RedisModuleString *passkey);
+int removePeer(SeedersObj *o, RedisModuleString *passkey);
+int insertPeer(dict *d, const char *passkey, size_t len, peer *p);
+void setPeerStats(SeedersObj *o, peer *p, RedisModuleString *passkey,
+                  int event, uint64_t uploaded, uint64_t downloaded,
+                  uint64_t left);
+size_t sampleSwarmPeers(SeedersObj *o, peer *self, size_t numwant,
+                        uint8_t *out, int v6);
+size_t samplePeerFamily(SeedersObj *o, peer *self, size_t numwant,
+                        uint8_t *out, int v6);
+void samplePeers(SeedersObj *o, peer *self, long numwant, uint8_t *out4,
+                 size_t *n4, uint8_t *out6, size_t *n6);
+size_t bencodeAnnounce(char *buf, SeedersObj *o, peer *self, long numwant);
+size_t bencodeAnnounceMaxLen(long numwant);
+size_t packEffect(uint8_t *buf, int op, peer *p);
+void replicateEffect(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                     RedisModuleString *passkey, const uint8_t *effect,
+                     size_t len, mstime_t expire_at);
+
+/* ========================== Announce core =============================*/
+/* A parsed announce, whatever protocol it came in with. */
+typedef struct TrackerAnnounce {
+  RedisModuleString *info_hash;
+  RedisModuleString *passkey;
+  uint8_t *v4; /* NULL when the peer has no address of that family */
+  uint8_t *v6;
+  uint16_t port;
+  int event;
+  int stats; /* uploaded, downloaded and left were reported */
+  uint64_t uploaded;
+  uint64_t downloaded;
+  uint64_t left;
+  long long numwant;
+  int redirect; /* may be sent to a sub-swarm, see trackerShardSplit */
+} TrackerAnnounce;
+
+#define TRACKER_ANNOUNCE_OK 0
+#define TRACKER_ANNOUNCE_RATE_LIMITED 1
+#define TRACKER_ANNOUNCE_WRONGTYPE 2
+#define TRACKER_ANNOUNCE_REFUSED 3 /* new swarm under memory pressure */
+#define TRACKER_ANNOUNCE_SHARDED 4 /* swarm split, see trackerShardRedirect */
+
+int trackerAnnounce(RedisModuleCtx *ctx, TrackerAnnounce *req,
+                    SeedersObj **swarm, peer **self);
+SeedersObj *trackerLookupSwarm(RedisModuleCtx *ctx,
+                               RedisModuleString *info_hash);
+SeedersObj *trackerSwarmFromKey(RedisModuleKey *key);
+void trackerSetSwarm(RedisModuleKey *key, SeedersObj *o);
+
+/* ========================== Swarm snapshots ==============================*/
+/* Immutable copy of a swarm for readers that do not hold the GIL. */
+typedef struct SwarmSnapshot {
+  mstime_t built_at;
+  int32_t complete;
+  int32_t incomplete;
+  uint64_t downloaded;
+  uint32_t n4;
+  uint32_t n6;
+  uint8_t *peers4; /* n4 compact IPv4 peers, 6 bytes each */
+  uint8_t *peers6; /* n6 compact IPv6 peers, 18 bytes each */
+  char *key;
+  size_t keylen;
+  char data[];
+} SwarmSnapshot;
+
+void trackerSnapshotInit(RedisModuleCtx *ctx);
+void trackerSnapshotInfo(RedisModuleInfoCtx *ctx);
+void trackerSnapshotTouch(RedisModuleString *keyname, SeedersObj *o);
+void trackerSnapshotDrop(SeedersObj *o);
+/* Reader threads register once, then bracket every use of what
+ * trackerSnapshotGet returns with Enter / Leave. */
+int trackerSnapshotReader(void);
+void trackerSnapshotEnter(int reader);
+void trackerSnapshotLeave(int reader);
+const SwarmSnapshot *trackerSnapshotGet(const char *key, size_t len);
+
+/* ========================== Lazy freeing =================================*/
+void trackerLazyfreeInit(RedisModuleCtx *ctx);
+void trackerLazyfreeInfo(RedisModuleInfoCtx *ctx);
+void trackerLazyfreeDict(dict *d);
+void trackerLazyfreeSwarm(SeedersObj *o);
+
+/* ========================== Swarm export =================================*/
+/* TRACKER.EXPORT file, integers little endian:
+ *   header  "RTRKEXP2" <created_ms:8> <db:4>
+ *   swarm   'S' <keylen:4> <key> <expire_at:8> <when_to_die d[0]:8>
+ *           <when_to_die d[1]:8> <npeers:4>, then npeers peers
+ *   peer    <generation:1> <flags:1> <passkeylen:2> <passkey> [peer:6]
+ *           [peer6:18] <last_announce:8> [uploaded:8 downloaded:8 left:8]
+ *   end     'E' <swarms:8> <peers:8>
+ * where flags are the TRACKER_EFFECT_HAS_* bits saying which optional
+ * fields follow, and db is the db the swarms were exported from. */
+#define TRACKER_EXPORT_MAGIC "RTRKEXP2"
+#define TRACKER_EXPORT_SWARM 'S'
+#define TRACKER_EXPORT_END 'E'
+
+void trackerExportInfo(RedisModuleInfoCtx *ctx);
+
+/* ========================== Unique peers =================================*/
+struct TrackerHll;
+
+void trackerHllInit(void);
+void trackerHllAnnounce(SeedersObj *o, RedisModuleString *passkey);
+void trackerHllFree(struct TrackerHll *hll);
+
+/* ========================== Hot swarms ===================================*/
+void trackerTopkInit(RedisModuleCtx *ctx);
+void trackerTopkAnnounce(RedisModuleString *info_hash);
+
+/* ========================== Full scrape ==================================*/
+void trackerScrapeInit(void);
+
+/* ========================== Swarm deltas =================================*/
+/* Message published on <delta-channel><info_hash>:
+ *   <seq:8> followed by records, in the order they happened
+ *   'P' <passkeylen:2> <passkey> <effect>   peer updated or removed
+ *   'R' <when_to_die:8>                     generations rotated
+ * where seq counts the messages of the swarm, so a gap means one was lost,
+ * effect is a TRACKER.APPLY effect carrying the state of the peer at the
+ * end of the tick, and when_to_die is the one of the new d[1]. Integers
+ * are little endian, except inside the effect. */
+#define TRACKER_DELTA_PEER 'P'
+#define TRACKER_DELTA_ROTATE 'R'
+
+void trackerDeltaInit(void);
+void trackerDeltaInfo(RedisModuleInfoCtx *ctx);
+void trackerDeltaPeer(SeedersObj *o, RedisModuleString *passkey, int op);
+void trackerDeltaRotate(SeedersObj *o);
+void trackerDeltaTouch(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                       SeedersObj *o);
+void trackerDeltaDrop(SeedersObj *o);
+
+/* ========================== Warm restart =================================*/
+void trackerRestoreInit(RedisModuleCtx *ctx);
+void trackerRestoreInfo(RedisModuleInfoCtx *ctx);
+
+/* ========================== Memory pressure ==============================*/
+void trackerPressureInit(RedisModuleCtx *ctx);
+void trackerPressureInfo(RedisModuleInfoCtx *ctx);
+uint64_t trackerPressureTtl(uint64_t ttl);
+int trackerPressureAdmitPeer(size_t size);
+int trackerPressureAdmitSwarm(void);
+long long trackerPressureInterval(long long interval);
+
+/* ========================== Adaptive interval ============================*/
+void trackerIntervalInit(RedisModuleCtx *ctx);
+void trackerIntervalInfo(RedisModuleInfoCtx *ctx);
+long long trackerAnnounceInterval(SeedersObj *o);
+long long trackerMinInterval(SeedersObj *o);
+uint64_t trackerGenerationTtl(void);
+
+/* ========================== Announce traces ==============================*/
+/* TRACKER.TRACE file, integers little endian:
+ *   header    "RTRKTRC2" <started_ms:8>
+ *   announce  'A' <ms:8> <db:4> <elapsed_us:4> <result:1> <event:1>
+ *             <flags:1> <port:2> <numwant:4> [v4:4] [v6:16] [uploaded:8
+ *             downloaded:8 left:8] <infohashlen:2> <info_hash>
+ *             <passkeylen:2> <passkey>
+ * where db is the one the announce went to, flags are the
+ * TRACKER_EFFECT_HAS_* bits saying which optional fields follow, result is
+ * what trackerAnnounce returned and elapsed_us how long it took. */
+#define TRACKER_TRACE_MAGIC "RTRKTRC2"
+#define TRACKER_TRACE_ANNOUNCE 'A'
+
+void trackerTraceInfo(RedisModuleInfoCtx *ctx);
+int trackerTracing(void);
+void trackerTraceAnnounce(RedisModuleCtx *ctx, TrackerAnnounce *req, int res,
+                          long long elapsed_us);
+long long trackerMicroseconds(void);
+mstime_t trackerMilliseconds(void);
+
+/* ========================== Announce slowlog ============================*/
+#define TRACKER_SLOWLOG_PARSE 0
+#define TRACKER_SLOWLOG_LOOKUP 1
+#define TRACKER_SLOWLOG_COMPACTION 2
+#define TRACKER_SLOWLOG_UPDATE 3
+#define TRACKER_SLOWLOG_REPLICATE 4
+#define TRACKER_SLOWLOG_REPLY 5
+#define TRACKER_SLOWLOG_STAGES 6
+
+void trackerSlowlogBegin(void);
+void trackerSlowlogStage(int stage);
+void trackerSlowlogReleased(size_t peers);
+void trackerSlowlogResize(void);
+void trackerSlowlogEnd(RedisModuleString *info_hash, SeedersObj *o,
+                       long long numwant);
+
+/* ========================== Sub-swarm sharding ===========================*/
+#define TRACKER_SHARD_MAX 64
+
+typedef struct TrackerShard TrackerShard;
+
+void trackerShardInit(RedisModuleCtx *ctx);
+void trackerShardInfo(RedisModuleInfoCtx *ctx);
+size_t trackerShardTag(const char *key, size_t len, uint32_t *index);
+void trackerShardAnnounce(SeedersObj *o, RedisModuleString *keyname);
+int trackerShardSplit(SeedersObj *o);
+RedisModuleString *trackerShardRedirect(RedisModuleCtx *ctx, SeedersObj *o,
+                                        RedisModuleString *passkey);
+RedisModuleString *trackerShardSubswarm(RedisModuleCtx *ctx, SeedersObj *o,
+                                        RedisModuleString *passkey);
+size_t trackerShardSample(SeedersObj *o, size_t numwant, uint8_t *out,
+                          int v6);
+void trackerShardCounts(SeedersObj *o, int *complete, int *incomplete);
+void trackerShardDrop(SeedersObj *o);
+
+/* ========================== UDP tracker protocol =========================*/
+int trackerUdpInit(RedisModuleCtx *ctx);
+void trackerUdpInfo(RedisModuleInfoCtx *ctx);
+int trackerUdpListenerThread(void);
 
 /* ================= "redistracker" type commands=======================*/
 int RedisTrackerTypeAnnounce_RedisCommand(RedisModuleCtx *ctx,
                                           RedisModuleString **argv, int argc);
+int RedisTrackerTypeApply_RedisCommand(RedisModuleCtx *ctx,
+                                       RedisModuleString **argv, int argc);
+int RedisTrackerConfig_RedisCommand(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc);
+int RedisTrackerPasskey_RedisCommand(RedisModuleCtx *ctx,
+                                     RedisModuleString **argv, int argc);
+int RedisTrackerInfohash_RedisCommand(RedisModuleCtx *ctx,
+                                      RedisModuleString **argv, int argc);
+int RedisTrackerOffenders_RedisCommand(RedisModuleCtx *ctx,
+                                       RedisModuleString **argv, int argc);
+int RedisTrackerAccounting_RedisCommand(RedisModuleCtx *ctx,
+                                        RedisModuleString **argv, int argc);
+int RedisTrackerUnique_RedisCommand(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc);
+int RedisTrackerTopk_RedisCommand(RedisModuleCtx *ctx,
+                                  RedisModuleString **argv, int argc);
+int RedisTrackerScrapeAll_RedisCommand(RedisModuleCtx *ctx,
+                                       RedisModuleString **argv, int argc);
+int RedisTrackerExport_RedisCommand(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc);
+int RedisTrackerTrace_RedisCommand(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv, int argc);
+int RedisTrackerReplay_RedisCommand(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc);
+int RedisTrackerAnnounceUdp_RedisCommand(RedisModuleCtx *ctx,
+                                         RedisModuleString **argv, int argc);
+int RedisTrackerSlowlog_RedisCommand(RedisModuleCtx *ctx,
+                                     RedisModuleString **argv, int argc);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE /* madvise */
+#define REDISMODULE_EXPERIMENTAL_API
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "redistracker.h"
+
+/* ========================== Warm restart =================================*/
+/* With restore-file set, the TRACKER.EXPORT file is mapped at load time and
+ * turned back into live swarms as soon as the event loop starts, which is
+ * after Redis loaded its own RDB / AOF. Our RDB callbacks keep no peers, so
+ * keys loaded from there are empty swarms that get filled here; keys that
+ * hold anything else are left alone. The mapping is walked once, in order,
+ * and every peer record is copied straight into its peer struct, so no
+ * RedisModuleString is created per peer.
+ *
+ * The walk goes in RESTORE_SLICE_MS slices with the event loop running in
+ * between, so the server keeps serving while millions of peers come back;
+ * a slice may stop in the middle of a swarm. Swarms can thus get announces
+ * before or while they are restored: restored peers are merged in, into the
+ * older generation if it outlives the one they were exported from and the
+ * newer one otherwise, unless the peer announced meanwhile. Peers of
+ * generations that died while the server was down are skipped, as are
+ * whole expired swarms.
+ * Swarms go back into the db named in the header, the swarm table has no
+ * dbs and ignores it.
+ *
+ * Our RDB has no peers either, so a full sync would only give replicas
+ * empty swarms: each restored swarm is sent to replicas and the AOF as
+ * TRACKER.APPLY effects of its peers, like announces are. Replicas never
+ * restore by themselves. */
+#define RESTORE_HEADER_LEN 20
+#define RESTORE_TRAILER_LEN 17
+#define RESTORE_SLICE_MS 10
+/* Peers read between two looks at the clock. */
+#define RESTORE_CLOCK_EVERY 1024
+
+typedef struct RestoreReader {
+  const uint8_t *p;
+  const uint8_t *end;
+  int err;
+} RestoreReader;
+
+static struct {
+  uint8_t *map;
+  size_t len;
+  char *path;
+  size_t pos; /* of the next record, 0 until the first slice */
+  int db;
+  mstime_t started_at;
+  /* The swarm record being read, keyname is NULL between records. */
+  RedisModuleString *keyname;
+  SeedersObj *o; /* NULL when its peers are only read past */
+  int created;
+  uint64_t when_to_die[2];
+  uint32_t peers_left;
+  uint32_t inserted;
+  /* Outcome, for INFO. */
+  const char *status; /* "none", "pending", "ok" or "err" */
+  long long swarms;
+  long long peers;
+  long long expired_peers;
+  long long skipped_swarms;
+  mstime_t duration_ms;
+} Restore = {.status = "none"};
+
+static const uint8_t *restoreTake(RestoreReader *r, size_t len) {
+  if (r->err || (size_t)(r->end - r->p) < len) {
+    r->err = 1;
+    return NULL;
+  }
+  const uint8_t *p = r->p;
+  r->p += len;
+  return p;
+}
+
+static uint64_t restoreLE(RestoreReader *r, int len) {
+  const uint8_t *p = restoreTake(r, len);
+  uint64_t v = 0;
+  if (p == NULL) return 0;
+  for (int i = 0; i < len; i++) v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+/* Reads one peer record, NULL once the reader failed. */
+static peer *restorePeer(RestoreReader *r, int *gen, const char **passkey,
+                         size_t *len) {
+  *gen = restoreLE(r, 1);
+  int flags = restoreLE(r, 1);
+  *len = restoreLE(r, 2);
+  *passkey = (const char *)restoreTake(r, *len);
+  const uint8_t *v4 = NULL, *v6 = NULL, *stats = NULL;
+  if (flags & TRACKER_EFFECT_HAS_V4) v4 = restoreTake(r, 6);
+  if (flags & TRACKER_EFFECT_HAS_V6) v6 = restoreTake(r, 18);
+  mstime_t last_announce = restoreLE(r, 8);
+  if (flags & TRACKER_EFFECT_HAS_STATS) stats = restoreTake(r, 24);
+  if (r->err || *gen > 1) {
+    r->err = 1;
+    return NULL;
+  }
+  peer *p = createPeerObject();
+  if (v4) {
+    p->use_v4 = 1;
+    memcpy(p->peer, v4, 6);
+  }
+  if (v6) {
+    p->use_v6 = 1;
+    memcpy(p->peer6, v6, 18);
+  }
+  p->last_announce = last_announce;
+  if (stats) {
+    RestoreReader s = {stats, stats + 24, 0};
+    p->has_stats = 1;
+    p->uploaded = restoreLE(&s, 8);
+    p->downloaded = restoreLE(&s, 8);
+    p->left = restoreLE(&s, 8);
+  }
+  return p;
+}
+
+static size_t restoreSwarmPeers(SeedersObj *o) {
+  return RedisModule_DictSize(o->d[0]->table) +
+         RedisModule_DictSize(o->d[1]->table);
+}
+
+/* The swarm of the record being read, as long as it is still the one that
+ * was found or created when the record began. */
+static SeedersObj *restoreCurrent(RedisModuleCtx *ctx, RedisModuleKey **key) {
+  *key = NULL;
+  if (Restore.o == NULL) return NULL;
+  SeedersObj *o;
+  if (trackerTableEnabled()) {
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(Restore.keyname, &len);
+    o = trackerTableGet(name, len);
+  } else {
+    *key = RedisModule_OpenKey(ctx, Restore.keyname,
+                               REDISMODULE_READ | REDISMODULE_WRITE);
+    o = trackerSwarmFromKey(*key);
+  }
+  return o == Restore.o ? o : NULL;
+}
+
+/* Reads the swarm record under r and finds or creates its swarm, unless
+ * it expired or the key holds something else. */
+static void restoreBegin(RedisModuleCtx *ctx, RestoreReader *r) {
+  size_t keylen = restoreLE(r, 4);
+  const char *name = (const char *)restoreTake(r, keylen);
+  mstime_t expire_at = restoreLE(r, 8);
+  Restore.when_to_die[0] = restoreLE(r, 8);
+  Restore.when_to_die[1] = restoreLE(r, 8);
+  Restore.peers_left = restoreLE(r, 4);
+  if (r->err) return;
+
+  mstime_t now = RedisModule_Milliseconds();
+  Restore.keyname = RedisModule_CreateString(NULL, name, keylen);
+  Restore.o = NULL;
+  Restore.created = 0;
+  Restore.inserted = 0;
+  RedisModuleKey *key = NULL;
+  SeedersObj *o = NULL;
+  if (expire_at && expire_at <= now) {
+    /* Expired while we were down. */
+  } else if (trackerTableEnabled()) {
+    o = trackerTableGet(name, keylen);
+    if (o == NULL) {
+      o = trackerTableAdd(name, keylen);
+      Restore.created = o != NULL;
+    }
+  } else {
+    key = RedisModule_OpenKey(ctx, Restore.keyname,
+                              REDISMODULE_READ | REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+      o = createSeedersObject();
+      trackerSetSwarm(key, o);
+      Restore.created = 1;
+    } else {
+      o = trackerSwarmFromKey(key);
+    }
+  }
+
+  if (o) {
+    /* A generation is dead once now reaches its when_to_die, and if d[0]
+     * is the only dead one d[1] takes its place, as seedersCompaction
+     * does. Swarms that got peers from announces keep their own. */
+    if (restoreSwarmPeers(o) == 0) {
+      int shift = (uint64_t)now / 1000 >= Restore.when_to_die[0];
+      o->d[0]->when_to_die = Restore.when_to_die[shift];
+      if (!shift) o->d[1]->when_to_die = Restore.when_to_die[1];
+    }
+    if (expire_at > o->expire_at) {
+      if (key) RedisModule_SetExpire(key, expire_at - now);
+      o->expire_at = expire_at;
+    } else {
+      refreshKeyTTL(key, o);
+    }
+  }
+  Restore.o = o;
+  RedisModule_CloseKey(key);
+}
+
+/* Sends a restored peer on as an effect, the first one of a swarm with its
+ * expiry. */
+static void restoreReplicate(RedisModuleCtx *ctx, SeedersObj *o,
+                             const char *passkey, size_t len, peer *p) {
+  uint8_t effect[TRACKER_EFFECT_MAX_LEN];
+  size_t efflen = packEffect(effect, TRACKER_EFFECT_UPDATE, p);
+  if (Restore.inserted == 1 && o->expire_at) {
+    RedisModule_Replicate(ctx, "TRACKER.APPLY", "sbbl", Restore.keyname,
+                          passkey, len, (const char *)effect, efflen,
+                          o->expire_at);
+  } else {
+    RedisModule_Replicate(ctx, "TRACKER.APPLY", "sbb", Restore.keyname,
+                          passkey, len, (const char *)effect, efflen);
+  }
+}
+
+/* Done with the swarm of the record: drops it if it was created here and
+ * got no peer after all. */
+static void restoreEnd(RedisModuleKey *key, SeedersObj *o) {
+  if (o && Restore.created && restoreSwarmPeers(o) == 0) {
+    if (key) {
+      RedisModule_DeleteKey(key);
+    } else {
+      trackerTableDel(o);
+    }
+  }
+  if (Restore.inserted) {
+    Restore.swarms++;
+  } else {
+    Restore.skipped_swarms++;
+  }
+  RedisModule_FreeString(NULL, Restore.keyname);
+  Restore.keyname = NULL;
+  Restore.o = NULL;
+}
+
+/* Reads peers of the current record until there are none left or the
+ * deadline passed. Peers already in the other generation, because they
+ * announced since the restore began, are left as they are. */
+static void restoreFill(RedisModuleCtx *ctx, RestoreReader *r,
+                        mstime_t deadline) {
+  RedisModuleKey *key;
+  SeedersObj *o = restoreCurrent(ctx, &key);
+  if (o) seedersCompaction(o);
+  uint64_t now_s = RedisModule_Milliseconds() / 1000;
+  for (uint32_t n = 1; Restore.peers_left; n++) {
+    if (n % RESTORE_CLOCK_EVERY == 0 &&
+        RedisModule_Milliseconds() >= deadline) {
+      break;
+    }
+    int gen;
+    const char *passkey;
+    size_t len;
+    peer *p = restorePeer(r, &gen, &passkey, &len);
+    if (p == NULL) break;
+    Restore.peers_left--;
+    if (o == NULL || now_s >= Restore.when_to_die[gen]) {
+      releasePeerObject(p);
+      if (o) Restore.expired_peers++;
+      continue;
+    }
+    int to = Restore.when_to_die[gen] > o->d[0]->when_to_die;
+    if (RedisModule_DictGetC(o->d[!to]->table, (void *)passkey, len,
+                             NULL) ||
+        insertPeer(o->d[to], passkey, len, p) == REDISMODULE_ERR) {
+      releasePeerObject(p);
+      continue;
+    }
+    Restore.peers++;
+    Restore.inserted++;
+    restoreReplicate(ctx, o, passkey, len, p);
+  }
+  if (o) trackerSnapshotTouch(Restore.keyname, o);
+  if (Restore.peers_left == 0 || r->err) restoreEnd(key, o);
+  RedisModule_CloseKey(key);
+}
+
+/* Drops the mapping, whatever was restored from it. */
+static void restoreUnmap(void) {
+  munmap(Restore.map, Restore.len);
+  Restore.map = NULL;
+}
+
+/* Restores for up to RESTORE_SLICE_MS, then lets the event loop run before
+ * the next slice. */
+static void restoreTimerHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  if (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_SLAVE) {
+    RedisModule_Log(ctx, "notice", "replica, not restoring swarms from %s",
+                    Restore.path);
+    Restore.status = Restore.pos ? "err" : "none";
+    if (Restore.keyname) restoreEnd(NULL, NULL);
+    restoreUnmap();
+    return;
+  }
+  if (Restore.pos == 0) {
+    RestoreReader h = {Restore.map + RESTORE_HEADER_LEN - 4,
+                       Restore.map + RESTORE_HEADER_LEN, 0};
+    Restore.db = restoreLE(&h, 4);
+    Restore.pos = RESTORE_HEADER_LEN;
+    Restore.started_at = RedisModule_Milliseconds();
+  }
+  if (!trackerTableEnabled() &&
+      RedisModule_SelectDb(ctx, Restore.db) == REDISMODULE_ERR) {
+    RedisModule_Log(ctx, "warning", "can't restore %s into missing db %d",
+                    Restore.path, Restore.db);
+    Restore.status = "err";
+    restoreUnmap();
+    return;
+  }
+  mstime_t deadline = RedisModule_Milliseconds() + RESTORE_SLICE_MS;
+  RestoreReader r = {Restore.map + Restore.pos,
+                     Restore.map + Restore.len - RESTORE_TRAILER_LEN, 0};
+  while (!r.err && RedisModule_Milliseconds() < deadline) {
+    if (Restore.keyname) {
+      restoreFill(ctx, &r, deadline);
+    } else if (r.p == r.end) {
+      break;
+    } else if (restoreLE(&r, 1) != TRACKER_EXPORT_SWARM) {
+      r.err = 1;
+    } else {
+      restoreBegin(ctx, &r);
+    }
+    Restore.pos = r.p - Restore.map;
+  }
+  if (!r.err && (r.p != r.end || Restore.keyname)) {
+    RedisModule_CreateTimer(ctx, 0, restoreTimerHandler, NULL);
+    return;
+  }
+  restoreUnmap();
+  Restore.duration_ms = RedisModule_Milliseconds() - Restore.started_at;
+  Restore.status = r.err ? "err" : "ok";
+  RedisModule_Log(ctx, r.err ? "warning" : "notice",
+                  "restored %lld swarms, %lld peers from %s in %lld ms%s",
+                  Restore.swarms, Restore.peers, Restore.path,
+                  (long long)Restore.duration_ms,
+                  r.err ? ", stopped at a corrupt record" : "");
+}
+
+/* Maps and checks the file, the swarms are created by a timer since keys
+ * can't be touched before Redis loaded its own data. */
+void trackerRestoreInit(RedisModuleCtx *ctx) {
+  const char *path = tracker_config.restore_file;
+  if (path[0] == '\0') return;
+  Restore.path = RedisModule_Strdup(path);
+  Restore.pos = 0;
+  Restore.status = "err";
+  Restore.swarms = Restore.peers = 0;
+  Restore.expired_peers = Restore.skipped_swarms = 0;
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    RedisModule_Log(ctx, "warning", "can't open restore file %s", path);
+    if (fd != -1) close(fd);
+    return;
+  }
+  size_t len = st.st_size;
+  uint8_t *map = MAP_FAILED;
+  if (len >= RESTORE_HEADER_LEN + RESTORE_TRAILER_LEN) {
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED ||
+      memcmp(map, TRACKER_EXPORT_MAGIC, 8) != 0 ||
+      map[len - RESTORE_TRAILER_LEN] != TRACKER_EXPORT_END) {
+    RedisModule_Log(ctx, "warning", "%s is not a complete tracker export",
+                    path);
+    if (map != MAP_FAILED) munmap(map, len);
+    return;
+  }
+  madvise(map, len, MADV_SEQUENTIAL);
+  Restore.map = map;
+  Restore.len = len;
+  Restore.status = "pending";
+  RedisModule_CreateTimer(ctx, 0, restoreTimerHandler, NULL);
+}
+
+void trackerRestoreInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "restore");
+  RedisModule_InfoAddFieldCString(ctx, "restore_status",
+                                  (char *)Restore.status);
+  RedisModule_InfoAddFieldLongLong(ctx, "restore_swarms", Restore.swarms);
+  RedisModule_InfoAddFieldLongLong(ctx, "restore_peers", Restore.peers);
+  RedisModule_InfoAddFieldLongLong(ctx, "restore_expired_peers",
+                                   Restore.expired_peers);
+  RedisModule_InfoAddFieldLongLong(ctx, "restore_skipped_swarms",
+                                   Restore.skipped_swarms);
+  RedisModule_InfoAddFieldLongLong(ctx, "restore_duration_ms",
+                                   Restore.duration_ms);
+}
@@ -0,0 +1,174 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include <strings.h>
+
+#include "redistracker.h"
+
+/* ========================== Full scrape ==================================*/
+/* TRACKER.SCRAPEALL walks the keyspace with RedisModule_Scan and returns the
+ * counters of every swarm it meets, packed, so a full scrape costs a few
+ * round trips instead of a SCAN plus a call per key. Only the per
+ * generation counters are read, never the peer tables.
+ *
+ * Module scan cursors can't be handed to clients, so they stay here and
+ * clients get an id instead. Cursors left idle for SCRAPEALL_CURSOR_IDLE_MS
+ * are reclaimed when a new scrape starts. With swarm-table on the table is
+ * walked instead, and the cursor is a slot. */
+#define SCRAPEALL_MAX_CURSORS 64
+#define SCRAPEALL_CURSOR_IDLE_MS 300000
+#define SCRAPEALL_DEFAULT_COUNT 100
+#define SCRAPEALL_MAX_COUNT 100000
+
+typedef struct ScrapeCursor {
+  RedisModuleScanCursor *cursor; /* NULL when walking the swarm table */
+  size_t slot;
+  mstime_t last_used;
+} ScrapeCursor;
+
+/* Cursor id -> ScrapeCursor. */
+static RedisModuleDict *ScrapeCursors;
+static unsigned long long ScrapeNextId = 1;
+
+typedef struct ScrapeBatch {
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+  long long visited;
+} ScrapeBatch;
+
+static inline void put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void scrapeRecord(ScrapeBatch *b, const char *name, size_t keylen,
+                         SeedersObj *o) {
+  if (keylen > UINT16_MAX) return;
+  size_t need = 2 + keylen + 12;
+  if (b->len + need > b->cap) {
+    b->cap = (b->len + need) * 2;
+    b->buf = RedisModule_Realloc(b->buf, b->cap);
+  }
+  uint8_t *p = b->buf + b->len;
+  p[0] = keylen >> 8;
+  p[1] = keylen & 0xff;
+  memcpy(p + 2, name, keylen);
+  p += 2 + keylen;
+  put32(p, o->d[0]->complete + o->d[1]->complete);
+  put32(p + 4, o->d[0]->incomplete + o->d[1]->incomplete);
+  put32(p + 8, o->downloaded);
+  b->len += need;
+}
+
+static void scrapeSwarm(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                        RedisModuleKey *key, void *privdata) {
+  REDISMODULE_NOT_USED(ctx);
+  ScrapeBatch *b = privdata;
+  b->visited++;
+  SeedersObj *o = key ? trackerSwarmFromKey(key) : NULL;
+  if (o == NULL) return;
+  size_t keylen;
+  const char *name = RedisModule_StringPtrLen(keyname, &keylen);
+  scrapeRecord(b, name, keylen, o);
+}
+
+static void scrapeTableSwarm(SeedersObj *o, void *privdata) {
+  scrapeRecord(privdata, o->key, o->keylen, o);
+}
+
+static void scrapeCursorFree(ScrapeCursor *sc) {
+  if (sc->cursor) RedisModule_ScanCursorDestroy(sc->cursor);
+  RedisModule_Free(sc);
+}
+
+static void scrapeCursorDel(unsigned long long id) {
+  ScrapeCursor *sc = NULL;
+  RedisModule_DictDelC(ScrapeCursors, &id, sizeof(id), &sc);
+  if (sc) scrapeCursorFree(sc);
+}
+
+/* Drops the cursors that clients walked away from. */
+static void scrapeCursorsExpire(mstime_t now) {
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(ScrapeCursors, "^", NULL, 0);
+  unsigned long long *id;
+  ScrapeCursor *sc;
+  while ((id = RedisModule_DictNextC(iter, NULL, (void **)&sc))) {
+    if (now - sc->last_used < SCRAPEALL_CURSOR_IDLE_MS) continue;
+    unsigned long long expired = *id;
+    scrapeCursorDel(expired);
+    RedisModule_DictIteratorReseekC(iter, ">", &expired, sizeof(expired));
+  }
+  RedisModule_DictIteratorStop(iter);
+}
+
+/* TRACKER.SCRAPEALL <cursor> [COUNT <n>]
+ *   -> [<next cursor>, <records>]
+ *
+ * Start with cursor 0 and go on until 0 comes back. COUNT is how many keys
+ * to visit, as for SCAN. Each record is <keylen:2> <key> <complete:4>
+ * <incomplete:4> <downloaded:4>, in network byte order. */
+int RedisTrackerScrapeAll_RedisCommand(RedisModuleCtx *ctx,
+                                       RedisModuleString **argv, int argc) {
+  if (argc != 2 && argc != 4) return RedisModule_WrongArity(ctx);
+  long long id, count = SCRAPEALL_DEFAULT_COUNT;
+  if (RedisModule_StringToLongLong(argv[1], &id) == REDISMODULE_ERR ||
+      id < 0) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid cursor");
+  }
+  if (argc == 4) {
+    if (strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "count")) {
+      return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+    }
+    if (RedisModule_StringToLongLong(argv[3], &count) == REDISMODULE_ERR ||
+        count < 1 || count > SCRAPEALL_MAX_COUNT) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid COUNT");
+    }
+  }
+
+  mstime_t now = RedisModule_Milliseconds();
+  unsigned long long cid = id;
+  ScrapeCursor *sc;
+  if (cid == 0) {
+    scrapeCursorsExpire(now);
+    if (RedisModule_DictSize(ScrapeCursors) >= SCRAPEALL_MAX_CURSORS) {
+      return RedisModule_ReplyWithError(
+          ctx, "ERR too many TRACKER.SCRAPEALL cursors in use");
+    }
+    sc = RedisModule_Alloc(sizeof(*sc));
+    sc->cursor =
+        trackerTableEnabled() ? NULL : RedisModule_ScanCursorCreate();
+    sc->slot = 0;
+    cid = ScrapeNextId++;
+    RedisModule_DictSetC(ScrapeCursors, &cid, sizeof(cid), sc);
+  } else {
+    sc = RedisModule_DictGetC(ScrapeCursors, &cid, sizeof(cid), NULL);
+    if (sc == NULL) {
+      return RedisModule_ReplyWithError(ctx,
+                                        "ERR unknown or expired cursor");
+    }
+  }
+  sc->last_used = now;
+
+  ScrapeBatch b = {NULL, 0, 0, 0};
+  int more = 1;
+  if (sc->cursor == NULL) {
+    sc->slot = trackerTableScan(sc->slot, count, scrapeTableSwarm, &b);
+    more = sc->slot != 0;
+  }
+  while (more && sc->cursor && b.visited < count) {
+    more = RedisModule_Scan(ctx, sc->cursor, scrapeSwarm, &b);
+  }
+  if (!more) {
+    scrapeCursorDel(cid);
+    cid = 0;
+  }
+  RedisModule_ReplyWithArray(ctx, 2);
+  RedisModule_ReplyWithLongLong(ctx, cid);
+  RedisModule_ReplyWithStringBuffer(ctx, b.buf ? (char *)b.buf : "", b.len);
+  RedisModule_Free(b.buf);
+  return REDISMODULE_OK;
+}
+
+void trackerScrapeInit(void) { ScrapeCursors = RedisModule_CreateDict(NULL); }
@@ -0,0 +1,430 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include "redistracker.h"
+
+/* ========================== Sub-swarm sharding ===========================*/
+/* A viral torrent is one key, so one cluster slot and one core. With
+ * shard-threshold set, a swarm reaching that many peers splits into
+ * shard-count sub-swarms, each its own key
+ *
+ *   {<base>:<k>}<info_hash>
+ *
+ * where base is 16 hex digits of a hash of the info_hash and k the
+ * sub-swarm. The hash tag puts each sub-swarm in its own slot, and the
+ * base keeps the sub-swarms of different torrents apart. The tag comes
+ * first because Cluster hashes the first {...} of a key, which a raw
+ * info_hash may contain too. A module can't write keys of other nodes, so
+ * the split swarm answers each HTTP announce with the error
+ * "SHARDED {<base>:<k>}" naming the sub-swarm of the passkey, which only
+ * depends on the info_hash and the passkey. Frontends prepend the tag to
+ * the info_hash, announce again, and may remember the tag of a passkey for
+ * an announce interval. Stops are not redirected: they detach the peer
+ * from the split swarm, where it may still be listed, and frontends that
+ * remembered a tag send them to the sub-swarm as well. The peers left in
+ * the split swarm age out with its generations. UDP announces can't be
+ * redirected: they go to the sub-swarm of their passkey when it lives on
+ * this node, and otherwise to the split swarm, which only updates the
+ * peers it already has and takes no new ones.
+ *
+ * Whether a swarm is split lives in this module only, it is neither
+ * replicated nor saved. After a failover, a restart or once the split swarm
+ * expired, the base key answers announces again and grows back until it
+ * splits anew; its sub-swarms, and the frontends still announcing to them,
+ * are unaffected since the tags come out the same.
+ *
+ * Sub-swarms answer with their own peers plus peers of their siblings, in
+ * proportion to the sizes of the siblings, and count the siblings in
+ * complete and incomplete. Every shard-digest-ms each sub-swarm on a master
+ * publishes a digest of its counts and a sample of shard-digest-peers peers
+ * per family over the cluster bus, and each node caches the digests it
+ * receives or publishes for three periods. Scrapes still count each key
+ * on its own. */
+#define SHARD_SEED 0x7368617264ULL
+#define SHARD_BASE_LEN 16
+#define SHARD_MSG_DIGEST 1
+#define SHARD_DIGEST_PERIODS 3
+
+typedef struct ShardDigest {
+  mstime_t received;
+  uint32_t complete;
+  uint32_t incomplete;
+  uint16_t n4;
+  uint16_t n6;
+  uint8_t peers[]; /* n4 compact v4 peers, then n6 v6 ones */
+} ShardDigest;
+
+/* The cached digests of the sub-swarms of one torrent. */
+typedef struct ShardGroup {
+  ShardDigest *digest[TRACKER_SHARD_MAX];
+} ShardGroup;
+
+struct TrackerShard {
+  SeedersObj *o;
+  int split;      /* o is the split swarm, else one of its sub-swarms */
+  uint32_t index; /* sub-swarm number, or how many a split swarm has */
+  struct TrackerShard *prev, *next; /* sub-swarms on this node */
+  size_t taglen; /* of key, the info_hash follows, 0 for a split swarm */
+  size_t keylen;
+  char key[];
+};
+
+static TrackerShard *ShardLocal;
+static RedisModuleDict *ShardGroups;
+
+static struct {
+  long long splits;
+  long long subswarms;
+  long long redirects;
+  long long digests_sent;
+  long long digests_received;
+  long long digests_cached;
+} ShardStats;
+
+static inline void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline uint16_t get16(const uint8_t *p) { return p[0] << 8 | p[1]; }
+
+static inline uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static uint64_t shardBase(const char *infohash, size_t len) {
+  return trackerHash64(infohash, len, SHARD_SEED);
+}
+
+/* Returns the length of the {<base>:<k>} tag starting key when it names a
+ * sub-swarm of the info_hash after it, 0 otherwise. */
+size_t trackerShardTag(const char *key, size_t len, uint32_t *index) {
+  if (len < SHARD_BASE_LEN + 5 || key[0] != '{' ||
+      key[SHARD_BASE_LEN + 1] != ':') {
+    return 0;
+  }
+  uint64_t base = 0;
+  for (size_t j = 1; j <= SHARD_BASE_LEN; j++) {
+    char c = key[j];
+    int v = c >= '0' && c <= '9'   ? c - '0'
+            : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                   : -1;
+    if (v < 0) return 0;
+    base = base << 4 | v;
+  }
+  size_t first = SHARD_BASE_LEN + 2, i = first;
+  uint32_t k = 0;
+  while (i < len && i < first + 2 && key[i] >= '0' && key[i] <= '9') {
+    k = k * 10 + key[i++] - '0';
+  }
+  if (i == first || (i == first + 2 && key[first] == '0') ||
+      k >= TRACKER_SHARD_MAX || i + 1 >= len || key[i] != '}') {
+    return 0;
+  }
+  i++;
+  if (base != shardBase(key + i, len - i)) return 0;
+  if (index) *index = k;
+  return i;
+}
+
+/* ------------------------- Digest cache ------------------------- */
+
+static mstime_t shardDigestTtl(void) {
+  return tracker_config.shard_digest_ms * SHARD_DIGEST_PERIODS;
+}
+
+static void shardStoreDigest(const char *infohash, size_t len,
+                             uint32_t index, ShardDigest *d) {
+  ShardGroup *g = RedisModule_DictGetC(ShardGroups, (char *)infohash, len,
+                                       NULL);
+  if (g == NULL) {
+    g = RedisModule_Calloc(1, sizeof(*g));
+    RedisModule_DictSetC(ShardGroups, (char *)infohash, len, g);
+  }
+  if (g->digest[index]) {
+    RedisModule_Free(g->digest[index]);
+  } else {
+    ShardStats.digests_cached++;
+  }
+  g->digest[index] = d;
+}
+
+/* Parses a digest message:
+ *   <keylen:2> <key> <complete:4> <incomplete:4> <n4:2> <n6:2>
+ *   <n4 compact v4 peers> <n6 compact v6 peers> */
+static void shardReceive(RedisModuleCtx *ctx, const char *sender_id,
+                         uint8_t type, const unsigned char *payload,
+                         uint32_t len) {
+  REDISMODULE_NOT_USED(ctx);
+  REDISMODULE_NOT_USED(sender_id);
+  if (type != SHARD_MSG_DIGEST || len < 2) return;
+  size_t keylen = get16(payload);
+  if (len < 2 + keylen + 12) return;
+  const char *key = (const char *)payload + 2;
+  const uint8_t *p = payload + 2 + keylen;
+  uint32_t index;
+  size_t taglen = trackerShardTag(key, keylen, &index);
+  if (taglen == 0) return;
+  uint16_t n4 = get16(p + 8), n6 = get16(p + 10);
+  size_t peerlen = (size_t)n4 * 6 + (size_t)n6 * 18;
+  if (len != 2 + keylen + 12 + peerlen) return;
+  ShardDigest *d = RedisModule_Alloc(sizeof(*d) + peerlen);
+  d->received = RedisModule_Milliseconds();
+  d->complete = get32(p);
+  d->incomplete = get32(p + 4);
+  d->n4 = n4;
+  d->n6 = n6;
+  memcpy(d->peers, p + 12, peerlen);
+  shardStoreDigest(key + taglen, keylen - taglen, index, d);
+  ShardStats.digests_received++;
+}
+
+/* Drops digests gone stale, and the torrents left with none. */
+static void shardExpireDigests(void) {
+  mstime_t stale = RedisModule_Milliseconds() - shardDigestTtl();
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(ShardGroups, "^", NULL, 0);
+  char *key;
+  size_t len;
+  ShardGroup *g;
+  while ((key = RedisModule_DictNextC(iter, &len, (void **)&g))) {
+    int live = 0;
+    for (int i = 0; i < TRACKER_SHARD_MAX; i++) {
+      if (g->digest[i] && g->digest[i]->received < stale) {
+        RedisModule_Free(g->digest[i]);
+        g->digest[i] = NULL;
+        ShardStats.digests_cached--;
+      }
+      live |= g->digest[i] != NULL;
+    }
+    if (!live) {
+      RedisModule_DictDelC(ShardGroups, key, len, NULL);
+      RedisModule_Free(g);
+      RedisModule_DictIteratorReseekC(iter, ">", key, len);
+    }
+  }
+  RedisModule_DictIteratorStop(iter);
+}
+
+static ShardGroup *shardSiblings(TrackerShard *s) {
+  if (s == NULL || s->split) return NULL;
+  return RedisModule_DictGetC(ShardGroups, s->key + s->taglen,
+                              s->keylen - s->taglen, NULL);
+}
+
+/* ------------------------- Publishing ------------------------- */
+
+static void shardPublish(RedisModuleCtx *ctx, TrackerShard *s) {
+  size_t want = tracker_config.shard_digest_peers;
+  size_t cap = 2 + s->keylen + 12 + want * (6 + 18);
+  uint8_t *msg = RedisModule_Alloc(cap);
+  put16(msg, s->keylen);
+  memcpy(msg + 2, s->key, s->keylen);
+  uint8_t *p = msg + 2 + s->keylen;
+  SeedersObj *o = s->o;
+  put32(p, o->d[0]->complete + o->d[1]->complete);
+  put32(p + 4, o->d[0]->incomplete + o->d[1]->incomplete);
+  size_t n4 = sampleSwarmPeers(o, NULL, want, p + 12, 0);
+  size_t n6 = sampleSwarmPeers(o, NULL, want, p + 12 + n4 * 6, 1);
+  put16(p + 8, n4);
+  put16(p + 10, n6);
+  uint32_t len = 2 + s->keylen + 12 + n4 * 6 + n6 * 18;
+  if (RedisModule_SendClusterMessage(ctx, NULL, SHARD_MSG_DIGEST, msg,
+                                     len) == REDISMODULE_OK) {
+    ShardStats.digests_sent++;
+  }
+  /* The bus doesn't loop back, siblings on this node read it here. */
+  shardReceive(ctx, NULL, SHARD_MSG_DIGEST, msg, len);
+  RedisModule_Free(msg);
+}
+
+static void shardTimerHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  if (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_MASTER) {
+    for (TrackerShard *s = ShardLocal; s; s = s->next) shardPublish(ctx, s);
+  }
+  shardExpireDigests();
+  RedisModule_CreateTimer(ctx, tracker_config.shard_digest_ms,
+                          shardTimerHandler, NULL);
+}
+
+/* ------------------------- Announces ------------------------- */
+
+static TrackerShard *shardCreate(SeedersObj *o, const char *key,
+                                 size_t keylen) {
+  TrackerShard *s = RedisModule_Calloc(1, sizeof(*s) + keylen);
+  s->o = o;
+  s->keylen = keylen;
+  memcpy(s->key, key, keylen);
+  o->shard = s;
+  return s;
+}
+
+/* Called once an announce went through on swarm o, under keyname: marks
+ * sub-swarms as such, and splits swarms that grew past shard-threshold. */
+void trackerShardAnnounce(SeedersObj *o, RedisModuleString *keyname) {
+  if (o->shard || tracker_config.shard_threshold == 0) return;
+  size_t len;
+  const char *key = RedisModule_StringPtrLen(keyname, &len);
+  if (len > UINT16_MAX) return;
+  uint32_t index;
+  size_t taglen = trackerShardTag(key, len, &index);
+  if (taglen) {
+    TrackerShard *s = shardCreate(o, key, len);
+    s->index = index;
+    s->taglen = taglen;
+    s->next = ShardLocal;
+    if (ShardLocal) ShardLocal->prev = s;
+    ShardLocal = s;
+    ShardStats.subswarms++;
+    return;
+  }
+  size_t peers = RedisModule_DictSize(o->d[0]->table) +
+                 RedisModule_DictSize(o->d[1]->table);
+  if (peers < (size_t)tracker_config.shard_threshold) return;
+  TrackerShard *s = shardCreate(o, key, len);
+  s->split = 1;
+  s->index = tracker_config.shard_count;
+  ShardStats.splits++;
+  RedisModule_Log(NULL, "notice", "swarm of %zu peers split in %u", peers,
+                  s->index);
+}
+
+/* Whether announces to o are to be sent to its sub-swarms. */
+int trackerShardSplit(SeedersObj *o) {
+  return o->shard && o->shard->split && tracker_config.shard_threshold;
+}
+
+/* The sub-swarm of split swarm s passkey announces to. */
+static uint32_t shardIndex(TrackerShard *s, RedisModuleString *passkey) {
+  size_t len;
+  const char *pk = RedisModule_StringPtrLen(passkey, &len);
+  return trackerHash64(pk, len, SHARD_SEED) % s->index;
+}
+
+/* The error telling the frontend which sub-swarm passkey announces to. */
+RedisModuleString *trackerShardRedirect(RedisModuleCtx *ctx, SeedersObj *o,
+                                        RedisModuleString *passkey) {
+  TrackerShard *s = o->shard;
+  ShardStats.redirects++;
+  return RedisModule_CreateStringPrintf(
+      ctx, "SHARDED {%016llx:%u}",
+      (unsigned long long)shardBase(s->key, s->keylen), shardIndex(s, passkey));
+}
+
+/* The key of the sub-swarm passkey announces to, for announces that can't
+ * be redirected. */
+RedisModuleString *trackerShardSubswarm(RedisModuleCtx *ctx, SeedersObj *o,
+                                        RedisModuleString *passkey) {
+  TrackerShard *s = o->shard;
+  RedisModuleString *key = RedisModule_CreateStringPrintf(
+      ctx, "{%016llx:%u}", (unsigned long long)shardBase(s->key, s->keylen),
+      shardIndex(s, passkey));
+  RedisModule_StringAppendBuffer(ctx, key, s->key, s->keylen);
+  return key;
+}
+
+/* Fills out with peers of the siblings of sub-swarm o, as many of numwant
+ * as their share of the torrent, or more when o has too few peers. */
+size_t trackerShardSample(SeedersObj *o, size_t numwant, uint8_t *out,
+                          int v6) {
+  ShardGroup *g = shardSiblings(o->shard);
+  if (g == NULL || numwant == 0) return 0;
+  mstime_t stale = RedisModule_Milliseconds() - shardDigestTtl();
+  uint64_t remote = 0;
+  for (int i = 0; i < TRACKER_SHARD_MAX; i++) {
+    ShardDigest *d = g->digest[i];
+    if (d == NULL || i == (int)o->shard->index || d->received < stale) {
+      continue;
+    }
+    remote += d->complete + d->incomplete;
+  }
+  if (remote == 0) return 0;
+  uint64_t local = RedisModule_DictSize(o->d[0]->table) +
+                   RedisModule_DictSize(o->d[1]->table);
+  size_t want = remote * numwant / (local + remote);
+  if (local < numwant && want < numwant - local) want = numwant - local;
+  size_t peerlen = v6 ? 18 : 6;
+  size_t n = 0;
+  int start = rand() % TRACKER_SHARD_MAX;
+  for (int j = 0; j < TRACKER_SHARD_MAX && n < want; j++) {
+    int i = (start + j) % TRACKER_SHARD_MAX;
+    ShardDigest *d = g->digest[i];
+    if (d == NULL || i == (int)o->shard->index || d->received < stale) {
+      continue;
+    }
+    size_t count = v6 ? d->n6 : d->n4;
+    if (count == 0) continue;
+    const uint8_t *peers = d->peers + (v6 ? d->n4 * 6 : 0);
+    size_t take =
+        (want * (uint64_t)(d->complete + d->incomplete) + remote - 1) / remote;
+    if (take > count) take = count;
+    if (take > want - n) take = want - n;
+    size_t from = rand() % count;
+    for (size_t t = 0; t < take; t++, n++) {
+      memcpy(out + n * peerlen, peers + (from + t) % count * peerlen,
+             peerlen);
+    }
+  }
+  return n;
+}
+
+/* Adds the siblings of sub-swarm o to its complete and incomplete. */
+void trackerShardCounts(SeedersObj *o, int *complete, int *incomplete) {
+  ShardGroup *g = shardSiblings(o->shard);
+  if (g == NULL) return;
+  mstime_t stale = RedisModule_Milliseconds() - shardDigestTtl();
+  for (int i = 0; i < TRACKER_SHARD_MAX; i++) {
+    ShardDigest *d = g->digest[i];
+    if (d == NULL || i == (int)o->shard->index || d->received < stale) {
+      continue;
+    }
+    *complete += d->complete;
+    *incomplete += d->incomplete;
+  }
+}
+
+void trackerShardDrop(SeedersObj *o) {
+  TrackerShard *s = o->shard;
+  if (s == NULL) return;
+  if (s->split) {
+    ShardStats.splits--;
+  } else {
+    if (s->prev) s->prev->next = s->next;
+    if (s->next) s->next->prev = s->prev;
+    if (ShardLocal == s) ShardLocal = s->next;
+    ShardStats.subswarms--;
+  }
+  RedisModule_Free(s);
+  o->shard = NULL;
+}
+
+void trackerShardInit(RedisModuleCtx *ctx) {
+  ShardGroups = RedisModule_CreateDict(NULL);
+  RedisModule_RegisterClusterMessageReceiver(ctx, SHARD_MSG_DIGEST,
+                                             shardReceive);
+  RedisModule_CreateTimer(ctx, tracker_config.shard_digest_ms,
+                          shardTimerHandler, NULL);
+}
+
+void trackerShardInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "shard");
+  RedisModule_InfoAddFieldLongLong(ctx, "shard_split_swarms",
+                                   ShardStats.splits);
+  RedisModule_InfoAddFieldLongLong(ctx, "shard_subswarms",
+                                   ShardStats.subswarms);
+  RedisModule_InfoAddFieldLongLong(ctx, "shard_redirects",
+                                   ShardStats.redirects);
+  RedisModule_InfoAddFieldLongLong(ctx, "shard_digests_sent",
+                                   ShardStats.digests_sent);
+  RedisModule_InfoAddFieldLongLong(ctx, "shard_digests_received",
+                                   ShardStats.digests_received);
+  RedisModule_InfoAddFieldLongLong(ctx, "shard_digests_cached",
+                                   ShardStats.digests_cached);
+}
@@ -0,0 +1,191 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include <strings.h>
+
+#include "redistracker.h"
+
+/* ========================== Announce slowlog ============================*/
+/* The Redis SLOWLOG only says that an announce was slow. This one says
+ * which swarm it went to, how big its generations were, whether a
+ * generation was released on the way, how many peers were asked for, and
+ * where the time went, so the few mega-swarms behind the tail latency show
+ * up by name.
+ *
+ * Announce paths bracket each announce with trackerSlowlogBegin / End, and
+ * mark the end of each stage on the way. Time since the last mark counts
+ * toward the stage being marked, and End puts what is left into the reply.
+ * Every announce trackerAnnounce answered reaches End, refused and
+ * redirected ones included; one rejected before that never does and is
+ * dropped by the next Begin. */
+static const char *SlowlogStageNames[TRACKER_SLOWLOG_STAGES] = {
+    "parse", "lookup", "compaction", "update", "replicate", "reply"};
+
+typedef struct SlowlogEntry {
+  long long id;
+  long long time; /* unix seconds */
+  long long duration_us;
+  char *key;
+  size_t keylen;
+  size_t generation[2]; /* peers, old generation first */
+  long long released;   /* peers of the released generation, or -1 */
+  long long numwant;
+  long long stage_us[TRACKER_SLOWLOG_STAGES];
+} SlowlogEntry;
+
+/* Newest entry at ring[(head + len - 1) % cap]. */
+static struct {
+  SlowlogEntry *ring;
+  size_t cap;
+  size_t head;
+  size_t len;
+  long long next_id;
+} Slowlog;
+
+static struct {
+  int active;
+  long long start;
+  long long mark;
+  long long released;
+  long long stage_us[TRACKER_SLOWLOG_STAGES];
+} Sample;
+
+void trackerSlowlogBegin(void) {
+  Sample.active = tracker_config.slowlog_log_slower_than >= 0 &&
+                  tracker_config.slowlog_max_len > 0;
+  if (!Sample.active) return;
+  Sample.start = Sample.mark = trackerMicroseconds();
+  Sample.released = -1;
+  memset(Sample.stage_us, 0, sizeof(Sample.stage_us));
+}
+
+void trackerSlowlogStage(int stage) {
+  if (!Sample.active) return;
+  long long now = trackerMicroseconds();
+  Sample.stage_us[stage] += now - Sample.mark;
+  Sample.mark = now;
+}
+
+void trackerSlowlogReleased(size_t peers) {
+  if (Sample.active) Sample.released = peers;
+}
+
+static SlowlogEntry *slowlogAt(size_t i) {
+  return &Slowlog.ring[(Slowlog.head + i) % Slowlog.cap];
+}
+
+/* Keeps the newest entries that fit cap. */
+static void slowlogResize(size_t cap) {
+  SlowlogEntry *ring = cap ? RedisModule_Calloc(cap, sizeof(*ring)) : NULL;
+  size_t keep = Slowlog.len < cap ? Slowlog.len : cap;
+  for (size_t i = 0; i < Slowlog.len; i++) {
+    SlowlogEntry *e = slowlogAt(i);
+    if (i < Slowlog.len - keep) {
+      RedisModule_Free(e->key);
+    } else {
+      ring[i - (Slowlog.len - keep)] = *e;
+    }
+  }
+  RedisModule_Free(Slowlog.ring);
+  Slowlog.ring = ring;
+  Slowlog.cap = cap;
+  Slowlog.head = 0;
+  Slowlog.len = keep;
+}
+
+/* Called when slowlog-max-len is set, so a shorter log, or none, drops
+ * its oldest entries right away rather than on the next slow announce. */
+void trackerSlowlogResize(void) {
+  if (Slowlog.cap != (size_t)tracker_config.slowlog_max_len) {
+    slowlogResize(tracker_config.slowlog_max_len);
+  }
+}
+
+void trackerSlowlogEnd(RedisModuleString *info_hash, SeedersObj *o,
+                       long long numwant) {
+  if (!Sample.active) return;
+  Sample.active = 0;
+  trackerSlowlogStage(TRACKER_SLOWLOG_REPLY);
+  long long duration = Sample.mark - Sample.start;
+  if (duration < tracker_config.slowlog_log_slower_than) return;
+  /* Sized on first use. */
+  trackerSlowlogResize();
+  SlowlogEntry *e;
+  if (Slowlog.len == Slowlog.cap) {
+    e = slowlogAt(0);
+    RedisModule_Free(e->key);
+    Slowlog.head = (Slowlog.head + 1) % Slowlog.cap;
+  } else {
+    e = slowlogAt(Slowlog.len++);
+  }
+  size_t keylen;
+  const char *key = RedisModule_StringPtrLen(info_hash, &keylen);
+  e->id = Slowlog.next_id++;
+  e->time = RedisModule_Milliseconds() / 1000;
+  e->duration_us = duration;
+  e->key = RedisModule_Alloc(keylen ? keylen : 1);
+  memcpy(e->key, key, keylen);
+  e->keylen = keylen;
+  e->generation[0] = o ? RedisModule_DictSize(o->d[0]->table) : 0;
+  e->generation[1] = o ? RedisModule_DictSize(o->d[1]->table) : 0;
+  e->released = Sample.released;
+  e->numwant = numwant;
+  memcpy(e->stage_us, Sample.stage_us, sizeof(e->stage_us));
+}
+
+static void slowlogReplyEntry(RedisModuleCtx *ctx, SlowlogEntry *e) {
+  RedisModule_ReplyWithArray(ctx, 8);
+  RedisModule_ReplyWithLongLong(ctx, e->id);
+  RedisModule_ReplyWithLongLong(ctx, e->time);
+  RedisModule_ReplyWithLongLong(ctx, e->duration_us);
+  RedisModule_ReplyWithStringBuffer(ctx, e->key, e->keylen);
+  RedisModule_ReplyWithArray(ctx, 2);
+  RedisModule_ReplyWithLongLong(ctx, e->generation[0]);
+  RedisModule_ReplyWithLongLong(ctx, e->generation[1]);
+  RedisModule_ReplyWithLongLong(ctx, e->released);
+  RedisModule_ReplyWithLongLong(ctx, e->numwant);
+  RedisModule_ReplyWithArray(ctx, TRACKER_SLOWLOG_STAGES * 2);
+  for (int i = 0; i < TRACKER_SLOWLOG_STAGES; i++) {
+    RedisModule_ReplyWithSimpleString(ctx, SlowlogStageNames[i]);
+    RedisModule_ReplyWithLongLong(ctx, e->stage_us[i]);
+  }
+}
+
+/* TRACKER.SLOWLOG GET [<count>] | LEN | RESET
+ *
+ * GET replies with the newest count entries (10 by default, -1 for all),
+ * newest first, each as
+ *   [id, unix time, microseconds, info_hash, [old peers, young peers],
+ *    released, numwant, [stage, microseconds, ...]]
+ * where the generation sizes are taken after the announce, 0 when it got
+ * no swarm (a wrong type key, or a new swarm refused), and released is
+ * the number of peers of the generation the announce rotated out, or -1
+ * when it rotated none. */
+int RedisTrackerSlowlog_RedisCommand(RedisModuleCtx *ctx,
+                                     RedisModuleString **argv, int argc) {
+  if (argc < 2) return RedisModule_WrongArity(ctx);
+  const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+  if (!strcasecmp(sub, "get") && argc <= 3) {
+    long long count = 10;
+    if (argc == 3 &&
+        (RedisModule_StringToLongLong(argv[2], &count) == REDISMODULE_ERR ||
+         count < -1)) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid count");
+    }
+    if (count == -1 || (size_t)count > Slowlog.len) count = Slowlog.len;
+    RedisModule_ReplyWithArray(ctx, count);
+    for (long long i = 0; i < count; i++) {
+      slowlogReplyEntry(ctx, slowlogAt(Slowlog.len - 1 - i));
+    }
+    return REDISMODULE_OK;
+  }
+  if (!strcasecmp(sub, "len") && argc == 2) {
+    return RedisModule_ReplyWithLongLong(ctx, Slowlog.len);
+  }
+  if (!strcasecmp(sub, "reset") && argc == 2) {
+    for (size_t i = 0; i < Slowlog.len; i++) {
+      RedisModule_Free(slowlogAt(i)->key);
+    }
+    Slowlog.head = Slowlog.len = 0;
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+  return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+}
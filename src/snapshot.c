@@ -0,0 +1,290 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include "redistracker.h"
+
+/* ========================== Swarm snapshots ==============================*/
+/* Immutable copies of each swarm (packed peers plus counters) that threads
+ * other than the event loop can read without the GIL. Announces only mark
+ * a swarm dirty; a timer rebuilds dirty swarms every snapshot-ms and swaps
+ * the new copy in, so a busy swarm costs one rebuild per period.
+ *
+ * Publishing is RCU style: the main thread is the only writer, and readers
+ * see either the old or the new pointer. What a writer unpublishes is
+ * retired under the current epoch and freed once every reader that was
+ * inside a read section at that epoch has left it. */
+#define SNAPSHOT_MIN_SLOTS 64
+#define SNAPSHOT_MAX_READERS 64
+
+typedef struct SnapshotSlot {
+  uint64_t hash; /* 0 for never used slots */
+  SwarmSnapshot *snap; /* NULL for never used or unpublished slots */
+} SnapshotSlot;
+
+typedef struct SnapshotTable {
+  size_t size; /* power of two */
+  size_t used; /* slots with a hash, unpublished ones included */
+  size_t live;
+  SnapshotSlot slots[];
+} SnapshotTable;
+
+typedef struct SnapshotRetired {
+  void *ptr;
+  uint64_t epoch;
+} SnapshotRetired;
+
+static SnapshotTable *Snapshots;
+static uint64_t SnapshotEpoch = 1;
+
+/* One cache line per reader, 0 when outside of a read section. */
+static struct {
+  uint64_t epoch;
+  int used;
+  char pad[64 - sizeof(uint64_t) - sizeof(int)];
+} SnapshotReaders[SNAPSHOT_MAX_READERS];
+
+static SnapshotRetired *Retired;
+static size_t RetiredLen, RetiredCap;
+
+/* Swarm key name -> SeedersObj waiting to be rebuilt. */
+static RedisModuleDict *DirtySwarms;
+
+static uint64_t snapshotHash(const char *key, size_t len) {
+  return trackerHash64(key, len, 0) | 1;
+}
+
+/* ------------------------- Reader side ------------------------------------*/
+
+int trackerSnapshotReader(void) {
+  for (int i = 0; i < SNAPSHOT_MAX_READERS; i++) {
+    int unused = 0;
+    if (__atomic_compare_exchange_n(&SnapshotReaders[i].used, &unused, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void trackerSnapshotEnter(int reader) {
+  uint64_t epoch = __atomic_load_n(&SnapshotEpoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&SnapshotReaders[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+void trackerSnapshotLeave(int reader) {
+  __atomic_store_n(&SnapshotReaders[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Only valid between trackerSnapshotEnter and trackerSnapshotLeave. */
+const SwarmSnapshot *trackerSnapshotGet(const char *key, size_t len) {
+  SnapshotTable *t = __atomic_load_n(&Snapshots, __ATOMIC_ACQUIRE);
+  if (t == NULL) return NULL;
+  uint64_t hash = snapshotHash(key, len);
+  size_t mask = t->size - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    uint64_t h = __atomic_load_n(&t->slots[i].hash, __ATOMIC_ACQUIRE);
+    if (h == 0) return NULL;
+    if (h != hash) continue;
+    SwarmSnapshot *s = __atomic_load_n(&t->slots[i].snap, __ATOMIC_ACQUIRE);
+    if (s && s->keylen == len && !memcmp(s->key, key, len)) return s;
+  }
+}
+
+/* ------------------------- Writer side ------------------------------------*/
+
+static void snapshotRetire(void *ptr) {
+  if (ptr == NULL) return;
+  if (RetiredLen == RetiredCap) {
+    RetiredCap = RetiredCap ? RetiredCap * 2 : 16;
+    Retired = RedisModule_Realloc(Retired, RetiredCap * sizeof(*Retired));
+  }
+  Retired[RetiredLen].ptr = ptr;
+  Retired[RetiredLen].epoch = SnapshotEpoch;
+  RetiredLen++;
+  __atomic_add_fetch(&SnapshotEpoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Frees what no reader can still be looking at. */
+static void snapshotReclaim(void) {
+  uint64_t oldest = UINT64_MAX;
+  for (int i = 0; i < SNAPSHOT_MAX_READERS; i++) {
+    uint64_t e = __atomic_load_n(&SnapshotReaders[i].epoch, __ATOMIC_SEQ_CST);
+    if (e && e < oldest) oldest = e;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < RetiredLen; i++) {
+    if (Retired[i].epoch < oldest) {
+      RedisModule_Free(Retired[i].ptr);
+    } else {
+      Retired[kept++] = Retired[i];
+    }
+  }
+  RetiredLen = kept;
+}
+
+static SnapshotTable *snapshotTableCreate(size_t size) {
+  SnapshotTable *t =
+      RedisModule_Calloc(1, sizeof(*t) + size * sizeof(SnapshotSlot));
+  t->size = size;
+  return t;
+}
+
+/* Readers may still walk the old table, so it is rebuilt aside, published
+ * and retired rather than resized in place. */
+static void snapshotTableResize(void) {
+  SnapshotTable *old = Snapshots;
+  size_t size = SNAPSHOT_MIN_SLOTS;
+  while ((old->live + 1) * 2 > size) size *= 2;
+  SnapshotTable *t = snapshotTableCreate(size);
+  for (size_t i = 0; i < old->size; i++) {
+    if (old->slots[i].snap == NULL) continue;
+    size_t j = old->slots[i].hash & (size - 1);
+    while (t->slots[j].hash) j = (j + 1) & (size - 1);
+    t->slots[j] = old->slots[i];
+    t->used++;
+    t->live++;
+  }
+  __atomic_store_n(&Snapshots, t, __ATOMIC_RELEASE);
+  snapshotRetire(old);
+}
+
+/* Publishes snap under key, or unpublishes key when snap is NULL. */
+static void snapshotPublish(const char *key, size_t len, SwarmSnapshot *snap) {
+  if (snap && (Snapshots->used + 1) * 4 > Snapshots->size * 3) {
+    snapshotTableResize();
+  }
+  SnapshotTable *t = Snapshots;
+  uint64_t hash = snapshotHash(key, len);
+  size_t mask = t->size - 1;
+  SnapshotSlot *free_slot = NULL;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    SnapshotSlot *slot = &t->slots[i];
+    SwarmSnapshot *s = slot->snap;
+    if (s && slot->hash == hash && s->keylen == len &&
+        !memcmp(s->key, key, len)) {
+      __atomic_store_n(&slot->snap, snap, __ATOMIC_RELEASE);
+      if (snap == NULL) t->live--;
+      snapshotRetire(s);
+      return;
+    }
+    if (s == NULL && free_slot == NULL) free_slot = slot;
+    if (slot->hash == 0) break;
+  }
+  if (snap == NULL) return;
+  /* Readers check the key of what they find, so a reused slot showing the
+   * new hash before the new snapshot is harmless. */
+  if (free_slot->hash == 0) t->used++;
+  __atomic_store_n(&free_slot->hash, hash, __ATOMIC_RELEASE);
+  __atomic_store_n(&free_slot->snap, snap, __ATOMIC_RELEASE);
+  t->live++;
+}
+
+static SwarmSnapshot *snapshotBuild(const char *key, size_t len,
+                                    SeedersObj *o) {
+  uint32_t n4 = o->d[0]->pool4.len + o->d[1]->pool4.len;
+  uint32_t n6 = o->d[0]->pool6.len + o->d[1]->pool6.len;
+  SwarmSnapshot *s =
+      RedisModule_Alloc(sizeof(*s) + len + (size_t)n4 * 6 + (size_t)n6 * 18);
+  s->built_at = RedisModule_Milliseconds();
+  s->complete = o->d[0]->complete + o->d[1]->complete;
+  s->incomplete = o->d[0]->incomplete + o->d[1]->incomplete;
+  s->downloaded = o->downloaded;
+  s->n4 = n4;
+  s->n6 = n6;
+  s->keylen = len;
+  s->peers4 = (uint8_t *)s->data;
+  s->peers6 = s->peers4 + (size_t)n4 * 6;
+  s->key = (char *)s->peers6 + (size_t)n6 * 18;
+  memcpy(s->key, key, len);
+  uint8_t *p4 = s->peers4, *p6 = s->peers6;
+  for (int g = 0; g < 2; g++) {
+    PeerPool *pool = &o->d[g]->pool4;
+    for (uint32_t i = 0; i < pool->len; i++, p4 += 6) {
+      memcpy(p4, pool->items[i]->peer, 6);
+    }
+    pool = &o->d[g]->pool6;
+    for (uint32_t i = 0; i < pool->len; i++, p6 += 18) {
+      memcpy(p6, pool->items[i]->peer6, 18);
+    }
+  }
+  return s;
+}
+
+/* Called after every change to a swarm. */
+void trackerSnapshotTouch(RedisModuleString *keyname, SeedersObj *o) {
+  if (tracker_config.snapshot_ms == 0) return;
+  size_t len;
+  const char *key = RedisModule_StringPtrLen(keyname, &len);
+  if (o->snapshot_key &&
+      (o->snapshot_keylen != len || memcmp(o->snapshot_key, key, len))) {
+    /* The key was renamed since we last saw it. */
+    trackerSnapshotDrop(o);
+  }
+  if (o->snapshot_key == NULL) {
+    o->snapshot_key = RedisModule_Alloc(len ? len : 1);
+    memcpy(o->snapshot_key, key, len);
+    o->snapshot_keylen = len;
+  }
+  if (!o->snapshot_dirty) {
+    if (RedisModule_DictSetC(DirtySwarms, o->snapshot_key, len, o) ==
+        REDISMODULE_ERR) {
+      /* A swarm renamed away from this key since it was queued. It loses
+       * its claim on the name and gets one for its new key when touched
+       * there. */
+      trackerSnapshotDrop(RedisModule_DictGetC(DirtySwarms, o->snapshot_key,
+                                               len, NULL));
+      RedisModule_DictSetC(DirtySwarms, o->snapshot_key, len, o);
+    }
+    o->snapshot_dirty = 1;
+  }
+}
+
+/* Unpublishes a swarm that is going away. */
+void trackerSnapshotDrop(SeedersObj *o) {
+  if (o->snapshot_key == NULL) return;
+  if (o->snapshot_dirty) {
+    RedisModule_DictDelC(DirtySwarms, o->snapshot_key, o->snapshot_keylen,
+                         NULL);
+    o->snapshot_dirty = 0;
+  }
+  snapshotPublish(o->snapshot_key, o->snapshot_keylen, NULL);
+  RedisModule_Free(o->snapshot_key);
+  o->snapshot_key = NULL;
+}
+
+static void snapshotTimerHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(DirtySwarms, "^", NULL, 0);
+  char *key;
+  size_t len;
+  SeedersObj *o;
+  while ((key = RedisModule_DictNextC(iter, &len, (void **)&o))) {
+    o->snapshot_dirty = 0;
+    snapshotPublish(key, len, snapshotBuild(key, len, o));
+  }
+  RedisModule_DictIteratorStop(iter);
+  if (RedisModule_DictSize(DirtySwarms)) {
+    RedisModule_FreeDict(NULL, DirtySwarms);
+    DirtySwarms = RedisModule_CreateDict(NULL);
+  }
+  snapshotReclaim();
+  mstime_t period = tracker_config.snapshot_ms;
+  RedisModule_CreateTimer(ctx, period ? period : 1000, snapshotTimerHandler,
+                          NULL);
+}
+
+void trackerSnapshotInit(RedisModuleCtx *ctx) {
+  Snapshots = snapshotTableCreate(SNAPSHOT_MIN_SLOTS);
+  DirtySwarms = RedisModule_CreateDict(NULL);
+  mstime_t period = tracker_config.snapshot_ms;
+  RedisModule_CreateTimer(ctx, period ? period : 1000, snapshotTimerHandler,
+                          NULL);
+}
+
+void trackerSnapshotInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "snapshots");
+  RedisModule_InfoAddFieldULongLong(ctx, "snapshot_swarms", Snapshots->live);
+  RedisModule_InfoAddFieldULongLong(ctx, "snapshot_dirty",
+                                    RedisModule_DictSize(DirtySwarms));
+  RedisModule_InfoAddFieldULongLong(ctx, "snapshot_retired", RetiredLen);
+  RedisModule_InfoAddFieldULongLong(ctx, "snapshot_epoch", SnapshotEpoch);
+}
@@ -0,0 +1,262 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include "redistracker.h"
+
+/* ========================== Swarm table ==================================*/
+/* With swarm-table on, swarms don't live in the keyspace but in this one
+ * open addressing table, keyed by info_hash, so a swarm costs a 16 byte
+ * slot and its key inline in the SeedersObj instead of a robj, an sds key,
+ * a dictEntry and an expires entry. Meant for normalized 20 byte keys, see
+ * infohash-normalize.
+ *
+ * Announces, TRACKER.APPLY, scrapes, exports and restores go to the table
+ * instead of keys. SeedersObj.expire_at is the only TTL: a timer sweeps
+ * enough slots every TABLE_SWEEP_MS to pass over the whole table once per
+ * TRACKER_KEY_TTL_SLACK, and frees the swarms past it. Replicas get
+ * expire_at with every TRACKER.APPLY and sweep on their own.
+ *
+ * The table is saved as module aux data after the keyspace, and holds what
+ * the RDB holds of a key swarm: that it exists, until when, and its
+ * download count. It belongs to no db: FLUSHDB of any db empties it, and
+ * SELECT doesn't change what announces see. Deletion shifts entries back
+ * instead of leaving tombstones, so lookups never probe past a gap. */
+#define TABLE_MIN_SIZE 1024
+#define TABLE_SWEEP_MS 100
+#define TABLE_AUX_VERSION 1
+
+typedef struct TableSlot {
+  uint64_t hash;
+  SeedersObj *o; /* NULL for an empty slot */
+} TableSlot;
+
+static struct {
+  int enabled;
+  TableSlot *slots;
+  size_t size; /* power of two */
+  size_t used;
+  uint64_t seed;
+  size_t sweep; /* next slot the sweeper looks at */
+  long long expired;
+  long long resizes;
+} Table;
+
+int trackerTableEnabled(void) { return Table.enabled; }
+
+static size_t tableFind(const char *key, size_t len, uint64_t hash) {
+  size_t mask = Table.size - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    SeedersObj *o = Table.slots[i].o;
+    if (o == NULL) return SIZE_MAX;
+    if (Table.slots[i].hash == hash && o->keylen == len &&
+        !memcmp(o->key, key, len)) {
+      return i;
+    }
+  }
+}
+
+static void tableInsert(TableSlot *slots, size_t size, uint64_t hash,
+                        SeedersObj *o) {
+  size_t i = hash & (size - 1);
+  while (slots[i].o) i = (i + 1) & (size - 1);
+  slots[i].hash = hash;
+  slots[i].o = o;
+}
+
+static void tableResize(size_t size) {
+  TableSlot *slots = RedisModule_Calloc(size, sizeof(*slots));
+  for (size_t i = 0; i < Table.size; i++) {
+    if (Table.slots[i].o) {
+      tableInsert(slots, size, Table.slots[i].hash, Table.slots[i].o);
+    }
+  }
+  RedisModule_Free(Table.slots);
+  Table.slots = slots;
+  Table.size = size;
+  Table.sweep = 0;
+  Table.resizes++;
+}
+
+/* Empties slot i, pulling back the entries of the cluster after it that
+ * may then sit closer to their home slot. */
+static void tableRemoveAt(size_t i) {
+  size_t mask = Table.size - 1;
+  Table.slots[i].o = NULL;
+  for (size_t j = (i + 1) & mask; Table.slots[j].o; j = (j + 1) & mask) {
+    size_t home = Table.slots[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      Table.slots[i] = Table.slots[j];
+      Table.slots[j].o = NULL;
+      i = j;
+    }
+  }
+  Table.used--;
+}
+
+static void tableFree(SeedersObj *o) {
+  trackerShardDrop(o);
+  trackerSnapshotDrop(o);
+  trackerDeltaDrop(o);
+  trackerLazyfreeSwarm(o);
+}
+
+SeedersObj *trackerTableGet(const char *key, size_t len) {
+  uint64_t hash = trackerHash64(key, len, Table.seed);
+  size_t i = tableFind(key, len, hash);
+  return i == SIZE_MAX ? NULL : Table.slots[i].o;
+}
+
+/* Creates the swarm of key, which must not be in the table yet. NULL if
+ * the key is too long to be kept inline. */
+SeedersObj *trackerTableAdd(const char *key, size_t len) {
+  if (len > UINT16_MAX) return NULL;
+  if ((Table.used + 1) * 4 > Table.size * 3) tableResize(Table.size * 2);
+  SeedersObj *o = createSeedersObjectWithKey(key, len);
+  tableInsert(Table.slots, Table.size, trackerHash64(key, len, Table.seed),
+              o);
+  Table.used++;
+  return o;
+}
+
+void trackerTableDel(SeedersObj *o) {
+  uint64_t hash = trackerHash64(o->key, o->keylen, Table.seed);
+  size_t i = tableFind(o->key, o->keylen, hash);
+  if (i != SIZE_MAX) tableRemoveAt(i);
+  tableFree(o);
+}
+
+/* Calls fn for the swarms in the count slots from cursor on, returns the
+ * cursor to continue from, 0 once past the end. A resize in between calls
+ * may make a walk skip or repeat swarms. */
+size_t trackerTableScan(size_t cursor, size_t count, TrackerTableScanCB fn,
+                        void *privdata) {
+  size_t i = cursor;
+  for (; i < Table.size && count; i++, count--) {
+    if (Table.slots[i].o) fn(Table.slots[i].o, privdata);
+  }
+  return i < Table.size ? i : 0;
+}
+
+size_t trackerTableSize(void) { return Table.used; }
+
+static void tableSweepHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  mstime_t now = RedisModule_Milliseconds();
+  size_t budget =
+      Table.size / (TRACKER_KEY_TTL_SLACK * 1000 / TABLE_SWEEP_MS) + 64;
+  while (budget--) {
+    SeedersObj *o = Table.slots[Table.sweep].o;
+    if (o && o->expire_at && o->expire_at <= now) {
+      /* Whatever shifts into the slot is looked at next. */
+      tableRemoveAt(Table.sweep);
+      tableFree(o);
+      Table.expired++;
+      continue;
+    }
+    Table.sweep = (Table.sweep + 1) & (Table.size - 1);
+    if (Table.sweep == 0 && Table.size > TABLE_MIN_SIZE &&
+        Table.used * 8 < Table.size) {
+      tableResize(Table.size / 2);
+      break;
+    }
+  }
+  RedisModule_CreateTimer(ctx, TABLE_SWEEP_MS, tableSweepHandler, NULL);
+}
+
+static void tableClear(void) {
+  for (size_t i = 0; i < Table.size; i++) {
+    if (Table.slots[i].o) tableFree(Table.slots[i].o);
+  }
+  RedisModule_Free(Table.slots);
+  Table.slots = RedisModule_Calloc(TABLE_MIN_SIZE, sizeof(*Table.slots));
+  Table.size = TABLE_MIN_SIZE;
+  Table.used = Table.sweep = 0;
+}
+
+static void tableFlushed(RedisModuleCtx *ctx, RedisModuleEvent e,
+                         uint64_t sub, void *data) {
+  REDISMODULE_NOT_USED(ctx);
+  REDISMODULE_NOT_USED(e);
+  REDISMODULE_NOT_USED(data);
+  if (sub == REDISMODULE_SUBEVENT_FLUSHDB_END) tableClear();
+}
+
+/* Aux data, after the keyspace:
+ *   <version> <swarms>, then per swarm <key> <expire_at> <downloaded> */
+void trackerTableAuxSave(RedisModuleIO *rdb, int when) {
+  if (when != REDISMODULE_AUX_AFTER_RDB) return;
+  RedisModule_SaveUnsigned(rdb, TABLE_AUX_VERSION);
+  RedisModule_SaveUnsigned(rdb, Table.used);
+  for (size_t i = 0; i < Table.size; i++) {
+    SeedersObj *o = Table.slots[i].o;
+    if (o == NULL) continue;
+    RedisModule_SaveStringBuffer(rdb, o->key, o->keylen);
+    RedisModule_SaveUnsigned(rdb, o->expire_at);
+    RedisModule_SaveUnsigned(rdb, o->downloaded);
+  }
+}
+
+int trackerTableAuxLoad(RedisModuleIO *rdb, int encver, int when) {
+  REDISMODULE_NOT_USED(encver);
+  if (when != REDISMODULE_AUX_AFTER_RDB) return REDISMODULE_OK;
+  if (RedisModule_LoadUnsigned(rdb) != TABLE_AUX_VERSION) {
+    return REDISMODULE_ERR;
+  }
+  uint64_t swarms = RedisModule_LoadUnsigned(rdb);
+  mstime_t now = RedisModule_Milliseconds();
+  long long dropped = 0;
+  for (uint64_t n = 0; n < swarms; n++) {
+    size_t len;
+    char *key = RedisModule_LoadStringBuffer(rdb, &len);
+    mstime_t expire_at = RedisModule_LoadUnsigned(rdb);
+    uint64_t downloaded = RedisModule_LoadUnsigned(rdb);
+    if (RedisModule_IsIOError(rdb)) {
+      RedisModule_Free(key);
+      return REDISMODULE_ERR;
+    }
+    SeedersObj *o = NULL;
+    if (Table.enabled && (expire_at == 0 || expire_at > now) &&
+        trackerTableGet(key, len) == NULL) {
+      o = trackerTableAdd(key, len);
+    }
+    if (o) {
+      o->expire_at = expire_at;
+      o->downloaded = downloaded;
+    } else {
+      dropped++;
+    }
+    RedisModule_Free(key);
+  }
+  if (!Table.enabled && swarms) {
+    RedisModule_Log(NULL, "warning",
+                    "swarm-table is off, dropped %llu swarms of the RDB",
+                    (unsigned long long)swarms);
+  } else if (dropped) {
+    RedisModule_Log(NULL, "notice",
+                    "dropped %lld expired swarms of the RDB", dropped);
+  }
+  return REDISMODULE_OK;
+}
+
+/* swarm-table is only read here, a table can't turn into keys later. */
+void trackerTableInit(RedisModuleCtx *ctx) {
+  if (!tracker_config.swarm_table) return;
+  Table.enabled = 1;
+  RedisModule_GetRandomBytes((unsigned char *)&Table.seed,
+                             sizeof(Table.seed));
+  Table.slots = RedisModule_Calloc(TABLE_MIN_SIZE, sizeof(*Table.slots));
+  Table.size = TABLE_MIN_SIZE;
+  RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_FlushDB,
+                                     tableFlushed);
+  RedisModule_CreateTimer(ctx, TABLE_SWEEP_MS, tableSweepHandler, NULL);
+}
+
+void trackerTableInfo(RedisModuleInfoCtx *ctx) {
+  if (!Table.enabled) return;
+  RedisModule_InfoAddSection(ctx, "table");
+  RedisModule_InfoAddFieldULongLong(ctx, "table_swarms", Table.used);
+  RedisModule_InfoAddFieldULongLong(ctx, "table_slots", Table.size);
+  RedisModule_InfoAddFieldULongLong(
+      ctx, "table_bytes", Table.size * sizeof(TableSlot));
+  RedisModule_InfoAddFieldLongLong(ctx, "table_expired_swarms",
+                                   Table.expired);
+  RedisModule_InfoAddFieldLongLong(ctx, "table_resizes", Table.resizes);
+}
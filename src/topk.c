@@ -0,0 +1,177 @@
+#define REDISMODULE_EXPERIMENTAL_API
+#include "redistracker.h"
+
+/* ========================== Hot swarms ===================================*/
+/* Streaming top-K of the swarms taking the most announces. Every announce
+ * applied to a swarm, so not the refused, redirected or rate limited ones,
+ * bumps a count-min sketch, which costs four counter increments; only an
+ * info_hash whose estimate reaches the smallest of the current top-K is
+ * looked up among the candidates, a min-heap of topk-size entries. Every
+ * topk-halflife-ms all counts are halved, so they follow the recent rate
+ * rather than the all time total. */
+#define TOPK_DEPTH 4
+#define TOPK_WIDTH 4096 /* power of two */
+
+typedef struct TopkEntry {
+  char *key;
+  size_t len;
+  uint32_t count;
+  uint32_t idx; /* position in the heap */
+} TopkEntry;
+
+static struct {
+  uint32_t sketch[TOPK_DEPTH][TOPK_WIDTH];
+  TopkEntry **heap; /* min-heap on count */
+  uint32_t len;
+  uint32_t size;
+  RedisModuleDict *entries; /* key -> TopkEntry */
+  uint64_t seed;
+} Topk;
+
+static void topkSwap(uint32_t i, uint32_t j) {
+  TopkEntry *a = Topk.heap[i];
+  Topk.heap[i] = Topk.heap[j];
+  Topk.heap[j] = a;
+  Topk.heap[i]->idx = i;
+  Topk.heap[j]->idx = j;
+}
+
+static void topkSiftDown(uint32_t i) {
+  for (;;) {
+    uint32_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < Topk.len && Topk.heap[l]->count < Topk.heap[min]->count) min = l;
+    if (r < Topk.len && Topk.heap[r]->count < Topk.heap[min]->count) min = r;
+    if (min == i) return;
+    topkSwap(i, min);
+    i = min;
+  }
+}
+
+static void topkSiftUp(uint32_t i) {
+  while (i && Topk.heap[(i - 1) / 2]->count > Topk.heap[i]->count) {
+    topkSwap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void topkEntryFree(TopkEntry *e) {
+  RedisModule_Free(e->key);
+  RedisModule_Free(e);
+}
+
+/* Drops every candidate and count, and sizes the heap for size entries. */
+static void topkReset(uint32_t size) {
+  for (uint32_t i = 0; i < Topk.len; i++) topkEntryFree(Topk.heap[i]);
+  if (Topk.entries) RedisModule_FreeDict(NULL, Topk.entries);
+  Topk.entries = RedisModule_CreateDict(NULL);
+  Topk.heap = RedisModule_Realloc(Topk.heap, (size ? size : 1) *
+                                                 sizeof(*Topk.heap));
+  Topk.len = 0;
+  Topk.size = size;
+  memset(Topk.sketch, 0, sizeof(Topk.sketch));
+}
+
+void trackerTopkAnnounce(RedisModuleString *info_hash) {
+  if ((uint32_t)tracker_config.topk_size != Topk.size) {
+    topkReset(tracker_config.topk_size);
+  }
+  if (Topk.size == 0) return;
+  size_t len;
+  const char *key = RedisModule_StringPtrLen(info_hash, &len);
+  uint64_t h = trackerHash64(key, len, Topk.seed);
+  uint32_t h1 = h, h2 = (h >> 32) | 1;
+  uint32_t est = UINT32_MAX;
+  for (int i = 0; i < TOPK_DEPTH; i++) {
+    uint32_t *c = &Topk.sketch[i][(h1 + i * h2) & (TOPK_WIDTH - 1)];
+    if (*c != UINT32_MAX) (*c)++;
+    if (*c < est) est = *c;
+  }
+  if (Topk.len == Topk.size && est <= Topk.heap[0]->count) return;
+
+  TopkEntry *e = RedisModule_DictGetC(Topk.entries, (void *)key, len, NULL);
+  if (e) {
+    e->count = est;
+    topkSiftDown(e->idx);
+    return;
+  }
+  if (Topk.len == Topk.size) {
+    /* Evict the coldest candidate, the newcomer takes its slot. */
+    e = Topk.heap[0];
+    RedisModule_DictDelC(Topk.entries, e->key, e->len, NULL);
+    RedisModule_Free(e->key);
+  } else {
+    e = RedisModule_Alloc(sizeof(*e));
+    e->idx = Topk.len;
+    Topk.heap[Topk.len++] = e;
+  }
+  e->key = RedisModule_Alloc(len ? len : 1);
+  memcpy(e->key, key, len);
+  e->len = len;
+  e->count = est;
+  RedisModule_DictSetC(Topk.entries, e->key, len, e);
+  topkSiftDown(e->idx);
+  topkSiftUp(e->idx);
+}
+
+/* Halving keeps the heap ordered, so nothing needs to move. */
+static void topkDecayHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  if (Topk.size) {
+    for (int i = 0; i < TOPK_DEPTH; i++) {
+      for (int j = 0; j < TOPK_WIDTH; j++) Topk.sketch[i][j] >>= 1;
+    }
+    for (uint32_t i = 0; i < Topk.len; i++) Topk.heap[i]->count >>= 1;
+  }
+  RedisModule_CreateTimer(ctx, tracker_config.topk_halflife_ms,
+                          topkDecayHandler, NULL);
+}
+
+static int topkCompare(const void *a, const void *b) {
+  uint32_t ca = (*(TopkEntry *const *)a)->count;
+  uint32_t cb = (*(TopkEntry *const *)b)->count;
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/* TRACKER.TOPK [<n>]
+ *   -> the n hottest swarms, hottest first, each as
+ *      [info_hash, decayed announces, complete, incomplete]
+ * where the last two are 0 once the swarm is gone. */
+int RedisTrackerTopk_RedisCommand(RedisModuleCtx *ctx,
+                                  RedisModuleString **argv, int argc) {
+  if (argc > 2) return RedisModule_WrongArity(ctx);
+  long long n = Topk.len;
+  if (argc == 2 &&
+      (RedisModule_StringToLongLong(argv[1], &n) == REDISMODULE_ERR ||
+       n < 0)) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid count");
+  }
+  if (n > Topk.len) n = Topk.len;
+  TopkEntry **sorted = RedisModule_Alloc((Topk.len ? Topk.len : 1) *
+                                         sizeof(*sorted));
+  memcpy(sorted, Topk.heap, Topk.len * sizeof(*sorted));
+  qsort(sorted, Topk.len, sizeof(*sorted), topkCompare);
+  RedisModule_ReplyWithArray(ctx, n);
+  for (long long i = 0; i < n; i++) {
+    TopkEntry *e = sorted[i];
+    RedisModuleString *info_hash =
+        RedisModule_CreateString(ctx, e->key, e->len);
+    SeedersObj *o = trackerLookupSwarm(ctx, info_hash);
+    RedisModule_ReplyWithArray(ctx, 4);
+    RedisModule_ReplyWithString(ctx, info_hash);
+    RedisModule_ReplyWithLongLong(ctx, e->count);
+    RedisModule_ReplyWithLongLong(
+        ctx, o ? o->d[0]->complete + o->d[1]->complete : 0);
+    RedisModule_ReplyWithLongLong(
+        ctx, o ? o->d[0]->incomplete + o->d[1]->incomplete : 0);
+    RedisModule_FreeString(ctx, info_hash);
+  }
+  RedisModule_Free(sorted);
+  return REDISMODULE_OK;
+}
+
+void trackerTopkInit(RedisModuleCtx *ctx) {
+  RedisModule_GetRandomBytes((unsigned char *)&Topk.seed, sizeof(Topk.seed));
+  topkReset(tracker_config.topk_size);
+  RedisModule_CreateTimer(ctx, tracker_config.topk_halflife_ms,
+                          topkDecayHandler, NULL);
+}
@@ -0,0 +1,475 @@
+#define _GNU_SOURCE /* clock_gettime */
+#define REDISMODULE_EXPERIMENTAL_API
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "redistracker.h"
+
+/* ========================== Announce traces ==============================*/
+/* TRACKER.TRACE START appends every announce, as trackerAnnounce got it, to
+ * a file (format in redistracker.h) so production traffic can be replayed
+ * against another build. The event loop only copies the record into a
+ * TRACE_RING_SIZE ring; a thread drains the ring into the file. Records
+ * that find the ring full, or that would take the file past
+ * trace-max-bytes, are dropped and counted, never waited for.
+ *
+ * TRACKER.REPLAY START feeds such a file back through trackerAnnounce from
+ * a timer, either at the pace it was recorded or as fast as the event loop
+ * allows in TRACE_REPLAY_SLICE_MS slices. Replayed announces see the trace
+ * timestamps instead of the wall clock, through trackerMilliseconds, so
+ * generations rotate and rate limits apply as they did when recorded; live
+ * announces served in between keep the wall clock. Each record goes back
+ * to the db it was traced in. Replayed announces are not traced, so a
+ * server can replay and trace at once, but are replicated and fed to the
+ * AOF like live ones: replicas keep up with the swarms, and take their
+ * share of the load. Replay on a master without replicas to time the
+ * announce path alone. */
+#define TRACE_RING_SIZE (1 << 22)
+#define TRACE_HEADER_LEN 16
+#define TRACE_RECORD_MAX_FIXED 80
+#define TRACE_REPLAY_SLICE_MS 10
+#define TRACE_REPLAY_MAX_WAIT_MS 100
+
+static struct {
+  int active;
+  char *path;
+  FILE *fp;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t *ring;
+  size_t head; /* written by the event loop, both only grow */
+  size_t tail; /* written by the thread */
+  int stopping;
+  int failed; /* a write failed, nothing more is taken */
+  uint64_t file_bytes;
+  long long records;
+  long long dropped;
+} Trace = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .cond = PTHREAD_COND_INITIALIZER};
+
+static struct {
+  int active;
+  int maxspeed;
+  char *path;
+  uint8_t *map;
+  size_t len;
+  size_t pos;
+  mstime_t now;        /* virtual clock, the current record's timestamp */
+  int applying;        /* inside trackerAnnounce for a record */
+  mstime_t first_ts;   /* of the first record */
+  mstime_t started_at; /* real time the replay began */
+  RedisModuleTimerID timer;
+  /* Outcome, for INFO. */
+  const char *status; /* "none", "running", "ok", "err" or "stopped" */
+  long long records;
+  long long elapsed_us;        /* spent in trackerAnnounce now */
+  long long traced_elapsed_us; /* spent when the records were traced */
+} Replay = {.status = "none"};
+
+long long trackerMicroseconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The clock swarm state is kept with: the wall clock, or the one of the
+ * record being replayed. */
+mstime_t trackerMilliseconds(void) {
+  if (Replay.applying) return Replay.now;
+  return RedisModule_Milliseconds();
+}
+
+/* ------------------------- Capture ------------------------- */
+
+static void *traceWriterMain(void *arg) {
+  REDISMODULE_NOT_USED(arg);
+  pthread_mutex_lock(&Trace.lock);
+  for (;;) {
+    while (Trace.head == Trace.tail && !Trace.stopping) {
+      pthread_cond_wait(&Trace.cond, &Trace.lock);
+    }
+    if (Trace.head == Trace.tail) break;
+    size_t off = Trace.tail & (TRACE_RING_SIZE - 1);
+    size_t len = Trace.head - Trace.tail;
+    if (len > TRACE_RING_SIZE - off) len = TRACE_RING_SIZE - off;
+    pthread_mutex_unlock(&Trace.lock);
+    /* The event loop only writes past head, so this stays untouched. */
+    int failed = fwrite(Trace.ring + off, 1, len, Trace.fp) != len;
+    pthread_mutex_lock(&Trace.lock);
+    Trace.tail += len;
+    if (failed) Trace.failed = 1;
+  }
+  pthread_mutex_unlock(&Trace.lock);
+  return NULL;
+}
+
+static void traceLE(uint8_t **p, uint64_t v, int len) {
+  for (int i = 0; i < len; i++) (*p)[i] = v >> (8 * i);
+  *p += len;
+}
+
+static void traceBytes(uint8_t **p, const void *buf, size_t len) {
+  memcpy(*p, buf, len);
+  *p += len;
+}
+
+/* Replayed announces are not traced again. */
+int trackerTracing(void) { return Trace.active && !Replay.applying; }
+
+/* req is the announce as it was before trackerAnnounce ran on ctx. */
+void trackerTraceAnnounce(RedisModuleCtx *ctx, TrackerAnnounce *req, int res,
+                          long long elapsed_us) {
+  size_t ihlen, pklen;
+  const char *ih = RedisModule_StringPtrLen(req->info_hash, &ihlen);
+  const char *pk = RedisModule_StringPtrLen(req->passkey, &pklen);
+  if (ihlen > UINT16_MAX || pklen > UINT16_MAX) {
+    Trace.dropped++;
+    return;
+  }
+  uint8_t fixed[TRACE_RECORD_MAX_FIXED];
+  uint8_t flags = 0;
+  if (req->v4) flags |= TRACKER_EFFECT_HAS_V4;
+  if (req->v6) flags |= TRACKER_EFFECT_HAS_V6;
+  if (req->stats) flags |= TRACKER_EFFECT_HAS_STATS;
+  uint8_t *p = fixed;
+  traceLE(&p, TRACKER_TRACE_ANNOUNCE, 1);
+  traceLE(&p, RedisModule_Milliseconds(), 8);
+  traceLE(&p, RedisModule_GetSelectedDb(ctx), 4);
+  traceLE(&p, elapsed_us > UINT32_MAX ? UINT32_MAX : elapsed_us, 4);
+  traceLE(&p, res, 1);
+  traceLE(&p, req->event, 1);
+  traceLE(&p, flags, 1);
+  traceLE(&p, req->port, 2);
+  traceLE(&p, req->numwant > UINT32_MAX ? UINT32_MAX : req->numwant, 4);
+  if (req->v4) traceBytes(&p, req->v4, 4);
+  if (req->v6) traceBytes(&p, req->v6, 16);
+  if (req->stats) {
+    traceLE(&p, req->uploaded, 8);
+    traceLE(&p, req->downloaded, 8);
+    traceLE(&p, req->left, 8);
+  }
+  size_t fixed_len = p - fixed;
+  size_t len = fixed_len + 2 + ihlen + 2 + pklen;
+
+  pthread_mutex_lock(&Trace.lock);
+  if (Trace.failed || TRACE_RING_SIZE - (Trace.head - Trace.tail) < len ||
+      (tracker_config.trace_max_bytes &&
+       Trace.file_bytes + len > (uint64_t)tracker_config.trace_max_bytes)) {
+    pthread_mutex_unlock(&Trace.lock);
+    Trace.dropped++;
+    return;
+  }
+  pthread_mutex_unlock(&Trace.lock);
+  /* Only the event loop moves head, the thread won't read past it. */
+  uint8_t lens[4] = {ihlen, ihlen >> 8, pklen, pklen >> 8};
+  const void *parts[5] = {fixed, lens, ih, lens + 2, pk};
+  size_t sizes[5] = {fixed_len, 2, ihlen, 2, pklen};
+  size_t head = Trace.head;
+  for (int i = 0; i < 5; i++) {
+    const uint8_t *src = parts[i];
+    size_t n = sizes[i];
+    while (n) {
+      size_t off = head & (TRACE_RING_SIZE - 1);
+      size_t chunk = TRACE_RING_SIZE - off < n ? TRACE_RING_SIZE - off : n;
+      memcpy(Trace.ring + off, src, chunk);
+      src += chunk;
+      n -= chunk;
+      head += chunk;
+    }
+  }
+  pthread_mutex_lock(&Trace.lock);
+  Trace.head = head;
+  Trace.file_bytes += len;
+  pthread_cond_signal(&Trace.cond);
+  pthread_mutex_unlock(&Trace.lock);
+  Trace.records++;
+}
+
+static int traceStart(RedisModuleCtx *ctx, const char *path) {
+  if (Trace.active) {
+    return RedisModule_ReplyWithError(ctx, "ERR a trace is in progress");
+  }
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return RedisModule_ReplyWithError(ctx, "ERR can't open the trace file");
+  }
+  uint8_t header[TRACE_HEADER_LEN], *p = header;
+  traceBytes(&p, TRACKER_TRACE_MAGIC, 8);
+  traceLE(&p, RedisModule_Milliseconds(), 8);
+  if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+    fclose(fp);
+    return RedisModule_ReplyWithError(ctx, "ERR can't write the trace file");
+  }
+  if (Trace.ring == NULL) Trace.ring = RedisModule_Alloc(TRACE_RING_SIZE);
+  Trace.fp = fp;
+  Trace.head = Trace.tail = 0;
+  Trace.stopping = Trace.failed = 0;
+  Trace.file_bytes = TRACE_HEADER_LEN;
+  Trace.records = Trace.dropped = 0;
+  if (pthread_create(&Trace.thread, NULL, traceWriterMain, NULL) != 0) {
+    fclose(fp);
+    return RedisModule_ReplyWithError(ctx, "ERR can't start the trace thread");
+  }
+  if (Trace.path) RedisModule_Free(Trace.path);
+  Trace.path = RedisModule_Strdup(path);
+  Trace.active = 1;
+  RedisModule_Log(ctx, "notice", "tracing announces to %s", path);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* Waits for the thread to drain the ring, which is at most
+ * TRACE_RING_SIZE bytes away. */
+static int traceStop(RedisModuleCtx *ctx) {
+  if (!Trace.active) {
+    return RedisModule_ReplyWithError(ctx, "ERR no trace in progress");
+  }
+  pthread_mutex_lock(&Trace.lock);
+  Trace.stopping = 1;
+  pthread_cond_signal(&Trace.cond);
+  pthread_mutex_unlock(&Trace.lock);
+  pthread_join(Trace.thread, NULL);
+  int failed = fclose(Trace.fp) != 0 || Trace.failed;
+  Trace.fp = NULL;
+  Trace.active = 0;
+  RedisModule_Log(ctx, failed ? "warning" : "notice",
+                  "traced %lld announces to %s, %lld dropped%s", Trace.records,
+                  Trace.path, Trace.dropped,
+                  failed ? ", the file may be truncated" : "");
+  RedisModule_ReplyWithArray(ctx, 2);
+  RedisModule_ReplyWithLongLong(ctx, Trace.records);
+  RedisModule_ReplyWithLongLong(ctx, Trace.dropped);
+  return REDISMODULE_OK;
+}
+
+/* TRACKER.TRACE START <path>
+ * TRACKER.TRACE STOP -> [records, dropped] */
+int RedisTrackerTrace_RedisCommand(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv, int argc) {
+  if (argc < 2) return RedisModule_WrongArity(ctx);
+  const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+  if (!strcasecmp(sub, "start") && argc == 3) {
+    return traceStart(ctx, RedisModule_StringPtrLen(argv[2], NULL));
+  }
+  if (!strcasecmp(sub, "stop") && argc == 2) return traceStop(ctx);
+  return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+}
+
+/* ------------------------- Replay ------------------------- */
+
+typedef struct TraceReader {
+  const uint8_t *p;
+  const uint8_t *end;
+  int err;
+} TraceReader;
+
+static const uint8_t *traceTake(TraceReader *r, size_t len) {
+  if (r->err || (size_t)(r->end - r->p) < len) {
+    r->err = 1;
+    return NULL;
+  }
+  const uint8_t *p = r->p;
+  r->p += len;
+  return p;
+}
+
+static uint64_t traceReadLE(TraceReader *r, int len) {
+  const uint8_t *p = traceTake(r, len);
+  uint64_t v = 0;
+  if (p == NULL) return 0;
+  for (int i = 0; i < len; i++) v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+static void replayEnd(RedisModuleCtx *ctx, const char *status) {
+  int err = !strcmp(status, "err");
+  munmap(Replay.map, Replay.len);
+  Replay.map = NULL;
+  Replay.active = 0;
+  Replay.status = status;
+  RedisModule_Log(ctx, err ? "warning" : "notice",
+                  "replayed %lld announces from %s in %lld us, traced %lld us"
+                  "%s",
+                  Replay.records, Replay.path, Replay.elapsed_us,
+                  Replay.traced_elapsed_us,
+                  err ? ", stopped at a corrupt record or a missing db" : "");
+}
+
+/* Runs the next record of r, returns 0 if it is corrupt. */
+static int replayRecord(RedisModuleCtx *ctx, TraceReader *r) {
+  if (traceReadLE(r, 1) != TRACKER_TRACE_ANNOUNCE) return 0;
+  Replay.now = traceReadLE(r, 8);
+  int db = traceReadLE(r, 4);
+  Replay.traced_elapsed_us += traceReadLE(r, 4);
+  traceReadLE(r, 1); /* result */
+  TrackerAnnounce req = {0};
+  req.event = traceReadLE(r, 1);
+  uint8_t flags = traceReadLE(r, 1);
+  req.port = traceReadLE(r, 2);
+  req.numwant = traceReadLE(r, 4);
+  uint8_t v4[4], v6[16];
+  const uint8_t *addr;
+  if (flags & TRACKER_EFFECT_HAS_V4 && (addr = traceTake(r, 4))) {
+    req.v4 = memcpy(v4, addr, 4);
+  }
+  if (flags & TRACKER_EFFECT_HAS_V6 && (addr = traceTake(r, 16))) {
+    req.v6 = memcpy(v6, addr, 16);
+  }
+  if (flags & TRACKER_EFFECT_HAS_STATS) {
+    req.stats = 1;
+    req.uploaded = traceReadLE(r, 8);
+    req.downloaded = traceReadLE(r, 8);
+    req.left = traceReadLE(r, 8);
+  }
+  size_t ihlen = traceReadLE(r, 2);
+  const char *ih = (const char *)traceTake(r, ihlen);
+  size_t pklen = traceReadLE(r, 2);
+  const char *pk = (const char *)traceTake(r, pklen);
+  if (r->err) return 0;
+  if (!trackerTableEnabled() &&
+      RedisModule_SelectDb(ctx, db) != REDISMODULE_OK) {
+    return 0;
+  }
+  req.info_hash = RedisModule_CreateString(NULL, ih, ihlen);
+  req.passkey = RedisModule_CreateString(NULL, pk, pklen);
+  SeedersObj *o;
+  peer *self;
+  long long start = trackerMicroseconds();
+  trackerSlowlogBegin();
+  Replay.applying = 1;
+  trackerAnnounce(ctx, &req, &o, &self);
+  Replay.applying = 0;
+  trackerSlowlogEnd(req.info_hash, o, req.numwant);
+  Replay.elapsed_us += trackerMicroseconds() - start;
+  RedisModule_FreeString(NULL, req.info_hash);
+  RedisModule_FreeString(NULL, req.passkey);
+  Replay.records++;
+  return 1;
+}
+
+/* Timestamp of the record at Replay.pos. */
+static mstime_t replayNextTs(void) {
+  TraceReader r = {Replay.map + Replay.pos + 1, Replay.map + Replay.len, 0};
+  return traceReadLE(&r, 8);
+}
+
+static void replayTimerHandler(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  mstime_t start = RedisModule_Milliseconds();
+  TraceReader r = {Replay.map + Replay.pos, Replay.map + Replay.len, 0};
+  while (r.p < r.end) {
+    mstime_t now = RedisModule_Milliseconds();
+    if (Replay.maxspeed) {
+      if (now - start >= TRACE_REPLAY_SLICE_MS) break;
+    } else if (replayNextTs() - Replay.first_ts > now - Replay.started_at) {
+      break;
+    }
+    if (!replayRecord(ctx, &r)) {
+      replayEnd(ctx, "err");
+      return;
+    }
+    Replay.pos = r.p - Replay.map;
+  }
+  if (r.p == r.end) {
+    replayEnd(ctx, "ok");
+    return;
+  }
+  mstime_t wait = 0;
+  if (!Replay.maxspeed) {
+    wait = replayNextTs() - Replay.first_ts -
+           (RedisModule_Milliseconds() - Replay.started_at);
+    if (wait < 0) wait = 0;
+    if (wait > TRACE_REPLAY_MAX_WAIT_MS) wait = TRACE_REPLAY_MAX_WAIT_MS;
+  }
+  Replay.timer = RedisModule_CreateTimer(ctx, wait, replayTimerHandler, NULL);
+}
+
+static int replayStart(RedisModuleCtx *ctx, const char *path, int maxspeed) {
+  if (Replay.active) {
+    return RedisModule_ReplyWithError(ctx, "ERR a replay is in progress");
+  }
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1) close(fd);
+    return RedisModule_ReplyWithError(ctx, "ERR can't open the trace file");
+  }
+  size_t len = st.st_size;
+  uint8_t *map = MAP_FAILED;
+  if (len >= TRACE_HEADER_LEN) {
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED || memcmp(map, TRACKER_TRACE_MAGIC, 8) != 0) {
+    if (map != MAP_FAILED) munmap(map, len);
+    return RedisModule_ReplyWithError(ctx, "ERR not a tracker trace");
+  }
+  if (Replay.path) RedisModule_Free(Replay.path);
+  Replay.path = RedisModule_Strdup(path);
+  Replay.map = map;
+  Replay.len = len;
+  Replay.pos = TRACE_HEADER_LEN;
+  Replay.maxspeed = maxspeed;
+  Replay.records = Replay.elapsed_us = Replay.traced_elapsed_us = 0;
+  Replay.first_ts = len > TRACE_HEADER_LEN ? replayNextTs() : 0;
+  Replay.now = Replay.first_ts;
+  Replay.started_at = RedisModule_Milliseconds();
+  Replay.active = 1;
+  Replay.status = "running";
+  Replay.timer = RedisModule_CreateTimer(ctx, 0, replayTimerHandler, NULL);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* TRACKER.REPLAY START <path> [MAXSPEED]
+ * TRACKER.REPLAY STOP
+ * Progress and timings are in INFO. */
+int RedisTrackerReplay_RedisCommand(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc) {
+  if (argc < 2) return RedisModule_WrongArity(ctx);
+  const char *sub = RedisModule_StringPtrLen(argv[1], NULL);
+  if (!strcasecmp(sub, "start") && (argc == 3 || argc == 4)) {
+    int maxspeed = 0;
+    if (argc == 4) {
+      if (strcasecmp(RedisModule_StringPtrLen(argv[3], NULL), "maxspeed")) {
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+      }
+      maxspeed = 1;
+    }
+    return replayStart(ctx, RedisModule_StringPtrLen(argv[2], NULL),
+                       maxspeed);
+  }
+  if (!strcasecmp(sub, "stop") && argc == 2) {
+    if (!Replay.active) {
+      return RedisModule_ReplyWithError(ctx, "ERR no replay in progress");
+    }
+    RedisModule_StopTimer(ctx, Replay.timer, NULL);
+    replayEnd(ctx, "stopped");
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+  return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+}
+
+void trackerTraceInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "trace");
+  RedisModule_InfoAddFieldLongLong(ctx, "trace_in_progress", Trace.active);
+  RedisModule_InfoAddFieldLongLong(ctx, "trace_records", Trace.records);
+  RedisModule_InfoAddFieldLongLong(ctx, "trace_dropped", Trace.dropped);
+  pthread_mutex_lock(&Trace.lock);
+  uint64_t bytes = Trace.file_bytes, pending = Trace.head - Trace.tail;
+  pthread_mutex_unlock(&Trace.lock);
+  RedisModule_InfoAddFieldULongLong(ctx, "trace_bytes", bytes);
+  RedisModule_InfoAddFieldULongLong(ctx, "trace_pending_bytes", pending);
+  RedisModule_InfoAddFieldCString(ctx, "replay_status",
+                                  (char *)Replay.status);
+  RedisModule_InfoAddFieldLongLong(ctx, "replay_records", Replay.records);
+  RedisModule_InfoAddFieldLongLong(ctx, "replay_elapsed_us",
+                                   Replay.elapsed_us);
+  RedisModule_InfoAddFieldLongLong(ctx, "replay_traced_elapsed_us",
+                                   Replay.traced_elapsed_us);
+}
@@ -0,0 +1,686 @@
+#define _GNU_SOURCE /* recvmmsg / sendmmsg */
+#define REDISMODULE_EXPERIMENTAL_API
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "redistracker.h"
+
+/* ========================== UDP tracker protocol =========================*/
+/* BEP 15 datagrams are handed over verbatim by a UDP relay: ANNOUNCE.UDP
+ * decodes the request, runs announces through the same core as ANNOUNCE and
+ * replies with the datagram to send back, so the relay never needs to look
+ * inside a packet. Connection ids are a SipHash-2-4 MAC of the source address
+ * and a time window rather than state, which lets any node answer any packet.
+ * SipHash is a PRF, so ids handed out say nothing about the key and can't be
+ * forged for other sources; the key itself never leaves the module. */
+#define UDP_PROTOCOL_ID 0x41727101980ULL
+#define UDP_ACTION_CONNECT 0
+#define UDP_ACTION_ANNOUNCE 1
+#define UDP_ACTION_SCRAPE 2
+#define UDP_ACTION_ERROR 3
+#define UDP_CONNECT_LEN 16
+#define UDP_ANNOUNCE_LEN 98
+#define UDP_SCRAPE_MAX 74
+/* Responses are built into buffers of this size, numwant is capped to fit. */
+#define UDP_RESPONSE_MAX 8192
+/* A connection id is accepted during its own window and the next one. */
+#define UDP_CONNID_WINDOW_MS 60000
+
+typedef struct UdpSource {
+  uint8_t addr[16]; /* IPv4 sources are stored as ::ffff:a.b.c.d */
+  int v6;
+  uint16_t port;
+} UdpSource;
+
+typedef struct UdpKey {
+  uint64_t k0, k1;
+} UdpKey;
+
+static UdpKey UdpRandomKey;
+
+/* Counters exported in INFO, only touched with the GIL held. */
+static struct {
+  long long received;
+  long long sent;
+  long long per_sec; /* received over the last full second, listener only */
+} UdpStats;
+
+static inline uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static inline uint64_t get64(const uint8_t *p) {
+  return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline void put64(uint8_t *p, uint64_t v) {
+  put32(p, v >> 32);
+  put32(p + 4, (uint32_t)v);
+}
+
+#define SIPROUND                                                               \
+  do {                                                                        \
+    v0 += v1;                                                                 \
+    v1 = rotl64(v1, 13) ^ v0;                                                 \
+    v0 = rotl64(v0, 32);                                                      \
+    v2 += v3;                                                                 \
+    v3 = rotl64(v3, 16) ^ v2;                                                 \
+    v0 += v3;                                                                 \
+    v3 = rotl64(v3, 21) ^ v0;                                                 \
+    v2 += v1;                                                                 \
+    v1 = rotl64(v1, 17) ^ v2;                                                 \
+    v2 = rotl64(v2, 32);                                                      \
+  } while (0)
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t getle64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) v = v << 8 | p[i];
+  return v;
+}
+
+/* SipHash-2-4 as specified by Aumasson and Bernstein. */
+static uint64_t siphash24(const uint8_t *in, size_t len, const UdpKey *key) {
+  uint64_t v0 = 0x736f6d6570736575ULL ^ key->k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ key->k1;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ key->k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ key->k1;
+  const uint8_t *end = in + (len & ~(size_t)7);
+  for (; in != end; in += 8) {
+    uint64_t m = getle64(in);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+  uint64_t b = (uint64_t)len << 56;
+  for (int i = (int)(len & 7) - 1; i >= 0; i--) b |= (uint64_t)in[i] << (8 * i);
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* A configured udp-secret lets several nodes accept each other's ids; it is
+ * stretched to the 128 bit SipHash key under two fixed keys. */
+static UdpKey udpKey(void) {
+  const char *secret = tracker_config.udp_secret;
+  if (secret[0] == '\0') return UdpRandomKey;
+  static const UdpKey lo = {0, 0}, hi = {0, 1};
+  UdpKey key = {
+      siphash24((const uint8_t *)secret, strlen(secret), &lo),
+      siphash24((const uint8_t *)secret, strlen(secret), &hi),
+  };
+  return key;
+}
+
+static uint64_t udpConnectionId(const UdpKey *key, UdpSource *src,
+                                uint64_t window) {
+  uint8_t buf[16 + 2 + 8];
+  memcpy(buf, src->addr, 16);
+  buf[16] = src->port >> 8;
+  buf[17] = src->port & 0xff;
+  put64(buf + 18, window);
+  return siphash24(buf, sizeof(buf), key);
+}
+
+static int udpConnectionValid(const UdpKey *key, UdpSource *src,
+                              uint64_t id) {
+  uint64_t window = RedisModule_Milliseconds() / UDP_CONNID_WINDOW_MS;
+  return id == udpConnectionId(key, src, window) ||
+         id == udpConnectionId(key, src, window - 1);
+}
+
+/* Writes the swarm key of a raw info_hash into key and returns its length:
+ * the 20 bytes as they are with infohash-normalize on, else the 40 lower case
+ * hex digits HTTP frontends announce with, so both land in the same swarm. */
+static size_t udpInfohashKey(const uint8_t *hash, int normalize,
+                             char key[40]) {
+  static const char hex[] = "0123456789abcdef";
+  if (normalize) {
+    memcpy(key, hash, 20);
+    return 20;
+  }
+  for (int i = 0; i < 20; i++) {
+    key[2 * i] = hex[hash[i] >> 4];
+    key[2 * i + 1] = hex[hash[i] & 0xf];
+  }
+  return 40;
+}
+
+static size_t udpError(uint8_t *out, uint32_t txid, const char *msg) {
+  /* Admission errors are written for RESP clients. */
+  if (!strncmp(msg, "ERR ", 4)) msg += 4;
+  size_t len = strlen(msg);
+  put32(out, UDP_ACTION_ERROR);
+  put32(out + 4, txid);
+  memcpy(out + 8, msg, len);
+  return 8 + len;
+}
+
+/* Private trackers hand out announce URLs like udp://host/<passkey>/announce
+ * or udp://host/announce?passkey=<passkey>, which clients send back in BEP 41
+ * URLData options after the announce. Returns NULL if there is no passkey. */
+static RedisModuleString *udpPasskey(RedisModuleCtx *ctx, const uint8_t *opt,
+                                     size_t len) {
+  char url[256];
+  size_t urllen = 0;
+  for (size_t i = 0; i < len;) {
+    if (opt[i] == 0) break; /* EndOfOptions */
+    if (opt[i] == 1) {      /* NOP */
+      i++;
+      continue;
+    }
+    if (opt[i] != 2 || i + 1 >= len || i + 2 + opt[i + 1] > len) break;
+    size_t n = opt[i + 1];
+    if (urllen + n > sizeof(url)) n = sizeof(url) - urllen;
+    memcpy(url + urllen, opt + i + 2, n);
+    urllen += n;
+    i += 2 + opt[i + 1];
+  }
+
+  const char *query = memchr(url, '?', urllen);
+  if (query) {
+    const char *end = url + urllen;
+    for (const char *s = query + 1; s < end;) {
+      const char *amp = memchr(s, '&', end - s);
+      if (amp == NULL) amp = end;
+      if (amp - s > 8 && !memcmp(s, "passkey=", 8)) {
+        return RedisModule_CreateString(ctx, s + 8, amp - s - 8);
+      }
+      s = amp + 1;
+    }
+    urllen = query - url;
+  }
+  for (size_t i = 0; i < urllen;) {
+    while (i < urllen && url[i] == '/') i++;
+    size_t start = i;
+    while (i < urllen && url[i] != '/') i++;
+    size_t n = i - start;
+    if (n && !(n == 8 && !memcmp(url + start, "announce", 8))) {
+      return RedisModule_CreateString(ctx, url + start, n);
+    }
+  }
+  return NULL;
+}
+
+static size_t udpConnect(UdpSource *src, uint32_t txid, uint8_t *out) {
+  put32(out, UDP_ACTION_CONNECT);
+  put32(out + 4, txid);
+  UdpKey key = udpKey();
+  put64(out + 8, udpConnectionId(&key, src, RedisModule_Milliseconds() /
+                                                UDP_CONNID_WINDOW_MS));
+  return 16;
+}
+
+static size_t udpAnnounce(RedisModuleCtx *ctx, UdpSource *src, uint32_t txid,
+                          const uint8_t *pkt, size_t len, uint8_t *out) {
+  static const int events[] = {TRACKER_EVENT_NONE, TRACKER_EVENT_COMPLETED,
+                               TRACKER_EVENT_STARTED, TRACKER_EVENT_STOPPED};
+  if (len < UDP_ANNOUNCE_LEN) {
+    return udpError(out, txid, "malformed announce");
+  }
+  uint32_t event = get32(pkt + 80);
+  if (event > 3) return udpError(out, txid, "invalid announce event");
+  trackerSlowlogBegin();
+
+  char key[40];
+  size_t keylen =
+      udpInfohashKey(pkt + 16, tracker_config.infohash_normalize, key);
+  RedisModuleString *info_hash = RedisModule_CreateString(ctx, key, keylen);
+  RedisModuleString *passkey =
+      udpPasskey(ctx, pkt + UDP_ANNOUNCE_LEN, len - UDP_ANNOUNCE_LEN);
+  if (passkey == NULL) {
+    /* Public swarm: the peer_id is the only identity we get. */
+    passkey = RedisModule_CreateString(ctx, (const char *)pkt + 36, 20);
+  }
+  const char *reject = trackerAdmit(info_hash, passkey);
+  if (reject) return udpError(out, txid, reject);
+
+  int32_t numwant = (int32_t)get32(pkt + 92);
+  uint16_t port = pkt[96] << 8 | pkt[97];
+  TrackerAnnounce req = {info_hash,
+                         passkey,
+                         src->v6 ? NULL : src->addr + 12,
+                         src->v6 ? src->addr : NULL,
+                         port ? port : src->port,
+                         events[event],
+                         1,
+                         get64(pkt + 72),
+                         get64(pkt + 56),
+                         get64(pkt + 64),
+                         numwant < 0 ? tracker_config.numwant_default
+                                     : numwant,
+                         0};
+  /* Peers of the family the request came in with, 6 or 18 bytes each. */
+  size_t peerlen = src->v6 ? 18 : 6;
+  long long fit = (UDP_RESPONSE_MAX - 20) / peerlen;
+  if (req.numwant > tracker_config.numwant_max) {
+    req.numwant = tracker_config.numwant_max;
+  }
+  if (req.numwant > fit) req.numwant = fit;
+
+  SeedersObj *o;
+  peer *self;
+  int res = trackerAnnounce(ctx, &req, &o, &self);
+  size_t outlen;
+  if (res == TRACKER_ANNOUNCE_WRONGTYPE) {
+    outlen = udpError(out, txid, "torrent unavailable");
+  } else if (res == TRACKER_ANNOUNCE_REFUSED) {
+    outlen = udpError(out, txid, "tracker under memory pressure");
+  } else if (res == TRACKER_ANNOUNCE_RATE_LIMITED &&
+             tracker_config.rate_limit_error) {
+    outlen = udpError(out, txid, "announce too frequent");
+  } else {
+    size_t n = samplePeerFamily(o, self, req.numwant, out + 20, src->v6);
+    put32(out, UDP_ACTION_ANNOUNCE);
+    put32(out + 4, txid);
+    int complete = o->d[0]->complete + o->d[1]->complete;
+    int incomplete = o->d[0]->incomplete + o->d[1]->incomplete;
+    trackerShardCounts(o, &complete, &incomplete);
+    put32(out + 8, (uint32_t)trackerAnnounceInterval(o));
+    put32(out + 12, incomplete);
+    put32(out + 16, complete);
+    outlen = 20 + n * peerlen;
+  }
+  trackerSlowlogEnd(req.info_hash, o, req.numwant);
+  return outlen;
+}
+
+/* Reads the swarm snapshots instead of the keys when ctx is NULL, which the
+ * caller must then bracket with trackerSnapshotEnter / Leave. */
+static size_t udpScrape(RedisModuleCtx *ctx, int normalize, uint32_t txid,
+                        const uint8_t *pkt, size_t len, uint8_t *out) {
+  size_t count = (len - 16) / 20;
+  if (count == 0) return udpError(out, txid, "malformed scrape");
+  if (count > UDP_SCRAPE_MAX) count = UDP_SCRAPE_MAX;
+  put32(out, UDP_ACTION_SCRAPE);
+  put32(out + 4, txid);
+  uint8_t *p = out + 8;
+  for (size_t i = 0; i < count; i++) {
+    char key[40];
+    size_t keylen = udpInfohashKey(pkt + 16 + i * 20, normalize, key);
+    uint32_t complete = 0, incomplete = 0, downloaded = 0;
+    if (ctx) {
+      RedisModuleString *info_hash =
+          RedisModule_CreateString(ctx, key, keylen);
+      SeedersObj *o = trackerLookupSwarm(ctx, info_hash);
+      if (o) {
+        complete = o->d[0]->complete + o->d[1]->complete;
+        incomplete = o->d[0]->incomplete + o->d[1]->incomplete;
+        downloaded = o->downloaded;
+      }
+    } else {
+      const SwarmSnapshot *s = trackerSnapshotGet(key, keylen);
+      if (s) {
+        complete = s->complete;
+        incomplete = s->incomplete;
+        downloaded = s->downloaded;
+      }
+    }
+    put32(p, complete);
+    put32(p + 4, downloaded);
+    put32(p + 8, incomplete);
+    p += 12;
+  }
+  return p - out;
+}
+
+/* Handles one request datagram and writes the response datagram into out,
+ * which holds UDP_RESPONSE_MAX bytes. Returns its length, or 0 when the
+ * packet is too short to even carry a transaction id and must be dropped. */
+static size_t udpHandlePacket(RedisModuleCtx *ctx, UdpSource *src,
+                              const uint8_t *pkt, size_t len, uint8_t *out) {
+  UdpStats.received++;
+  if (len < UDP_CONNECT_LEN) return 0;
+  UdpStats.sent++;
+  uint64_t connid = get64(pkt);
+  uint32_t action = get32(pkt + 8);
+  uint32_t txid = get32(pkt + 12);
+  if (action == UDP_ACTION_CONNECT) {
+    if (connid != UDP_PROTOCOL_ID) {
+      return udpError(out, txid, "invalid protocol id");
+    }
+    return udpConnect(src, txid, out);
+  }
+  UdpKey key = udpKey();
+  if (!udpConnectionValid(&key, src, connid)) {
+    return udpError(out, txid, "invalid connection id");
+  }
+  if (action == UDP_ACTION_ANNOUNCE) {
+    return udpAnnounce(ctx, src, txid, pkt, len, out);
+  }
+  if (action == UDP_ACTION_SCRAPE) {
+    return udpScrape(ctx, tracker_config.infohash_normalize, txid, pkt, len,
+                     out);
+  }
+  return udpError(out, txid, "unknown action");
+}
+
+/* ANNOUNCE.UDP <packet> <source ip> <source port>
+ *
+ * Takes a BEP 15 connect, announce or scrape request as received, and
+ * replies with the response datagram, BEP 15 errors included. Info hashes
+ * are keyed as ANNOUNCE would key them, raw with infohash-normalize and as
+ * lower case hex otherwise. Only packets too short to carry a
+ * transaction id get a Redis error, the relay should drop those.
+ *
+ * The keys it opens are inside the packet, where neither Cluster nor ACL
+ * key patterns can see them, so it declares none and is refused in cluster
+ * mode: relays to a cluster have to parse the packet and call ANNOUNCE. */
+int RedisTrackerAnnounceUdp_RedisCommand(RedisModuleCtx *ctx,
+                                         RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx);
+  if (argc != 4) return RedisModule_WrongArity(ctx);
+  if (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER) {
+    return RedisModule_ReplyWithError(
+        ctx, "ERR announce.udp can't be used in cluster mode");
+  }
+  UdpSource src;
+  uint8_t *v4 = src.addr + 12, *v6 = src.addr;
+  long long port;
+  memset(src.addr, 0, 10);
+  src.addr[10] = src.addr[11] = 0xff;
+  if (parseIPV4(argv[2], src.addr + 12, &v4) == REDISMODULE_OK && v4) {
+    src.v6 = 0;
+  } else if (parseIPV6(argv[2], src.addr, &v6) == REDISMODULE_OK && v6) {
+    src.v6 = 1;
+  } else {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid source address");
+  }
+  if (RedisModule_StringToLongLong(argv[3], &port) == REDISMODULE_ERR ||
+      port < 0 || port > 65535) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid source port");
+  }
+  src.port = (uint16_t)port;
+
+  size_t len;
+  const uint8_t *pkt =
+      (const uint8_t *)RedisModule_StringPtrLen(argv[1], &len);
+  uint8_t *out = RedisModule_Alloc(UDP_RESPONSE_MAX);
+  size_t outlen = udpHandlePacket(ctx, &src, pkt, len, out);
+  if (outlen) {
+    RedisModule_ReplyWithStringBuffer(ctx, (char *)out, outlen);
+  } else {
+    RedisModule_ReplyWithError(ctx, "ERR short packet");
+  }
+  RedisModule_Free(out);
+  return REDISMODULE_OK;
+}
+
+/* ========================== UDP listener ==================================*/
+/* With udp-listen set at load time the module serves BEP 15 itself: one
+ * thread receives datagrams in batches with recvmmsg, takes the GIL once
+ * per batch to answer all of them, and sends the responses with sendmmsg
+ * once the GIL is released. When swarm snapshots are published, scrapes are
+ * answered from them without the GIL, and a batch of scrapes only never
+ * takes it. */
+#define UDP_BATCH 64
+#define UDP_PACKET_MAX 2048
+#define UDP_IDLE_WAKEUP_MS 100
+
+static int UdpFd = -1;
+static pthread_t UdpThread;
+/* Only there to bind the per batch contexts to the module, which timers set
+ * up while replicating need. */
+static RedisModuleCtx *UdpModuleCtx;
+/* Config the listener needs without the GIL, refreshed each time it holds
+ * it. */
+static UdpKey UdpListenerKey;
+static int UdpListenerSnapshots;
+static int UdpListenerNormalize;
+
+static void udpSourceFromSockaddr(UdpSource *src,
+                                  struct sockaddr_storage *sa) {
+  if (sa->ss_family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+    memset(src->addr, 0, 10);
+    src->addr[10] = src->addr[11] = 0xff;
+    memcpy(src->addr + 12, &sin->sin_addr, 4);
+    src->port = ntohs(sin->sin_port);
+    src->v6 = 0;
+  } else {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+    memcpy(src->addr, &sin6->sin6_addr, 16);
+    src->port = ntohs(sin6->sin6_port);
+    /* IPv4 clients of a dual stack socket. */
+    src->v6 = !IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr);
+  }
+}
+
+/* Parses "<ipv4>:<port>" or "[<ipv6>]:<port>". */
+static int udpParseListen(const char *spec, struct sockaddr_storage *sa,
+                          socklen_t *salen) {
+  char host[64];
+  const char *colon = strrchr(spec, ':');
+  if (colon == NULL || colon == spec || (size_t)(colon - spec) >= sizeof(host))
+    return REDISMODULE_ERR;
+  char *end;
+  long port = strtol(colon + 1, &end, 10);
+  if (*end || port <= 0 || port > 65535) return REDISMODULE_ERR;
+  memset(sa, 0, sizeof(*sa));
+  if (spec[0] == '[' && colon[-1] == ']') {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+    memcpy(host, spec + 1, colon - spec - 2);
+    host[colon - spec - 2] = '\0';
+    if (inet_pton(AF_INET6, host, &sin6->sin6_addr) != 1) {
+      return REDISMODULE_ERR;
+    }
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    *salen = sizeof(*sin6);
+  } else {
+    struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    if (inet_pton(AF_INET, host, &sin->sin_addr) != 1) return REDISMODULE_ERR;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    *salen = sizeof(*sin);
+  }
+  return REDISMODULE_OK;
+}
+
+/* Answers a scrape from the swarm snapshots. Returns the response length,
+ * or 0 when the packet is something else and needs the GIL. */
+static size_t udpScrapeLockFree(int reader, UdpSource *src,
+                                const uint8_t *pkt, size_t len,
+                                uint8_t *out) {
+  if (len < UDP_CONNECT_LEN || get32(pkt + 8) != UDP_ACTION_SCRAPE) return 0;
+  uint32_t txid = get32(pkt + 12);
+  if (!udpConnectionValid(&UdpListenerKey, src, get64(pkt))) {
+    return udpError(out, txid, "invalid connection id");
+  }
+  trackerSnapshotEnter(reader);
+  size_t outlen =
+      udpScrape(NULL, UdpListenerNormalize, txid, pkt, len, out);
+  trackerSnapshotLeave(reader);
+  return outlen;
+}
+
+static void *udpListenerMain(void *arg) {
+  REDISMODULE_NOT_USED(arg);
+  struct mmsghdr *in = RedisModule_Calloc(UDP_BATCH, sizeof(*in));
+  struct mmsghdr *out = RedisModule_Calloc(UDP_BATCH, sizeof(*out));
+  struct iovec *iniov = RedisModule_Calloc(UDP_BATCH, sizeof(*iniov));
+  struct iovec *outiov = RedisModule_Calloc(UDP_BATCH, sizeof(*outiov));
+  struct sockaddr_storage *addrs =
+      RedisModule_Calloc(UDP_BATCH, sizeof(*addrs));
+  size_t *outlen = RedisModule_Calloc(UDP_BATCH, sizeof(*outlen));
+  uint8_t *inbuf = RedisModule_Alloc(UDP_BATCH * UDP_PACKET_MAX);
+  uint8_t *outbuf = RedisModule_Alloc(UDP_BATCH * UDP_RESPONSE_MAX);
+  int reader = trackerSnapshotReader();
+  mstime_t sampled_at = RedisModule_Milliseconds();
+  long long sampled = 0, received = 0;
+  long long lockfree = 0; /* answered since we last held the GIL */
+
+  for (;;) {
+    for (int i = 0; i < UDP_BATCH; i++) {
+      iniov[i].iov_base = inbuf + i * UDP_PACKET_MAX;
+      iniov[i].iov_len = UDP_PACKET_MAX;
+      in[i].msg_hdr.msg_iov = &iniov[i];
+      in[i].msg_hdr.msg_iovlen = 1;
+      in[i].msg_hdr.msg_name = &addrs[i];
+      in[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+    int n = recvmmsg(UdpFd, in, UDP_BATCH, MSG_WAITFORONE, NULL);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      break;
+    }
+    if (n < 0) n = 0;
+    received += n;
+    mstime_t now = RedisModule_Milliseconds();
+    int sample = now - sampled_at >= 1000;
+    int locked = 0;
+    for (int i = 0; i < n; i++) {
+      UdpSource src;
+      udpSourceFromSockaddr(&src, &addrs[i]);
+      outlen[i] = 0;
+      if (reader != -1 && UdpListenerSnapshots) {
+        outlen[i] = udpScrapeLockFree(reader, &src, iniov[i].iov_base,
+                                      in[i].msg_len,
+                                      outbuf + i * UDP_RESPONSE_MAX);
+        if (outlen[i]) {
+          lockfree++;
+          continue;
+        }
+      }
+      locked++;
+    }
+
+    if (locked || sample) {
+      RedisModuleCtx *ctx =
+          RedisModule_GetDetachedThreadSafeContext(UdpModuleCtx);
+      RedisModule_ThreadSafeContextLock(ctx);
+      RedisModule_AutoMemory(ctx);
+      for (int i = 0; i < n; i++) {
+        if (outlen[i]) continue;
+        UdpSource src;
+        udpSourceFromSockaddr(&src, &addrs[i]);
+        outlen[i] = udpHandlePacket(ctx, &src, iniov[i].iov_base,
+                                    in[i].msg_len,
+                                    outbuf + i * UDP_RESPONSE_MAX);
+      }
+      UdpStats.received += lockfree;
+      UdpStats.sent += lockfree;
+      lockfree = 0;
+      if (sample) {
+        UdpStats.per_sec = (received - sampled) * 1000 / (now - sampled_at);
+        sampled = received;
+        sampled_at = now;
+      }
+      UdpListenerKey = udpKey();
+      UdpListenerSnapshots = tracker_config.snapshot_ms > 0;
+      UdpListenerNormalize = tracker_config.infohash_normalize;
+      RedisModule_ThreadSafeContextUnlock(ctx);
+      RedisModule_FreeThreadSafeContext(ctx);
+    }
+
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+      if (outlen[i] == 0) continue;
+      outiov[m].iov_base = outbuf + i * UDP_RESPONSE_MAX;
+      outiov[m].iov_len = outlen[i];
+      memset(&out[m].msg_hdr, 0, sizeof(out[m].msg_hdr));
+      out[m].msg_hdr.msg_iov = &outiov[m];
+      out[m].msg_hdr.msg_iovlen = 1;
+      out[m].msg_hdr.msg_name = &addrs[i];
+      out[m].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+      m++;
+    }
+    for (int sent = 0; sent < m;) {
+      int k = sendmmsg(UdpFd, out + sent, m - sent, 0);
+      if (k <= 0) break; /* clients retry, BEP 15 is lossy anyway */
+      sent += k;
+    }
+  }
+  RedisModule_Free(in);
+  RedisModule_Free(out);
+  RedisModule_Free(iniov);
+  RedisModule_Free(outiov);
+  RedisModule_Free(addrs);
+  RedisModule_Free(outlen);
+  RedisModule_Free(inbuf);
+  RedisModule_Free(outbuf);
+  return NULL;
+}
+
+static int udpStartListener(RedisModuleCtx *ctx, const char *spec) {
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  if (udpParseListen(spec, &sa, &salen) == REDISMODULE_ERR) {
+    RedisModule_Log(ctx, "warning", "invalid udp-listen '%s'", spec);
+    return REDISMODULE_ERR;
+  }
+  int fd = socket(sa.ss_family, SOCK_DGRAM, 0);
+  if (fd == -1) goto err;
+  if (sa.ss_family == AF_INET6) {
+    int no = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+  }
+  /* Wake up now and then to keep the packets/sec sample fresh. */
+  struct timeval tv = {0, UDP_IDLE_WAKEUP_MS * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (bind(fd, (struct sockaddr *)&sa, salen) == -1) goto err;
+  UdpFd = fd;
+  UdpModuleCtx = RedisModule_GetDetachedThreadSafeContext(ctx);
+  UdpListenerKey = udpKey();
+  UdpListenerSnapshots = tracker_config.snapshot_ms > 0;
+  UdpListenerNormalize = tracker_config.infohash_normalize;
+  if (pthread_create(&UdpThread, NULL, udpListenerMain, NULL) != 0) {
+    UdpFd = -1;
+    goto err;
+  }
+  RedisModule_Log(ctx, "notice", "serving BEP 15 on udp %s", spec);
+  return REDISMODULE_OK;
+
+err:
+  RedisModule_Log(ctx, "warning", "can't listen on udp %s: %s", spec,
+                  strerror(errno));
+  if (fd != -1) close(fd);
+  return REDISMODULE_ERR;
+}
+
+int trackerUdpInit(RedisModuleCtx *ctx) {
+  RedisModule_GetRandomBytes((unsigned char *)&UdpRandomKey,
+                             sizeof(UdpRandomKey));
+  if (tracker_config.udp_listen[0] == '\0') return REDISMODULE_OK;
+  return udpStartListener(ctx, tracker_config.udp_listen);
+}
+
+/* Whether the caller is the listener, which runs announces with the GIL. */
+int trackerUdpListenerThread(void) {
+  return UdpFd != -1 && pthread_equal(pthread_self(), UdpThread);
+}
+
+void trackerUdpInfo(RedisModuleInfoCtx *ctx) {
+  RedisModule_InfoAddSection(ctx, "udp");
+  RedisModule_InfoAddFieldLongLong(ctx, "udp_listener", UdpFd != -1);
+  RedisModule_InfoAddFieldLongLong(ctx, "udp_packets_received",
+                                   UdpStats.received);
+  RedisModule_InfoAddFieldLongLong(ctx, "udp_packets_sent", UdpStats.sent);
+  RedisModule_InfoAddFieldLongLong(ctx, "udp_packets_per_sec",
+                                   UdpStats.per_sec);
+}
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""BEP 15 round trip against the module's own UDP listener.
+
+Starts a redis-server loading the module with udp-listen on the loopback,
+then plays two peers through connect, announce and scrape and checks what
+the tracker hands back. Needs nothing but the standard library:
+
+    python3 tests/udp_loopback.py [--redis-server PATH] [--module PATH]
+"""
+
+import argparse
+import os
+import random
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+PROTOCOL_ID = 0x41727101980
+CONNECT, ANNOUNCE, SCRAPE, ERROR = 0, 1, 2, 3
+NONE, COMPLETED, STARTED, STOPPED = 0, 1, 2, 3
+
+
+def free_port(kind):
+    s = socket.socket(socket.AF_INET, kind)
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+class Peer:
+    """One client socket, so one source address and connection id."""
+
+    def __init__(self, tracker, peer_id):
+        self.tracker = tracker
+        self.peer_id = peer_id
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", 0))
+        self.sock.settimeout(1)
+        self.connid = None
+
+    def request(self, action, body, connid=None):
+        txid = random.getrandbits(32)
+        if connid is None:
+            connid = self.connid
+        self.sock.sendto(struct.pack(">QII", connid, action, txid) + body,
+                         self.tracker)
+        resp = self.sock.recv(8192)
+        got_action, got_txid = struct.unpack_from(">II", resp)
+        assert got_txid == txid, "transaction id not echoed"
+        return got_action, resp[8:]
+
+    def connect(self):
+        action, body = self.request(CONNECT, b"", PROTOCOL_ID)
+        assert action == CONNECT, body
+        (self.connid,) = struct.unpack(">Q", body)
+
+    def announce(self, info_hash, event, left, port, numwant=50):
+        body = struct.pack(">20s20sQQQIIIiH", info_hash, self.peer_id, 0,
+                           left, 0, event, 0, 0, numwant, port)
+        action, body = self.request(ANNOUNCE, body)
+        assert action == ANNOUNCE, body
+        interval, leechers, seeders = struct.unpack_from(">III", body)
+        peers = [(socket.inet_ntoa(body[i:i + 4]),
+                  struct.unpack_from(">H", body, i + 4)[0])
+                 for i in range(12, len(body), 6)]
+        return interval, leechers, seeders, peers
+
+    def scrape(self, *info_hashes):
+        action, body = self.request(SCRAPE, b"".join(info_hashes))
+        assert action == SCRAPE, body
+        return [struct.unpack_from(">III", body, i)
+                for i in range(0, len(body), 12)]
+
+
+def wait_for_listener(tracker, deadline):
+    probe = Peer(tracker, b"-PROBE-" + b"0" * 13)
+    probe.sock.settimeout(0.1)
+    while time.time() < deadline:
+        try:
+            probe.connect()
+            return
+        except (socket.timeout, ConnectionRefusedError):
+            pass
+    raise RuntimeError("UDP listener did not come up")
+
+
+def run(tracker):
+    info_hash = os.urandom(20)
+    seeder = Peer(tracker, b"-SEED01-" + os.urandom(12))
+    leecher = Peer(tracker, b"-LEECH1-" + os.urandom(12))
+
+    action, body = seeder.request(CONNECT, b"", 0)
+    assert action == ERROR, "connect without the protocol id was accepted"
+    action, body = seeder.request(ANNOUNCE, b"\0" * 82, 1)
+    assert action == ERROR and body == b"invalid connection id", body
+
+    seeder.connect()
+    leecher.connect()
+    assert seeder.connid != leecher.connid, "connection ids not per source"
+
+    interval, leechers, seeders, peers = seeder.announce(
+        info_hash, STARTED, 0, 6881)
+    assert interval > 0 and (leechers, seeders) == (0, 1), (leechers, seeders)
+    assert peers == [], "announcing peer got itself back"
+
+    interval, leechers, seeders, peers = leecher.announce(
+        info_hash, STARTED, 1000, 6882)
+    assert (leechers, seeders) == (1, 1), (leechers, seeders)
+    assert peers == [("127.0.0.1", 6881)], peers
+
+    _, _, _, peers = seeder.announce(info_hash, NONE, 0, 6881)
+    assert peers == [("127.0.0.1", 6882)], peers
+
+    unknown = os.urandom(20)
+    assert seeder.scrape(info_hash, unknown) == [(1, 0, 1), (0, 0, 0)]
+
+    leecher.announce(info_hash, COMPLETED, 0, 6882)
+    assert seeder.scrape(info_hash) == [(2, 1, 0)]
+
+    _, _, _, peers = leecher.announce(info_hash, STOPPED, 0, 6882)
+    assert peers == [], "stopped peer got a peer list"
+    assert seeder.scrape(info_hash) == [(1, 1, 0)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--redis-server", default="redis-server")
+    parser.add_argument("--module", default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), "..", "redistracker.so"))
+    args = parser.parse_args()
+
+    tcp_port = free_port(socket.SOCK_STREAM)
+    udp_port = free_port(socket.SOCK_DGRAM)
+    server = subprocess.Popen(
+        [args.redis_server, "--port", str(tcp_port), "--save", "",
+         "--appendonly", "no", "--loadmodule",
+         os.path.abspath(args.module), "udp-listen",
+         "127.0.0.1:%d" % udp_port],
+        stdout=subprocess.DEVNULL)
+    tracker = ("127.0.0.1", udp_port)
+    try:
+        wait_for_listener(tracker, time.time() + 10)
+        run(tracker)
+    finally:
+        server.terminate()
+        server.wait()
+    print("udp loopback ok")
+
+
+if __name__ == "__main__":
+    sys.exit(main())